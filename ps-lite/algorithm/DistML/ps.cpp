@@ -5,8 +5,11 @@
 #include"psf/client/client.h"
 #include "ps/ps.h"
 #include<cassert>
+#include<memory>
 #include<psf/psf/PSFunc.h>
 #include<psf/server/serverMatrixMeta.h>
+#include<psf/server/PartitionBalancer.h>
+#include<psf/server/MatrixMetaService.h>
 #include<dmlc/logging.h>
 #include<ps/internal/postoffice.h>
 #include"ps/base.h"
@@ -18,18 +21,35 @@ namespace py = pybind11;
 
 
 
+// moves partitions between servers, only on the scheduler
+std::unique_ptr<PartitionBalancer> balancer;
+
+// allocates the matrices, only on the scheduler
+std::unique_ptr<MatrixMetaService> metaService;
+
 void init(){
 
  Start(0);
 
 // if(!IsWorker()) assert(false);
 
+ if(IsScheduler()) metaService.reset(new MatrixMetaService());
+
+ int interval = GetEnv("PS_BALANCE_INTERVAL", 0);
+ if(IsScheduler() && interval>0){
+   balancer.reset(new PartitionBalancer(0,0));
+   balancer->Start(interval);
+ }
+
 }
 
 
 void finalize(){
 
+  // no partition is moved while nodes are exiting
+  balancer.reset();
   Finalize(0,true);
+  metaService.reset();
 
 }
 
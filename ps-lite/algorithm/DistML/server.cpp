@@ -5,6 +5,7 @@
 #include"psf/client/client.h"
 #include "ps/ps.h"
 #include<cassert>
+#include<memory>
 #include<psf/psf/PSFunc.h>
 #include<psf/server/serverMatrixMeta.h>
 #include<dmlc/logging.h>
@@ -25,8 +26,15 @@ void startServer() {
   }
 
   auto server = new KVServer<float>(0);
-  server->set_request_handle(KVServerMLHandle<float>());
-  RegisterExitCallback([server](){ delete server; });
+  // the handle also reports statistics and migrates partitions for the scheduler
+  auto handle = std::make_shared<KVServerMLHandle<float>>();
+  server->set_request_handle([handle](const KVMeta& req_meta, const KVPairs<float>& req_data, KVServer<float>* server){
+      (*handle)(req_meta, req_data, server);
+    });
+  server->SimpleApp::set_request_handle([handle, server](const SimpleData& req, SimpleApp* app){
+      handle->Control(req, server);
+    });
+  RegisterExitCallback([server, handle](){ handle->StopSync(); delete server; });
 
 }
 
@@ -5,6 +5,9 @@
 #include"psf/client/client.h"
 #include "ps/ps.h"
 #include<cassert>
+#include<atomic>
+#include<memory>
+#include<thread>
 #include<psf/psf/PSFunc.h>
 #include<psf/server/serverMatrixMeta.h>
 #include<dmlc/logging.h>
@@ -94,8 +97,40 @@ ReqMatrixMeta GenReqMatrixMeta(psfType type, int matrixId){
 
 Client<float> client(0,0);
 
+const std::thread::id mainThread = std::this_thread::get_id();
+
+// the client of the calling thread. the thread importing this module uses client,
+// every other thread gets its own client (own customer, so own completion routing)
+// which shares the matrix routing and the connections of client.
+Client<float>& localClient(){
+
+    if(std::this_thread::get_id()==mainThread) return client;
+
+    static std::atomic<int> nextCustomerId(1);
+    thread_local std::unique_ptr<Client<float>> local;
+    if(!local) local.reset(new Client<float>(0,nextCustomerId++,client));
+    return *local;
+
+}
+
 void barrier_worker();
 
+// create a rows x cols matrix called name, or get the one some worker created, returns its id
+int createMatrix(const std::string& name, int rows, long cols){
+
+    py::gil_scoped_release release;
+    return localClient().CreateMatrix(name,rows,cols);
+
+}
+
+// the priority of the pushes and pulls of a matrix, higher goes first with the p3 van,
+// e.g. -layer so the gradients of the first layers go out first
+void setPriority(int matrixId, int priority){
+
+    localClient().SetPriority(matrixId,priority);
+
+}
+
 void  pushAll(py::array_t<float>& input, int matrixId){
 
     py::buffer_info buf = input.request();
@@ -111,8 +146,14 @@ void  pushAll(py::array_t<float>& input, int matrixId){
     // for(int i = 0 ; i < buf.shape[0];i++ ) vals.push_back(ptr[i]);
     // Client<float> client(0,0);
     
-    client.Wait(client.Push(vals,meta));
-    barrier_worker();
+    Client<float>& c = localClient();
+    {
+      // let other python threads run while waiting
+      py::gil_scoped_release release;
+      c.Wait(c.Push(vals,meta));
+    }
+    // the barrier counts one request per worker process, so only the main thread joins it
+    if(&c==&client) barrier_worker();
    // return ts;
 }
 
@@ -123,9 +164,13 @@ py::array_t<float> pullAll(int matrixId, py::array_t<float>& param){
 
  std::vector<float> ret;
  std::vector<int> lens;
- client.Wait(client.Pull(ret,lens,meta));
- 
- barrier_worker();
+ Client<float>& c = localClient();
+ {
+   py::gil_scoped_release release;
+   c.Wait(c.Pull(ret,lens,meta));
+ }
+
+ if(&c==&client) barrier_worker();
  auto output = py::array_t<float>(param.request().size);
 
 // std::cout<<"output size"<<output.request().shape.size()<< output.request().shape[0]<<std::endl;
@@ -143,12 +188,20 @@ py::array_t<float> pullAll(int matrixId, py::array_t<float>& param){
 
 void wait(int timestamp){
 
-    client.Wait(timestamp);
+    py::gil_scoped_release release;
+    localClient().Wait(timestamp);
+
+}
+
+bool test(int timestamp){
+
+    return localClient().Test(timestamp);
 
 }
 
 void barrier_worker(){
- 
+
+  py::gil_scoped_release release;
   Postoffice::Get()->Barrier(0,kWorkerGroup);
 
 }
@@ -159,9 +212,12 @@ void barrier_worker(){
 PYBIND11_MODULE(worker, m) {
 
     m.doc() = "worker module"; // optional module docstring
+    m.def("createMatrix",&createMatrix,"create a matrix, or get its id if it exists");
+    m.def("setPriority",&setPriority,"set the priority of the requests of a matrix");
     m.def("pushAll",&pushAll,"a function pushAll to ps");
     m.def("pullAll",&pullAll,"a function pullAll from ps");
     m.def("wait",&wait,"wait timestamp");
+    m.def("test",&test,"test whether timestamp finished");
     m.def("barrier_worker",&barrier_worker,"barrier");
 
 
@@ -0,0 +1,177 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_FUTURE_H_
+#define PS_FUTURE_H_
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "ps/internal/utils.h"
+namespace ps {
+
+/**
+ * \brief a lightweight handle to the completion of an asynchronous request
+ *
+ * A future is cheap to copy; all copies observe the same completion. It is
+ * completed by the owning \ref Promise, which for push and pull requests is
+ * done by the receiving thread of the customer when the last response
+ * arrives. Continuations registered by \ref Then therefore run on the
+ * customer thread, unless the future is already ready when \ref Then is
+ * called, in which case the continuation runs immediately in the caller.
+ *
+ * Sample usage: overlap the pull for the next minibatch with compute
+ * \code
+ *   Future next = client.PullAsync(vals, lens, req);
+ *   Compute(minibatch);
+ *   next.Wait();
+ * \endcode
+ */
+class Future {
+ public:
+  /** \brief the continuation type */
+  using Continuation = std::function<void()>;
+
+  /** \brief an empty future, which is always ready */
+  Future() {}
+
+  /**
+   * \brief whether or not the request has finished. non-blocking, threadsafe
+   */
+  bool Test() const {
+    if (!state_) return true;
+    std::lock_guard<std::mutex> lk(state_->mu);
+    return state_->ready;
+  }
+
+  /**
+   * \brief block until the request has finished. threadsafe
+   */
+  void Wait() const {
+    if (!state_) return;
+    std::unique_lock<std::mutex> lk(state_->mu);
+    state_->cond.wait(lk, [this] { return state_->ready; });
+  }
+
+  /**
+   * \brief register a continuation which is called once the request finished
+   *
+   * \param cb the continuation
+   * \return a future which is ready after \a cb has returned
+   */
+  Future Then(const Continuation& cb) const;
+
+  /** \brief the timestamp of the underlying request, -1 if unknown */
+  int timestamp() const { return state_ ? state_->timestamp : -1; }
+
+ private:
+  friend class Promise;
+  /** \brief the state shared by a promise and its futures */
+  struct State {
+    std::mutex mu;
+    std::condition_variable cond;
+    bool ready = false;
+    int timestamp = -1;
+    std::vector<Continuation> continuations;
+  };
+  explicit Future(const std::shared_ptr<State>& state) : state_(state) {}
+  std::shared_ptr<State> state_;
+};
+
+/**
+ * \brief the producer side of a \ref Future
+ */
+class Promise {
+ public:
+  /** \brief create a pending promise */
+  Promise() : state_(std::make_shared<Future::State>()) {}
+
+  /** \brief return a future sharing the state of this promise */
+  Future GetFuture() const { return Future(state_); }
+
+  /** \brief record the timestamp of the request this promise tracks */
+  void set_timestamp(int timestamp) const {
+    std::lock_guard<std::mutex> lk(state_->mu);
+    state_->timestamp = timestamp;
+  }
+
+  /**
+   * \brief mark the request as finished and run the registered continuations.
+   * setting an already ready promise is a no-op. threadsafe
+   */
+  void Set() const {
+    std::vector<Future::Continuation> conts;
+    {
+      std::lock_guard<std::mutex> lk(state_->mu);
+      if (state_->ready) return;
+      state_->ready = true;
+      conts.swap(state_->continuations);
+    }
+    state_->cond.notify_all();
+    for (const auto& cb : conts) cb();
+  }
+
+ private:
+  std::shared_ptr<Future::State> state_;
+};
+
+inline Future Future::Then(const Continuation& cb) const {
+  Promise next;
+  auto run = [cb, next]() {
+    if (cb) cb();
+    next.Set();
+  };
+  if (state_) {
+    std::unique_lock<std::mutex> lk(state_->mu);
+    if (!state_->ready) {
+      state_->continuations.push_back(run);
+      return next.GetFuture();
+    }
+  }
+  run();
+  return next.GetFuture();
+}
+
+/**
+ * \brief return a future which is ready once all of \a futures are ready
+ */
+inline Future WhenAll(const std::vector<Future>& futures) {
+  Promise all;
+  if (futures.empty()) {
+    all.Set();
+    return all.GetFuture();
+  }
+  auto remain = std::make_shared<std::pair<std::mutex, size_t>>();
+  remain->second = futures.size();
+  for (const auto& f : futures) {
+    f.Then([all, remain]() {
+        bool done;
+        {
+          std::lock_guard<std::mutex> lk(remain->first);
+          done = --remain->second == 0;
+        }
+        if (done) all.Set();
+      });
+  }
+  return all.GetFuture();
+}
+
+/**
+ * \brief return a future which is ready once any of \a futures is ready
+ */
+inline Future WhenAny(const std::vector<Future>& futures) {
+  Promise any;
+  if (futures.empty()) {
+    any.Set();
+    return any.GetFuture();
+  }
+  for (const auto& f : futures) {
+    f.Then([any]() { any.Set(); });
+  }
+  return any.GetFuture();
+}
+
+}  // namespace ps
+#endif  // PS_FUTURE_H_
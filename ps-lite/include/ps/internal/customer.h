@@ -18,7 +18,13 @@ namespace ps {
 /**
  * \brief The object for communication.
  *
- * As a sender, a customer tracks the responses for each request sent.
+ * As a sender, a customer tracks the responses for each request sent. Requests
+ * are tracked in a fixed-capacity ring of slots, so memory stays constant no
+ * matter how many requests are issued. The slot of timestamp `t` is `t %
+ * capacity`, and a slot is only recycled once its previous request has
+ * finished. If the window of in-flight requests is full, \ref NewRequest
+ * blocks until the oldest one finishes. The capacity is set by the
+ * environment variable `PS_REQUEST_WINDOW`.
  *
  * It has its own receiving thread which is able to process any message received
  * from a remote node with `msg.meta.customer_id` equal to this customer's id
@@ -58,6 +64,12 @@ class Customer {
 
   /**
    * \brief get a timestamp for a new request. threadsafe
+   *
+   * Blocks while the slot for the new request is still used by an unfinished
+   * request. Never call it from the receiving thread of this customer (e.g. in
+   * a callback) when the window may be full, since that thread is the one
+   * finishing requests.
+   *
    * \param recver the receive node id of this request
    * \return the timestamp of this request
    */
@@ -66,14 +78,23 @@ class Customer {
 
   /**
    * \brief wait until the request is finished. threadsafe
+   *
+   * Only waiters of this request are woken up. Returns immediately if the
+   * request's slot has already been recycled, since that implies it finished.
    * \param timestamp the timestamp of the request
    */
   void WaitRequest(int timestamp);
 
   /**
-   * \brief return the number of responses received for the request. threadsafe
+   * \brief return whether the request is finished, without blocking. threadsafe
    * \param timestamp the timestamp of the request
    */
+  bool TestRequest(int timestamp);
+
+  /**
+   * \brief return the number of responses received for the request. threadsafe
+   * \param timestamp the timestamp of the request, which must be in flight
+   */
   int NumResponse(int timestamp);
 
   /**
@@ -103,9 +124,34 @@ class Customer {
   ThreadsafePQueue recv_queue_;
   std::unique_ptr<std::thread> recv_thread_;
 
-  std::mutex tracker_mu_;
-  std::condition_variable tracker_cond_;
-  std::vector<std::pair<int, int>> tracker_;
+  /**
+   * \brief the tracking state of one in-flight request
+   */
+  struct RequestSlot {
+    std::mutex mu;
+    std::condition_variable cond;
+    /** \brief the timestamp currently owning this slot, -1 if never used */
+    int timestamp = -1;
+    /** \brief the number of expected responses */
+    int expected = 0;
+    /** \brief the number of received responses */
+    int received = 0;
+    bool done() const { return received >= expected; }
+  };
+
+  /**
+   * \brief return the slot of timestamp
+   */
+  inline RequestSlot& slot(int timestamp) {
+    return slots_[timestamp % window_];
+  }
+
+  /** \brief serializes slot claims so timestamps are handed out in order */
+  std::mutex submit_mu_;
+  /** \brief the next timestamp, wraps at a multiple of \ref window_ */
+  int next_timestamp_ = 0;
+  int window_;
+  std::unique_ptr<RequestSlot[]> slots_;
 
   DISALLOW_COPY_AND_ASSIGN(Customer);
 };
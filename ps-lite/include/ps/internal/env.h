@@ -18,7 +18,8 @@ class Environment {
    * \brief return the singleton instance
    */
   static inline Environment* Get() {
-    return _GetSharedRef(nullptr).get();
+    Environment* env = Current();
+    return env ? env : _GetSharedRef(nullptr).get();
   }
   /**
    * \brief return a shared ptr of the singleton instance
@@ -37,6 +38,25 @@ class Environment {
     return env;
   }
 
+  /**
+   * \brief create an instance for one of the nodes running in this process
+   *
+   * Its envs take precedence over the ones of the singleton. It is returned by
+   * \ref Get in the threads it is made current in by \ref SetCurrent.
+   */
+  static inline std::shared_ptr<Environment> Create(
+      const std::unordered_map<std::string, std::string>& envs) {
+    std::shared_ptr<Environment> env(new Environment(&envs));
+    env->parent_ = _GetSharedRef();
+    return env;
+  }
+  /**
+   * \brief make env the instance of the calling thread, nullptr for the singleton
+   */
+  static inline void SetCurrent(Environment* env) {
+    Current() = env;
+  }
+
   /**
    * \brief find the env value.
    *  User-defined env vars first. If not found, check system's environment
@@ -45,7 +65,8 @@ class Environment {
    */
   const char* find(const char* k) {
     std::string key(k);
-    return kvs.find(key) == kvs.end() ? getenv(k) : kvs[key].c_str();
+    if (kvs.find(key) != kvs.end()) return kvs[key].c_str();
+    return parent_ ? parent_->find(k) : getenv(k);
   }
 
  private:
@@ -59,7 +80,14 @@ class Environment {
     return inst_ptr;
   }
 
+  static inline Environment*& Current() {
+    static thread_local Environment* env = nullptr;
+    return env;
+  }
+
   std::unordered_map<std::string, std::string> kvs;
+  /** \brief the singleton, for an instance made by \ref Create */
+  std::shared_ptr<Environment> parent_;
 };
 
 }  // namespace ps
@@ -0,0 +1,60 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_HUGE_PAGE_ALLOCATOR_H_
+#define PS_INTERNAL_HUGE_PAGE_ALLOCATOR_H_
+#include <sys/mman.h>
+#include <cstddef>
+#include <new>
+#include "ps/internal/utils.h"
+namespace ps {
+
+/**
+ * \brief an allocator backing large arrays by transparent huge pages
+ *
+ * If PS_HUGE_PAGES is set, arrays of at least 2MB are mapped directly and
+ * advised to use huge pages, which saves TLB misses on large parameter blocks.
+ * Smaller arrays, and all arrays otherwise, come from operator new.
+ */
+template<typename T> class HugePageAllocator {
+ public:
+  typedef T value_type;
+
+  HugePageAllocator() { }
+  template<typename U> HugePageAllocator(const HugePageAllocator<U>&) { }
+
+  T* allocate(size_t n) {
+    size_t bytes = n * sizeof(T);
+    if (!Huge(bytes)) return static_cast<T*>(::operator new(bytes));
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+    madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t n) {
+    size_t bytes = n * sizeof(T);
+    if (!Huge(bytes)) {
+      ::operator delete(p);
+    } else {
+      munmap(p, bytes);
+    }
+  }
+
+ private:
+  static bool Huge(size_t bytes) {
+    static const bool enabled = GetEnv("PS_HUGE_PAGES", 0) != 0;
+    return enabled && bytes >= (2 << 20);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+
+}  // namespace ps
+#endif  // PS_INTERNAL_HUGE_PAGE_ALLOCATOR_H_
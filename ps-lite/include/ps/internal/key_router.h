@@ -0,0 +1,279 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_KEY_ROUTER_H_
+#define PS_INTERNAL_KEY_ROUTER_H_
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ps/base.h"
+#include "ps/range.h"
+namespace ps {
+
+/**
+ * \brief maps keys to server ranks
+ *
+ * A router is immutable once published by \ref Postoffice. Updating the
+ * routing at runtime means publishing a new router, whose version is larger
+ * than the previous one.
+ */
+class KeyRouter {
+ public:
+  /**
+   * \brief create a router by name
+   * \param type `range` or `hash`
+   * \param num_servers the number of servers
+   */
+  static KeyRouter* Create(const std::string& type, int num_servers);
+
+  explicit KeyRouter(int num_servers) : num_servers_(num_servers) {
+    CHECK_GT(num_servers, 0);
+  }
+  virtual ~KeyRouter() {}
+
+  /**
+   * \brief return the rank of the server maintaining key
+   */
+  virtual int ServerRank(Key key) const = 0;
+
+  /**
+   * \brief return the rank of a server to read key from, which is either the
+   * server maintaining it or one of its read replicas
+   */
+  virtual int ReadServerRank(Key key) const { return ServerRank(key); }
+
+  /**
+   * \brief return the id-th key routed to server rank
+   *
+   * The result is deterministic, so every worker derives the same key.
+   */
+  virtual Key KeyOfServer(int rank, Key id) const = 0;
+
+  /**
+   * \brief whether the keys of every server form one range, with server i's
+   * range before server i+1's. Then sorted keys can be sliced without copying.
+   */
+  virtual bool contiguous() const = 0;
+
+  /**
+   * \brief whether the router decides the server of a key itself, so a
+   * partitioner should place a block on the server of its key instead of
+   * asking \ref KeyOfServer for a key on the server it picked
+   */
+  virtual bool places_keys() const { return false; }
+
+  /** \brief the number of servers */
+  int num_servers() const { return num_servers_; }
+
+  /** \brief the routing version */
+  int version() const { return version_; }
+
+  /** \brief set the routing version, called by \ref Postoffice */
+  void set_version(int version) { version_ = version; }
+
+ protected:
+  int num_servers_;
+  int version_ = 0;
+};
+
+/**
+ * \brief split [0, kMaxKey) evenly into one range per server
+ */
+class RangeKeyRouter : public KeyRouter {
+ public:
+  explicit RangeKeyRouter(int num_servers)
+      : KeyRouter(num_servers), width_(kMaxKey / num_servers) { }
+
+  int ServerRank(Key key) const override {
+    return static_cast<int>(std::min<Key>(key / width_, num_servers_ - 1));
+  }
+
+  Key KeyOfServer(int rank, Key id) const override {
+    CHECK_LT(id, width_);
+    return width_ * rank + id;
+  }
+
+  bool contiguous() const override { return true; }
+
+  /** \brief the key range of server rank */
+  Range range(int rank) const {
+    return Range(width_ * rank, width_ * (rank + 1));
+  }
+
+ private:
+  Key width_;
+};
+
+/**
+ * \brief consistent hashing with virtual nodes
+ *
+ * Every server owns \a num_vnodes points on a 64-bit hash ring, and a key goes
+ * to the owner of the first point at or after its hash. Adding or removing a
+ * server only moves the keys next to its points. Lookups are O(1) on average
+ * through a table indexed by the top bits of the hash.
+ */
+class ConsistentHashKeyRouter : public KeyRouter {
+ public:
+  ConsistentHashKeyRouter(int num_servers, int num_vnodes)
+      : KeyRouter(num_servers) {
+    CHECK_GT(num_vnodes, 0);
+    std::vector<int> ranks(num_servers);
+    for (int i = 0; i < num_servers; ++i) ranks[i] = i;
+    Build(ranks, num_vnodes);
+  }
+
+  /**
+   * \brief a ring over a subset of servers, e.g. without a failed one
+   * \param ranks the server ranks on the ring
+   */
+  ConsistentHashKeyRouter(int num_servers, const std::vector<int>& ranks,
+                          int num_vnodes)
+      : KeyRouter(num_servers) {
+    CHECK(!ranks.empty());
+    CHECK_GT(num_vnodes, 0);
+    Build(ranks, num_vnodes);
+  }
+
+  int ServerRank(Key key) const override {
+    uint64_t h = Hash(key);
+    size_t i = bucket_[h >> shift_];
+    while (i < ring_.size() && ring_[i].first < h) ++i;
+    return ring_[i == ring_.size() ? 0 : i].second;
+  }
+
+  Key KeyOfServer(int rank, Key id) const override {
+    CHECK(rank >= 0 && rank < num_servers_ && on_ring_[rank])
+        << "server " << rank << " is not on the ring";
+    // probe a deterministic sequence; expected num_servers probes
+    Key key = Hash(id ^ 0x5bd1e9955bd1e995ULL);
+    while (ServerRank(key) != rank) ++key;
+    return key;
+  }
+
+  bool contiguous() const override { return false; }
+
+  bool places_keys() const override { return true; }
+
+  /** \brief the 64-bit mixer (splitmix64 finalizer) used for keys and points */
+  static inline uint64_t Hash(uint64_t x) {
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+ private:
+  void Build(const std::vector<int>& ranks, int num_vnodes) {
+    on_ring_.assign(num_servers_, false);
+    for (int r : ranks) {
+      CHECK_GE(r, 0);
+      CHECK_LT(r, num_servers_);
+      on_ring_[r] = true;
+      for (int v = 0; v < num_vnodes; ++v) {
+        uint64_t point = Hash((static_cast<uint64_t>(r) << 32) | v);
+        ring_.push_back(std::make_pair(point, r));
+      }
+    }
+    std::sort(ring_.begin(), ring_.end());
+    // about two buckets per point
+    int bits = 1;
+    while ((1ULL << bits) < 2 * ring_.size() && bits < 24) ++bits;
+    shift_ = 64 - bits;
+    bucket_.resize(1ULL << bits);
+    size_t i = 0;
+    for (size_t b = 0; b < bucket_.size(); ++b) {
+      uint64_t lower = static_cast<uint64_t>(b) << shift_;
+      while (i < ring_.size() && ring_[i].first < lower) ++i;
+      bucket_[b] = i;
+    }
+  }
+
+  /** \brief (point, server rank), sorted by point */
+  std::vector<std::pair<uint64_t, int>> ring_;
+  /** \brief bucket_[b] is the first point with hash >= b << shift_ */
+  std::vector<size_t> bucket_;
+  int shift_;
+  /** \brief whether server rank has points on the ring */
+  std::vector<bool> on_ring_;
+};
+
+/**
+ * \brief a router sending some keys to other servers than its base router
+ *
+ * Used after keys are migrated between servers or replicated for reading at
+ * runtime. The keys of a server are derived by the base router, so they never
+ * change by migration.
+ */
+class MigratedKeyRouter : public KeyRouter {
+ public:
+  /**
+   * \param base the router of the keys not moved
+   * \param moved the new server rank of every moved key
+   * \param replicas the ranks of the servers having a read replica of a key
+   */
+  MigratedKeyRouter(const std::shared_ptr<const KeyRouter>& base,
+                    const std::unordered_map<Key, int>& moved,
+                    const std::unordered_map<Key, std::vector<int>>& replicas = {})
+      : KeyRouter(base->num_servers()), base_(base), moved_(moved), replicas_(replicas) {
+    for (const auto& m : moved_) CHECK_LT(m.second, num_servers_);
+    for (const auto& r : replicas_) {
+      for (int rank : r.second) CHECK_LT(rank, num_servers_);
+    }
+  }
+
+  int ServerRank(Key key) const override {
+    if (!moved_.empty()) {
+      auto it = moved_.find(key);
+      if (it != moved_.end()) return it->second;
+    }
+    return base_->ServerRank(key);
+  }
+
+  int ReadServerRank(Key key) const override {
+    if (!replicas_.empty()) {
+      auto it = replicas_.find(key);
+      if (it != replicas_.end()) {
+        // spread the reads of a thread over the primary and the replicas
+        static thread_local unsigned next = 0;
+        size_t i = next++ % (it->second.size() + 1);
+        if (i) return it->second[i - 1];
+      }
+    }
+    return ServerRank(key);
+  }
+
+  Key KeyOfServer(int rank, Key id) const override {
+    return base_->KeyOfServer(rank, id);
+  }
+
+  bool contiguous() const override {
+    return moved_.empty() && replicas_.empty() && base_->contiguous();
+  }
+
+  bool places_keys() const override { return base_->places_keys(); }
+
+  /** \brief the router of the keys not moved */
+  const std::shared_ptr<const KeyRouter>& base() const { return base_; }
+
+ private:
+  std::shared_ptr<const KeyRouter> base_;
+  std::unordered_map<Key, int> moved_;
+  std::unordered_map<Key, std::vector<int>> replicas_;
+};
+
+inline KeyRouter* KeyRouter::Create(const std::string& type, int num_servers) {
+  if (type == "range") {
+    return new RangeKeyRouter(num_servers);
+  } else if (type == "hash") {
+    return new ConsistentHashKeyRouter(
+        num_servers, GetEnv("PS_KEY_ROUTER_VNODES", 128));
+  } else {
+    LOG(FATAL) << "Unsupported key router type: " << type;
+    return nullptr;
+  }
+}
+
+}  // namespace ps
+#endif  // PS_INTERNAL_KEY_ROUTER_H_
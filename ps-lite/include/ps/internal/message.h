@@ -131,7 +131,6 @@ struct Control {
       ss << " }";
     }
     if (cmd == BARRIER) ss << ", barrier_group=" << barrier_group;
-    if (cmd == ACK) ss << ", msg_sig=" << msg_sig;
     return ss.str();
   }
   /** \brief all commands */
@@ -142,8 +141,6 @@ struct Control {
   std::vector<Node> node;
   /** \brief the node group for a barrier, such as kWorkerGroup */
   int barrier_group;
-  /** message signature */
-  uint64_t msg_sig;
 };
 /**
  * \brief meta info of a message
@@ -165,6 +162,8 @@ struct Meta {
     ss <<  " => " << recver;
     ss << ". Meta: request=" << request;
     if (timestamp != kEmpty) ss << ", timestamp=" << timestamp;
+    if (seq) ss << ", seq=" << seq;
+    if (ack) ss << ", ack=" << ack;
     if (!control.empty()) {
       ss << ", control={ " << control.DebugString() << " }";
     } else {
@@ -212,6 +211,25 @@ struct Meta {
   int data_size = 0;
   /** \brief message priority */
   int priority = 0;
+  /** \brief the id given by the sender to the message this is a slice of, or
+   * kEmpty if not sliced */
+  int slice_id = kEmpty;
+  /** \brief the index of this slice */
+  int slice_index = 0;
+  /** \brief the number of slices of the message */
+  int num_slices = 0;
+  /** \brief the data of the message the first data of this slice is a part of */
+  int slice_frame = 0;
+  /** \brief the codec data[i] is compressed with, empty if none is */
+  std::vector<uint8_t> codec;
+  /** \brief the sequence number from the sender to the receiver with
+   * PS_RESEND, 0 if none */
+  uint32_t seq = 0;
+  /** \brief the messages from the receiver to the sender before this
+   * sequence number are received, 0 if unknown */
+  uint32_t ack = 0;
+  /** \brief bit i: the message of sequence number ack + i is received */
+  uint64_t sack = 0;
 };
 /**
  * \brief messages that communicated amaong nodes.
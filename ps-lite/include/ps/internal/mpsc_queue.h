@@ -0,0 +1,113 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_MPSC_QUEUE_H_
+#define PS_INTERNAL_MPSC_QUEUE_H_
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <utility>
+#include "ps/base.h"
+namespace ps {
+
+/**
+ * \brief multi-producer single-consumer queue with lock-free push
+ *
+ * Producers never take a lock unless the consumer is sleeping, so many
+ * application threads can submit concurrently without serializing on a mutex.
+ * Only one thread may pop.
+ *
+ * Every value pushed takes a node from Alloc, which has to be stateless, as
+ * the producers allocate concurrently. A pool such as SlabAllocator of
+ * src/slab.h keeps the queue off the heap.
+ */
+template<typename T, typename Alloc = std::allocator<T>> class MPSCQueue {
+ public:
+  MPSCQueue() : head_(NewNode()), tail_(head_.load()) { }
+  ~MPSCQueue() {
+    T tmp;
+    while (TryPop(&tmp)) { }
+    DeleteNode(tail_);
+  }
+
+  /**
+   * \brief push an value into the end. lock-free, threadsafe.
+   * \param new_value the value
+   */
+  void Push(T new_value) {
+    Node* node = NewNode();
+    node->value = std::move(new_value);
+    Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_seq_cst)) {
+      // the lock only orders us with a consumer about to wait
+      std::lock_guard<std::mutex> lk(mu_);
+      cond_.notify_one();
+    }
+  }
+
+  /**
+   * \brief pop an element from the beginning if any. consumer only
+   * \param value the poped value
+   * \return false if the queue is empty
+   */
+  bool TryPop(T* value) {
+    Node* next = tail_->next.load(std::memory_order_acquire);
+    if (next == nullptr) return false;
+    *value = std::move(next->value);
+    DeleteNode(tail_);
+    tail_ = next;
+    return true;
+  }
+
+  /**
+   * \brief wait until pop an element from the beginning. consumer only
+   * \param value the poped value
+   */
+  void WaitAndPop(T* value) {
+    for (int i = 0; i < kSpin; ++i) {
+      if (TryPop(value)) return;
+    }
+    std::unique_lock<std::mutex> lk(mu_);
+    sleeping_.store(true, std::memory_order_seq_cst);
+    cond_.wait(lk, [this] {
+        return tail_->next.load(std::memory_order_seq_cst) != nullptr;
+      });
+    sleeping_.store(false, std::memory_order_relaxed);
+    lk.unlock();
+    CHECK(TryPop(value));
+  }
+
+ private:
+  struct Node {
+    std::atomic<Node*> next{nullptr};
+    T value;
+  };
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Node> NodeAlloc;
+
+  static Node* NewNode() {
+    NodeAlloc alloc;
+    return new (alloc.allocate(1)) Node();
+  }
+
+  static void DeleteNode(Node* node) {
+    node->~Node();
+    NodeAlloc alloc;
+    alloc.deallocate(node, 1);
+  }
+
+  static const int kSpin = 128;
+  /** \brief the most recently pushed node, touched by producers */
+  std::atomic<Node*> head_;
+  /** \brief the already consumed stub node, touched by the consumer */
+  Node* tail_;
+  std::atomic<bool> sleeping_{false};
+  std::mutex mu_;
+  std::condition_variable cond_;
+  DISALLOW_COPY_AND_ASSIGN(MPSCQueue);
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_MPSC_QUEUE_H_
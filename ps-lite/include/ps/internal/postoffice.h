@@ -12,6 +12,7 @@
 #include "ps/internal/env.h"
 #include "ps/internal/customer.h"
 #include "ps/internal/van.h"
+#include "ps/internal/key_router.h"
 //#include "psf/comm/MLClient.h"
 //#include "psf/comm/MLClientFactory.h"
 
@@ -26,8 +27,42 @@ class Postoffice {
    * \brief return the singleton object
    */
   static Postoffice* Get() {
+    Postoffice* po = Current();
+    if (po) return po;
     static Postoffice e; return &e;
   }
+  /**
+   * \brief create a postoffice for one more node in this process
+   *
+   * Together with the `local` van, a scheduler, servers and workers run as
+   * threads of one process, each thread calling \ref SetCurrent with its own
+   * postoffice before \ref Start. The envs, such as `DMLC_ROLE`, take
+   * precedence over the ones of the process for this node. Delete it after
+   * \ref Finalize.
+   */
+  static Postoffice* Create(const std::unordered_map<std::string, std::string>& envs) {
+    return new Postoffice(Environment::Create(envs));
+  }
+  /**
+   * \brief make po the postoffice returned by \ref Get in the calling thread,
+   * nullptr for the singleton
+   */
+  static void SetCurrent(Postoffice* po) {
+    Current() = po;
+    Environment::SetCurrent(po ? po->env_ref_.get() : nullptr);
+  }
+  /**
+   * \brief wrap the function of a thread of this node, so the thread uses the
+   * postoffice of the calling one
+   */
+  static std::function<void()> Inherit(const std::function<void()>& func) {
+    Postoffice* po = Current();
+    return [po, func]() {
+      SetCurrent(po);
+      func();
+    };
+  }
+  ~Postoffice() { delete van_; }
   /** \brief get the van */
   Van* van() { return van_; }
   /**
@@ -80,6 +115,22 @@ class Postoffice {
    */
   const std::vector<Range>& GetServerKeyRanges();
 
+  /**
+   * \brief return the current key router. threadsafe
+   *
+   * Created on first use according to the environment variable
+   * `PS_KEY_ROUTER` (`range` in default, or `hash`). The returned snapshot stays
+   * valid even if the router is updated concurrently.
+   */
+  std::shared_ptr<const KeyRouter> GetKeyRouter();
+
+  /**
+   * \brief replace the key router at runtime. threadsafe
+   *
+   * The new router gets the version of the current one plus one.
+   */
+  void UpdateKeyRouter(const std::shared_ptr<KeyRouter>& router);
+
 
 
 
@@ -151,9 +202,20 @@ class Postoffice {
   bool is_recovery() const { return van_->my_node().is_recovery; }
   /**
    * \brief barrier
+   *
+   * The nodes report to their parents in a tree of PS_BARRIER_FANOUT children
+   * per node rooted at the scheduler, and are released down the same tree.
+   * Barriers of different groups may run at the same time.
    * \param node_id the barrier group id
    */
   void Barrier(int customer_id, int node_group);
+  /**
+   * \brief define a node group of the given node ids for \ref Barrier
+   *
+   * Call it with the same arguments on every node, after \ref Start and before
+   * any barrier of the group. The id must not be taken by a node or a group.
+   */
+  void AddNodeGroup(int group, const std::vector<int>& ids);
   /**
    * \brief process a control message, called by van
    * \param the received message
@@ -176,22 +238,33 @@ class Postoffice {
 
  private:
   Postoffice();
-  ~Postoffice() { delete van_; }
+  explicit Postoffice(std::shared_ptr<Environment> env) : env_ref_(env) {}
+
+  static Postoffice*& Current() {
+    static thread_local Postoffice* po = nullptr;
+    return po;
+  }
 
   void InitEnvironment();
 
-  Van* van_;
+  Van* van_ = nullptr;
   //MLClientFactory* ml_;
 
   mutable std::mutex mu_;
+  /** \brief notified when a customer is added */
+  mutable std::condition_variable customers_cond_;
   // app_id -> (customer_id -> customer pointer)
   std::unordered_map<int, std::unordered_map<int, Customer*>> customers_;
   std::unordered_map<int, std::vector<int>> node_ids_;
   std::mutex server_key_ranges_mu_;
   std::vector<Range> server_key_ranges_;
+  std::mutex key_router_mu_;
+  std::shared_ptr<const KeyRouter> key_router_;
   bool is_worker_, is_server_, is_scheduler_;
   int num_servers_, num_workers_;
   std::unordered_map<int, std::unordered_map<int, bool> > barrier_done_;
+  /** \brief customer id -> the group of its last barrier */
+  std::unordered_map<int, int> barrier_group_;
   int verbose_;
   std::mutex barrier_mu_;
   std::condition_variable barrier_cond_;
@@ -13,7 +13,8 @@
 namespace ps {
 
 /**
- * \brief thread-safe queue allowing push and waited pop
+ * \brief thread-safe queue allowing push and waited pop, the message of the
+ * highest priority first, and the messages of the same priority in order
  */
 class ThreadsafePQueue {
  public:
@@ -26,7 +27,7 @@ class ThreadsafePQueue {
    */
   void Push(Message new_value) {
     mu_.lock();
-    queue_.push(std::move(new_value));
+    queue_.push(std::make_pair(std::move(new_value), next_++));
     mu_.unlock();
     cond_.notify_all();
   }
@@ -38,19 +39,25 @@ class ThreadsafePQueue {
   void WaitAndPop(Message* value) {
     std::unique_lock<std::mutex> lk(mu_);
     cond_.wait(lk, [this]{return !queue_.empty();});
-    *value = std::move(queue_.top());
+    *value = std::move(const_cast<Entry&>(queue_.top()).first);
     queue_.pop();
   }
 
  private:
+  /** \brief a message and its push order */
+  typedef std::pair<Message, uint64_t> Entry;
   class Compare {
    public:
-    bool operator()(const Message &l, const Message &r) {
-      return l.meta.priority <= r.meta.priority;
+    bool operator()(const Entry &l, const Entry &r) {
+      if (l.first.meta.priority != r.first.meta.priority) {
+        return l.first.meta.priority < r.first.meta.priority;
+      }
+      return l.second > r.second;
     }
   };
   mutable std::mutex mu_;
-  std::priority_queue<Message, std::vector<Message>, Compare> queue_;
+  std::priority_queue<Entry, std::vector<Entry>, Compare> queue_;
+  uint64_t next_ = 0;
   std::condition_variable cond_;
 };
 
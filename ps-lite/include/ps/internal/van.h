@@ -4,6 +4,7 @@
 #ifndef PS_INTERNAL_VAN_H_
 #define PS_INTERNAL_VAN_H_
 #include <atomic>
+#include <condition_variable>
 #include <ctime>
 #include <memory>
 #include <mutex>
@@ -16,6 +17,7 @@
 #include "ps/internal/message.h"
 namespace ps {
 class Resender;
+class Compressor;
 class PBMeta;
 /**
  * \brief Van sends messages to remote nodes
@@ -56,6 +58,12 @@ class Van {
    */
   int Send(const Message &msg);
 
+  /**
+   * \brief send the messages held back to be coalesced, if the van does. It is
+   * thread-safe
+   */
+  virtual void Flush() { }
+
   /**
    * \brief return my node
    */
@@ -80,12 +88,36 @@ class Van {
    */
   inline bool IsReady() { return ready_; }
 
+  /**
+   * \brief the node a barrier request of this node for group goes to: its
+   * parent in the barrier tree if no children wait for it, itself otherwise.
+   * thread safe
+   */
+  int BarrierEntry(int group);
+
  protected:
   /**
    * \brief connect to a node
    */
   virtual void Connect(const Node &node) = 0;
 
+  /**
+   * \brief whether \ref Connect may be called by several threads at once
+   */
+  virtual bool CanConnectInParallel() { return false; }
+
+  /**
+   * \brief whether \ref Connect may be called on the first send to a node
+   */
+  virtual bool CanConnectLazily() { return true; }
+
+  /**
+   * \brief whether to connect to node. a worker only talks to the other
+   * workers which are its neighbors in the barrier tree, while the servers
+   * talk to each other to move and replicate partitions
+   */
+  bool NeedConnect(const Node &node);
+
   /**
    * \brief bind to my node
    * do multiple retries on binding the port. since it's possible that
@@ -107,17 +139,29 @@ class Van {
   virtual int SendMsg(const Message &msg) = 0;
 
   /**
-   * \brief pack meta into a string
+   * \brief pack meta into a string, a fixed layout header for data messages
+   * and protobuf for control messages. the buffer is released by \ref FreeMeta
    */
   void PackMeta(const Meta &meta, char **meta_buf, int *buf_size);
 
+  /**
+   * \brief a buffer of size bytes for a header, released by \ref FreeMeta
+   */
+  static char *AllocMeta(int size);
+
+  /**
+   * \brief release a buffer of \ref PackMeta or \ref AllocMeta, small ones
+   * are reused
+   */
+  static void FreeMeta(char *meta_buf, int buf_size);
+
   /**
    * \brief pack meta into protobuf
    */
   void PackMetaPB(const Meta &meta, PBMeta *pb);
 
   /**
-   * \brief unpack meta from a string
+   * \brief unpack meta from a string of \ref PackMeta or a protobuf
    */
   void UnpackMeta(const char *meta_buf, int buf_size, Meta *meta);
 
@@ -127,6 +171,11 @@ class Van {
   std::mutex start_mu_;
 
  private:
+  friend class Resender;
+
+  /** \brief send a message as is, without compressing or resending it */
+  int SendRaw(const Message &msg);
+
   /** thread function for receving */
   void Receiving();
 
@@ -142,6 +191,17 @@ class Van {
 
   /** whether it is ready for sending */
   std::atomic<bool> ready_{false};
+  std::mutex ready_mu_;
+  std::condition_variable ready_cv_;
+  /** \brief the time of the phases of \ref Start, for PS_VERBOSE */
+  double bind_ms_ = 0;
+  double connect_ms_ = 0;
+  size_t num_connected_ = 0;
+  /** \brief the nodes not connected yet with PS_LAZY_CONNECT, by id */
+  bool lazy_connect_ = false;
+  std::mutex lazy_mu_;
+  std::unordered_map<int, Node> lazy_nodes_;
+  std::atomic<bool> has_lazy_nodes_{false};
   std::atomic<size_t> send_bytes_{0};
   size_t recv_bytes_ = 0;
   int num_servers_ = 0;
@@ -150,10 +210,36 @@ class Van {
   std::unique_ptr<std::thread> receiver_thread_;
   /** the thread for sending heartbeat */
   std::unique_ptr<std::thread> heartbeat_thread_;
-  std::vector<int> barrier_count_;
+  /** \brief the barrier requests received so far, by group */
+  std::unordered_map<int, int> barrier_count_;
+  /** \brief what a node does in the barrier of a group */
+  struct BarrierPlan {
+    /** \brief whether the node is in the group */
+    bool member = false;
+    /** \brief the children the subtrees of which have nodes of the group */
+    std::vector<int> children;
+  };
+  /**
+   * \brief the barrier tree: a heap of PS_BARRIER_FANOUT children per node
+   * over all the node ids in order, rooted at the scheduler. 0 makes every node
+   * a child of the scheduler. the node table is broadcast down it at startup
+   */
+  int barrier_fanout_ = 0;
+  std::vector<int> barrier_nodes_;
+  std::mutex barrier_mu_;
+  std::unordered_map<int, BarrierPlan> barrier_plans_;
   /** msg resender */
   Resender *resender_ = nullptr;
+  /** \brief compresses the data of the data messages, nullptr if disabled */
+  Compressor *compressor_ = nullptr;
   int drop_rate_ = 0;
+  /** \brief the random state of dropping, for the receiving thread */
+  unsigned drop_seed_ = 0;
+  /** \brief report the heap allocations every this many messages, 0 if not */
+  int alloc_stats_ = 0;
+  uint64_t num_recv_msgs_ = 0;
+  uint64_t last_heap_allocs_ = 0;
+  uint64_t last_pool_allocs_ = 0;
   std::atomic<int> timestamp_{0};
   int init_stage = 0;
 
@@ -163,6 +249,25 @@ class Van {
   void ProcessAddNodeCommandAtScheduler(Message *msg, Meta *nodes,
                                         Meta *recovery_nodes);
 
+  /** \brief set ready and wake up \ref Start */
+  void SetReady();
+
+  /**
+   * \brief connect to the nodes, in PS_CONNECT_THREADS threads if the van can,
+   * or only remember them with PS_LAZY_CONNECT
+   */
+  void ConnectAll(const std::vector<Node> &nodes);
+
+  /** \brief connect to node id if it is remembered by \ref ConnectAll */
+  void ConnectLazily(int id);
+
+  /**
+   * \brief the nodes the node table goes to from node id: its children in the
+   * tree of the nodes, or their children for the ones not present
+   */
+  void TableChildren(int id, const std::unordered_set<int> &present,
+                     std::vector<int> *children);
+
   /**
    * \brief processing logic of Terminate message
    */
@@ -178,6 +283,15 @@ class Van {
    */
   void ProcessBarrierCommand(Message *msg);
 
+  /** \brief build the barrier tree if not yet, barrier_mu_ is held */
+  void InitBarrierTree();
+
+  /** \brief the parent of node id in the barrier tree, kEmpty for the root */
+  int BarrierParent(int id);
+
+  /** \brief the barrier of group at this node. thread safe */
+  const BarrierPlan &GetBarrierPlan(int group);
+
   /**
    * \brief processing logic of AddNode message (run on each node)
    */
@@ -4,14 +4,27 @@
 #ifndef PS_KV_APP_H_
 #define PS_KV_APP_H_
 #include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include "ps/base.h"
 #include "ps/simple_app.h"
+#include "ps/internal/huge_page_allocator.h"
 #include "psf/server/serverMatrixMeta.h"
 #include "psf/client/ReqMatrixMeta.h"
 #include "psf/psf/PSFunc.h"
+#include "psf/server/PartitionStats.h"
+#include "psf/Matrix/MatrixMeta.h"
 
 namespace ps {
 
@@ -95,6 +108,7 @@ class KVWorker : public SimpleApp {
    */
   explicit KVWorker(int app_id, int customer_id) : SimpleApp() {
     using namespace std::placeholders;
+    chunk_bytes_ = GetEnv("PS_CHUNK_BYTES", 0);
     slicer_ = std::bind(&KVWorker<Val>::DefaultSlicer, this, _1, _2, _3);
     obj_ = new Customer(app_id, customer_id, std::bind(&KVWorker<Val>::Process, this, _1));
   }
@@ -182,18 +196,32 @@ class KVWorker : public SimpleApp {
            const Callback& cb = nullptr,
            int priority = 0) {
 
-    SArray<Key> skeys(keys);
-    SArray<ReqMatrixMeta> smetas(reqmatrixmeta); 
-    int ts = AddPullMLCB(skeys, vals, smetas,lens, cmd, cb);
+    return ZPull(SArray<Key>(keys), vals, SArray<ReqMatrixMeta>(reqmatrixmeta), lens, cmd, cb,
+                 priority);
+
+  }
 
+  /**
+   * \brief zero-copy Pull of the ops described by reqmatrixmeta
+   *
+   * This function is similar to \ref Pull except that keys and reqmatrixmeta
+   * are sent without being copied, so they must not be changed before the pull
+   * is finished.
+   */
+  int ZPull(const SArray<Key>& keys,
+            std::vector<Val>* vals,
+            const SArray<ReqMatrixMeta>& reqmatrixmeta,
+            std::vector<int>* lens = nullptr,
+            int cmd = 0,
+            const Callback& cb = nullptr,
+            int priority = 0) {
+    int ts = AddPullMLCB(keys, vals, reqmatrixmeta, lens, cmd, cb);
     KVPairs<Val> kvs;
-    kvs.keys = skeys;
-    kvs.reqmatrixmeta = smetas; 
+    kvs.keys = keys;
+    kvs.reqmatrixmeta = reqmatrixmeta;
     kvs.priority = priority;
     Send(ts, false, true, cmd, kvs);
-
     return ts;
-
   }
 
   /**
@@ -265,6 +293,13 @@ class KVWorker : public SimpleApp {
    */
   void Wait(int timestamp) { obj_->WaitRequest(timestamp); }
 
+  /**
+   * \brief Returns whether a push or pull has been finished, without blocking
+   *
+   * \param timestamp the timestamp returned by the push or pull
+   */
+  bool Test(int timestamp) { return obj_->TestRequest(timestamp); }
+
   /**
    * \brief zero-copy Push
    *
@@ -307,7 +342,7 @@ class KVWorker : public SimpleApp {
             int cmd = 0,
             const Callback& cb = nullptr,
             int priority = 0) {
-    int ts = AddPullCB(keys, vals, lens, cmd, cb);
+    int ts = AddPullCB(keys, vals, SArray<ReqMatrixMeta>(), lens, cmd, cb);
     KVPairs<Val> kvs;
     kvs.keys = keys;
     kvs.priority = priority;
@@ -330,7 +365,7 @@ class KVWorker : public SimpleApp {
                 int cmd = 0,
                 const Callback& cb = nullptr,
                 int priority = 0) {
-    int ts = AddPullCB(keys, outs, lens, cmd, cb);
+    int ts = AddPullCB(keys, outs, SArray<ReqMatrixMeta>(), lens, cmd, cb);
     KVPairs<Val> kvs;
     kvs.keys = keys;
     kvs.vals = vals;
@@ -356,7 +391,7 @@ class KVWorker : public SimpleApp {
    * \brief set a user-defined slicer
    */
   void set_slicer(const Slicer& slicer) {
-    CHECK(slicer); slicer_ = slicer;
+    CHECK(slicer); slicer_ = slicer; default_slicer_ = false;
   }
 
  private:
@@ -411,7 +446,28 @@ class KVWorker : public SimpleApp {
   /** \brief default kv slicer */
   void DefaultSlicer(const KVPairs<Val>& send,
                      const std::vector<Range>& ranges,
-                     SlicedKVs* sliced);
+                     SlicedKVs* sliced) {
+    Slice(send, false, sliced);
+  }
+
+  /**
+   * \brief slice by the key router
+   * \param read route to the read replicas of keys if any
+   */
+  void Slice(const KVPairs<Val>& send, bool read, SlicedKVs* sliced);
+
+  /**
+   * \brief split the kv list of one server into messages: the PushAll and
+   * PullAll blocks of more than \ref chunk_bytes_ are cut into chunks of rows,
+   * each sent as a message of its own
+   * \return the number of keys sent more than once
+   */
+  size_t Chunk(const KVPairs<Val>& kvs, std::vector<KVPairs<Val>>* chunks);
+
+  /** \brief the size of a chunk, 0 to not chunk */
+  size_t chunk_bytes_ = 0;
+  /** \brief the number of keys pulled more than once for each timestamp */
+  std::unordered_map<int, size_t> chunked_keys_;
 
   /** \brief data buffer for received kvs for each timestamp */
   std::unordered_map<int, std::vector<KVPairs<Val>>> recv_kvs_;
@@ -423,6 +479,8 @@ class KVWorker : public SimpleApp {
   std::mutex mu_;
   /** \brief kv list slicer */
   Slicer slicer_;
+  /** \brief whether slicer_ is the default one */
+  bool default_slicer_ = true;
 };
 
 
@@ -444,6 +502,8 @@ struct KVMeta {
   int timestamp;
   /** \brief the customer id of worker */
   int customer_id;
+  /** \brief the priority of the request, given to its response */
+  int priority = 0;
 };
 
 
@@ -463,7 +523,7 @@ class KVServer : public SimpleApp {
   }
 
   /** \brief deconstructor */
-  virtual ~KVServer() { delete obj_; obj_ = nullptr; }
+  virtual ~KVServer() { StopDeferred(); delete obj_; obj_ = nullptr; }
 
   /**
    * \brief the handle to process a push/pull request from a worker
@@ -486,15 +546,39 @@ class KVServer : public SimpleApp {
    */
   void Response(const KVMeta& req, const KVPairs<Val>& res = KVPairs<Val>());
 
- 
-  
+  /**
+   * \brief the callback of a forwarded request, given the response
+   */
+  using ForwardCallback = std::function<void(const KVPairs<Val>& res)>;
+
+  /**
+   * \brief forward (part of) a request to another server
+   *
+   * The other server processes it as a normal request, but responses to this
+   * server, then \a cb is called in the receiving thread of this server. It is
+   * used to serve keys which are being migrated to another server. The request
+   * is sent by the sending thread of \ref SimpleApp::Defer, so a handle can
+   * forward even if the request window is full.
+   *
+   * \param req the meta-info of the request
+   * \param data the kv pairs to forward
+   * \param recver the node id of the other server
+   * \param cb the callback
+   */
+  void Forward(const KVMeta& req, const KVPairs<Val>& data, int recver,
+               const ForwardCallback& cb);
+
  private:
   /** \brief internal receive handle */
   void Process(const Message& msg);
+  /** \brief send a request of \ref Forward, in the sending thread */
+  void SendForward(const KVMeta& req, const KVPairs<Val>& data, int recver,
+                   const ForwardCallback& cb);
   /** \brief request handle */
   ReqHandle request_handle_;
-
-  
+  /** \brief the callbacks of forwarded requests, by timestamp */
+  std::unordered_map<int, ForwardCallback> forwards_;
+  std::mutex forwards_mu_;
 };
 
 
@@ -512,9 +596,120 @@ class KVServer : public SimpleApp {
 
 template <typename Val>
 struct KVServerMLHandle {
+
+  // the priority of the state of partitions sent to other servers. the p3 van
+  // sends and delivers a message before the ones of lower priorities, so the
+  // state stays ahead of the requests forwarded after it, whatever theirs
+  static const int kStatePriority = INT_MAX;
+
   void operator()(
       const KVMeta& req_meta, const KVPairs<Val>& req_data, KVServer<Val>* server) {
 
+    switch (req_meta.cmd) {
+
+    case metaCmd::MatrixAlloc:
+      // zero the blocks of a new matrix, so neither the first push nor the first
+      // step pays for allocation and page faults
+      for (size_t i = 0; i < req_data.keys.size(); ++i) {
+        Key key = req_data.keys[i];
+        if (MatrixValue_.count(key)) continue;
+        const ServerMatrixMeta& meta = req_data.matrixmeta[i];
+        MatrixMeta_[key] = meta;
+        MatrixValue_[key].resize((size_t)(meta.endRow - meta.startRow) * (meta.endCol - meta.startCol));
+      }
+      server->Response(req_meta);
+      return;
+
+    case balanceCmd::PartInstall:
+      install(req_data);
+      server->Response(req_meta);
+      return;
+
+    case balanceCmd::PartReplica:
+      install(req_data);
+      for (Key key : req_data.keys) replicaOf_[key] = req_meta.sender;
+      server->Response(req_meta);
+      return;
+
+    case balanceCmd::PartDrop:
+      // reads still in flight go to the primary
+      for (Key key : req_data.keys) {
+        MatrixValue_.erase(key);
+        MatrixMeta_.erase(key);
+        stats_.erase(key);
+        replicaOf_.erase(key);
+        partners_.erase(key);
+        moved_[key] = req_meta.sender;
+      }
+      server->Response(req_meta);
+      return;
+
+    default:
+      break;
+
+    }
+
+    size_t n = req_data.keys.size();
+
+    // keys migrated to other servers are forwarded, so are writes to replicas
+    std::vector<size_t> local;
+    std::map<int,std::vector<size_t>> remote; // node id -> index of keys
+    if (!moved_.empty() || (req_meta.push && !replicaOf_.empty())) {
+      for (size_t i = 0; i < n; ++i) {
+        auto it = moved_.find(req_data.keys[i]);
+        if (it != moved_.end()) {
+          remote[it->second].push_back(i);
+          continue;
+        }
+        if (req_meta.push && (it = replicaOf_.find(req_data.keys[i])) != replicaOf_.end()) {
+          remote[it->second].push_back(i);
+          continue;
+        }
+        local.push_back(i);
+      }
+    }
+
+    if (remote.empty()) {
+
+      KVPairs<Val> res;
+      handle(req_meta, req_data, res);
+      server->Response(req_meta, res);
+      return;
+
+    }
+
+    // respond once all parts are done
+    auto pending = std::make_shared<Forwarding>();
+    pending->meta = req_meta;
+    pending->n = n;
+    pending->left = remote.size();
+
+    if (!local.empty()) {
+
+      KVPairs<Val> res;
+      handle(req_meta, subset(req_data, local), res);
+      pending->parts.push_back(std::make_pair(local, res));
+
+    }
+
+    for (const auto& r : remote) {
+
+      size_t part = pending->parts.size();
+      pending->parts.push_back(std::make_pair(r.second, KVPairs<Val>()));
+      server->Forward(req_meta, subset(req_data, r.second), r.first,
+                      [this, pending, part, server](const KVPairs<Val>& res) {
+                        pending->parts[part].second = res;
+                        if (--pending->left == 0) finish(*pending, server);
+                      });
+
+    }
+
+  }
+
+
+  // process a request about keys stored here
+  void handle(const KVMeta& req_meta, const KVPairs<Val>& req_data, KVPairs<Val>& res) {
+
     size_t n = req_data.keys.size();
 
 
@@ -522,8 +717,6 @@ struct KVServerMLHandle {
    // std::cout<< req_data.matrixmeta[0].matrixId<<std::endl;
 
 
-    KVPairs<Val> res;
-
     if (!req_meta.pull) {
 
       CHECK_EQ(n, req_data.lens.size());
@@ -554,6 +747,8 @@ struct KVServerMLHandle {
 
       //Key key = req_data.keys[i];
 
+      PartStats& stats = stats_[req_data.keys[i]];
+      ++stats.requests;
 
 ///////////////////////////////////////////////////////////////////////
 
@@ -561,13 +756,23 @@ struct KVServerMLHandle {
 
  
         handlePush(i,req_data,t);
+        stats.bytes += req_data.lens[i] * sizeof(Val);
+        if (!replicas_.empty() && replicas_.count(req_data.keys[i])) dirty_.insert(req_data.keys[i]);
 
 
       }
 
       if (req_meta.pull) {
 
-       handlePull(req_data.reqmatrixmeta[i],res);
+       const ReqMatrixMeta& req = req_data.reqmatrixmeta[i];
+       if ((req.type == psfType::RowDot || req.type == psfType::ColDot) && req.key2 != req.key) {
+         // a binary op needs both partitions here, so they only move together
+         partners_[req.key].insert(req.key2);
+         partners_[req.key2].insert(req.key);
+       }
+       size_t before = res.vals.size();
+       handlePull(req,res);
+       stats.bytes += (res.vals.size() - before) * sizeof(Val);
 
       }
 
@@ -575,11 +780,351 @@ struct KVServerMLHandle {
 
     }
 
-    server->Response(req_meta, res);
+  }
+
+
+  // push the updated partitions to their read replicas every interval
+  // milliseconds, which bounds the staleness of the replicas
+  void StartSync(KVServer<Val>* server, int interval) {
+
+    CHECK_GT(interval, 0);
+    StopSync();
+    sync_ = std::make_shared<SyncTimer>();
+    Customer* customer = server->get_customer();
+    auto timer = sync_;
+    timer->thread = std::thread(Postoffice::Inherit([timer, customer, interval]() {
+        Message msg;
+        msg.meta.simple_app = true;
+        msg.meta.request = true;
+        msg.meta.head = balanceCmd::ReplicaSync;
+        msg.meta.app_id = customer->app_id();
+        msg.meta.customer_id = customer->customer_id();
+        msg.meta.sender = Postoffice::Get()->van()->my_node().id;
+        std::unique_lock<std::mutex> lk(timer->mu);
+        while (!timer->cond.wait_for(lk, std::chrono::milliseconds(interval),
+                                     [timer] { return timer->stop; })) {
+          customer->Accept(msg);
+        }
+      }));
 
   }
 
+  // stop the sync timer, must be called before the server is deleted
+  void StopSync() {
 
+    if (!sync_) return;
+    {
+      std::lock_guard<std::mutex> lk(sync_->mu);
+      sync_->stop = true;
+    }
+    sync_->cond.notify_all();
+    sync_->thread.join();
+    sync_.reset();
+
+  }
+
+  // the messages of the scheduler to balance the partitions
+  void Control(const SimpleData& req, KVServer<Val>* server) {
+
+    std::istringstream is(req.body);
+
+    switch (req.head) {
+
+    case balanceCmd::PartStatsReq:
+      {
+
+      // "key requests bytes replica partners partner..." per line, for every
+      // partition stored here, replica is 1 for read replicas, the partners are
+      // the partitions here it must stay with: the blocks of the same index and
+      // shape of other matrices, which the partitioner placed together so binary
+      // ops may pair them before any did, and the ones paired by binary ops
+      std::map<std::tuple<int,int,int,int,int>, std::vector<Key>> placed;
+      for (const auto& v : MatrixValue_) {
+        if (moved_.count(v.first)) continue;
+        placed[shapeOf(v.first)].push_back(v.first);
+      }
+      std::ostringstream os;
+      for (const auto& v : MatrixValue_) {
+        if (moved_.count(v.first)) continue;
+        const PartStats& stats = stats_[v.first];
+        os << v.first << " " << stats.requests << " " << stats.bytes << " "
+           << replicaOf_.count(v.first);
+        std::set<Key> partners;
+        auto shape = shapeOf(v.first);
+        if (std::get<0>(shape) >= 0) {
+          for (Key k : placed[shape]) if (k != v.first) partners.insert(k);
+        }
+        auto it = partners_.find(v.first);
+        if (it != partners_.end()) {
+          for (Key k : it->second) {
+            if (MatrixValue_.count(k) && !moved_.count(k)) partners.insert(k);
+          }
+        }
+        os << " " << partners.size();
+        for (Key k : partners) os << " " << k;
+        os << "\n";
+      }
+      stats_.clear();
+      server->SimpleApp::Response(req, os.str());
+
+      }
+      break;
+
+    case balanceCmd::PartMigrate:
+      {
+
+      // phase one: send the partitions to the new server at once, since binary
+      // ops need them together, and forward all the later requests about them,
+      // which are ordered after the state
+      int rank; Key key;
+      is >> rank;
+      int recver = Postoffice::Get()->ServerRankToID(rank);
+      CHECK_NE(recver, Postoffice::Get()->van()->my_node().id);
+
+      KVPairs<Val> state;
+      std::vector<Val> vals;
+      while (is >> key) {
+        CHECK(MatrixValue_.count(key) && !moved_.count(key)) << "partition " << key << " is not here";
+        CHECK(!replicas_.count(key) && !replicaOf_.count(key)) << "partition " << key << " is replicated";
+        moved_[key] = recver;
+        state.keys.push_back(key);
+        vals.insert(vals.end(), MatrixValue_[key].begin(), MatrixValue_[key].end());
+        state.lens.push_back(MatrixValue_[key].size());
+        state.matrixmeta.push_back(MatrixMeta_[key]);
+      }
+      CHECK(!state.keys.empty());
+      state.vals = SArray<Val>(vals);
+      KVMeta meta;
+      meta.cmd = balanceCmd::PartInstall;
+      meta.priority = kStatePriority;
+      meta.push = true;
+      meta.pull = false;
+      server->Forward(meta, state, recver, [server, req](const KVPairs<Val>& res) {
+          server->SimpleApp::Response(req);
+        });
+
+      }
+      break;
+
+    case balanceCmd::PartCommit:
+      {
+
+      // phase two: the workers route to the new server, so drop the state but
+      // keep forwarding the requests still in flight
+      Key key;
+      while (is >> key) {
+        CHECK(moved_.count(key)) << "partition " << key << " is not migrated";
+        MatrixValue_.erase(key);
+        MatrixMeta_.erase(key);
+        stats_.erase(key);
+        partners_.erase(key);
+      }
+      server->SimpleApp::Response(req);
+
+      }
+      break;
+
+    case balanceCmd::PartReplicate:
+      {
+
+      // copy the partition to the servers of ranks, respond once all have it
+      Key key; int rank;
+      is >> key;
+      CHECK(MatrixValue_.count(key) && !moved_.count(key)) << "partition " << key << " is not here";
+      std::vector<int> recvers;
+      while (is >> rank) {
+        int recver = Postoffice::Get()->ServerRankToID(rank);
+        auto& replicas = replicas_[key];
+        if (std::find(replicas.begin(), replicas.end(), recver) != replicas.end()) continue;
+        replicas.push_back(recver);
+        recvers.push_back(recver);
+      }
+      dirty_.erase(key);
+      // the first replica starts the sync timer, which bounds its staleness
+      if (!recvers.empty() && !sync_) StartSync(server, GetEnv("PS_REPLICA_STALENESS", 100));
+      auto left = std::make_shared<size_t>(recvers.size());
+      if (recvers.empty()) server->SimpleApp::Response(req);
+      for (int recver : recvers) {
+        sync(key, recver, server, [server, req, left]() {
+            if (--*left == 0) server->SimpleApp::Response(req);
+          });
+      }
+
+      }
+      break;
+
+    case balanceCmd::PartUnreplicate:
+      {
+
+      // the workers do not read the replicas any more, drop them
+      Key key;
+      is >> key;
+      auto it = replicas_.find(key);
+      CHECK(it != replicas_.end()) << "partition " << key << " is not replicated";
+      std::vector<int> recvers = it->second;
+      replicas_.erase(it);
+      dirty_.erase(key);
+      auto left = std::make_shared<size_t>(recvers.size());
+      // a push carries the matrix meta, which Process expects after the keys
+      KVPairs<Val> drop;
+      drop.keys.push_back(key);
+      drop.matrixmeta.push_back(MatrixMeta_[key]);
+      KVMeta meta;
+      meta.cmd = balanceCmd::PartDrop;
+      meta.priority = kStatePriority;
+      meta.push = true;
+      meta.pull = false;
+      for (int recver : recvers) {
+        server->Forward(meta, drop, recver, [server, req, left](const KVPairs<Val>& res) {
+            if (--*left == 0) server->SimpleApp::Response(req);
+          });
+      }
+
+      }
+      break;
+
+    case balanceCmd::ReplicaSync:
+      {
+
+      // sent by the sync timer of this server, not answered
+      for (Key key : dirty_) {
+        for (int recver : replicas_[key]) sync(key, recver, server, nullptr);
+      }
+      dirty_.clear();
+
+      }
+      break;
+
+    default:
+      server->SimpleApp::Response(req);
+
+    }
+
+  }
+
+
+ private:
+
+  struct SyncTimer {
+    std::thread thread;
+    std::mutex mu;
+    std::condition_variable cond;
+    bool stop = false;
+  };
+
+  // a request partly forwarded to other servers
+  struct Forwarding {
+    KVMeta meta;
+    size_t n;
+    size_t left; // the number of parts not finished
+    std::vector<std::pair<std::vector<size_t>, KVPairs<Val>>> parts; // index of keys, response
+  };
+
+  // the index and shape of the block of partition key, the index is -1 if the
+  // block has no matrix meta
+  std::tuple<int,int,int,int,int> shapeOf(Key key) {
+
+    auto it = MatrixMeta_.find(key);
+    if (it == MatrixMeta_.end() || it->second.matrixId < 0) return std::make_tuple(-1, 0, 0, 0, 0);
+    const ServerMatrixMeta& meta = it->second;
+    return std::make_tuple(meta.partId, meta.startRow, meta.endRow, meta.startCol, meta.endCol);
+
+  }
+
+  // the keys of index in data
+  KVPairs<Val> subset(const KVPairs<Val>& data, const std::vector<size_t>& index) {
+
+    std::vector<size_t> offset(data.keys.size() + 1, 0);
+    size_t k = data.lens.size() ? 0 : data.vals.size() / data.keys.size();
+    for (size_t i = 0; i < data.keys.size(); ++i)
+      offset[i+1] = offset[i] + (data.lens.size() ? data.lens[i] : k);
+
+    KVPairs<Val> ret;
+    std::vector<Val> vals;
+    for (size_t i : index) {
+      ret.keys.push_back(data.keys[i]);
+      vals.insert(vals.end(), data.vals.begin() + offset[i], data.vals.begin() + offset[i+1]);
+      if (data.lens.size()) ret.lens.push_back(data.lens[i]);
+      if (data.matrixmeta.size()) ret.matrixmeta.push_back(data.matrixmeta[i]);
+      if (data.reqmatrixmeta.size()) ret.reqmatrixmeta.push_back(data.reqmatrixmeta[i]);
+    }
+    ret.vals = SArray<Val>(vals);
+    return ret;
+
+  }
+
+  // merge the responses of all parts in the order of the request
+  void finish(const Forwarding& f, KVServer<Val>* server) {
+
+    KVPairs<Val> res;
+    if (f.meta.pull) {
+
+      std::vector<std::pair<size_t, size_t>> where(f.n); // part, position in part
+      std::vector<std::vector<size_t>> offset(f.parts.size());
+      for (size_t p = 0; p < f.parts.size(); ++p) {
+        const auto& r = f.parts[p].second;
+        CHECK_EQ(r.keys.size(), f.parts[p].first.size());
+        offset[p].resize(r.keys.size() + 1, 0);
+        for (size_t j = 0; j < r.keys.size(); ++j) {
+          where[f.parts[p].first[j]] = std::make_pair(p, j);
+          offset[p][j+1] = offset[p][j] + r.lens[j];
+        }
+      }
+
+      std::vector<Val> vals;
+      for (size_t i = 0; i < f.n; ++i) {
+        size_t p = where[i].first, j = where[i].second;
+        const auto& r = f.parts[p].second;
+        res.keys.push_back(r.keys[j]);
+        vals.insert(vals.end(), r.vals.begin() + offset[p][j], r.vals.begin() + offset[p][j+1]);
+        res.lens.push_back(r.lens[j]);
+        if (r.reqmatrixmeta.size()) res.reqmatrixmeta.push_back(r.reqmatrixmeta[j]);
+      }
+      res.vals = SArray<Val>(vals);
+
+    }
+    server->Response(f.meta, res);
+
+  }
+
+  // send the state of partition key to the read replica on recver
+  void sync(Key key, int recver, KVServer<Val>* server, const std::function<void()>& done) {
+
+    KVPairs<Val> state;
+    state.keys.push_back(key);
+    state.vals.CopyFrom(MatrixValue_[key].data(), MatrixValue_[key].size());
+    state.lens.push_back(MatrixValue_[key].size());
+    state.matrixmeta.push_back(MatrixMeta_[key]);
+    KVMeta meta;
+    meta.cmd = balanceCmd::PartReplica;
+    meta.priority = kStatePriority;
+    meta.push = true;
+    meta.pull = false;
+    server->Forward(meta, state, recver, [done](const KVPairs<Val>& res) {
+        if (done) done();
+      });
+
+  }
+
+  // store a partition migrated from another server
+  void install(const KVPairs<Val>& data) {
+
+    size_t offset = 0;
+    for (size_t i = 0; i < data.keys.size(); ++i) {
+      Key key = data.keys[i];
+      MatrixValue_[key].assign(data.vals.begin() + offset, data.vals.begin() + offset + data.lens[i]);
+      MatrixMeta_[key] = data.matrixmeta[i];
+      offset += data.lens[i];
+      moved_.erase(key);
+    }
+    // the partitions moved together stay together
+    for (Key a : data.keys) {
+      for (Key b : data.keys) if (a != b) partners_[a].insert(b);
+    }
+
+  }
+
+ public:
 
  void handlePush(const int index, const KVPairs<Val>& req_data, int & accumulate){
       
@@ -595,7 +1140,20 @@ struct KVServerMLHandle {
             {
 
 //             std::cout<<key<<std::endl; 
+             const ServerMatrixMeta& meta = req_data.matrixmeta[index];
+             if(meta.rowIndex>=0){
+
+             // a chunk of rows, added at its offset in the block
              if(MatrixValue_[key].size()==0){
+               MatrixMeta_[key]=meta;
+               MatrixValue_[key].resize((size_t)(meta.endRow-meta.startRow)*(meta.endCol-meta.startCol));
+             }
+             size_t offset = (size_t)(meta.rowIndex-MatrixMeta_[key].startRow)*(MatrixMeta_[key].endCol-MatrixMeta_[key].startCol);
+             CHECK_LE(offset+len_,MatrixValue_[key].size());
+             Val* block = MatrixValue_[key].data()+offset;
+             for(size_t j=0;j<len_;j++) block[j]+=req_data.vals[accumulate++];
+
+             } else if(MatrixValue_[key].size()==0){
 
              MatrixMeta_[key]=req_data.matrixmeta[index];
 
@@ -622,11 +1180,15 @@ struct KVServerMLHandle {
            case psfType::PushRow:
                {
 
+               // add to the segment of the row in this block
                CHECK_NE(MatrixValue_[key].size(),0);
-               CHECK_GE(req_data.matrixmeta[index].rowIndex,MatrixMeta_[key].startRow);
-               CHECK_LT(req_data.matrixmeta[index].rowIndex,MatrixMeta_[key].endRow);
-               CHECK_EQ(len_,MatrixValue_[key].size());
-               for(size_t j = 0 ; j<len_;j++) MatrixValue_[key][j]+=req_data.vals[accumulate++];
+               int rowIndex = req_data.matrixmeta[index].rowIndex;
+               CHECK_GE(rowIndex,MatrixMeta_[key].startRow);
+               CHECK_LT(rowIndex,MatrixMeta_[key].endRow);
+               size_t elePerRow = MatrixMeta_[key].endCol-MatrixMeta_[key].startCol;
+               CHECK_EQ(len_,elePerRow);
+               Val* row = MatrixValue_[key].data()+(rowIndex-MatrixMeta_[key].startRow)*elePerRow;
+               for(size_t j = 0 ; j<len_;j++) row[j]+=req_data.vals[accumulate++];
 
                }
                break;
@@ -659,8 +1221,16 @@ struct KVServerMLHandle {
     case psfType::PullAll:
        {
       
-        req.setStartRow(MatrixMeta_[key].startRow);
-        req.setEndRow(MatrixMeta_[key].endRow);
+        if(req.rowIndex>=0){
+          // a chunk of rows [rowIndex, rowIndex2)
+          CHECK_GE(req.rowIndex,MatrixMeta_[key].startRow);
+          CHECK_LE(req.rowIndex2,MatrixMeta_[key].endRow);
+          req.setStartRow(req.rowIndex);
+          req.setEndRow(req.rowIndex2);
+        } else {
+          req.setStartRow(MatrixMeta_[key].startRow);
+          req.setEndRow(MatrixMeta_[key].endRow);
+        }
         req.setStartCol( MatrixMeta_[key].startCol);
         req.setEndCol(MatrixMeta_[key].endCol);
         res.reqmatrixmeta.push_back(req);
@@ -770,9 +1340,14 @@ struct KVServerMLHandle {
 
    void pullall(const Key key, const ReqMatrixMeta& req, KVPairs<Val>& res){
 
-            int size = MatrixValue_[key].size();
-            for(int i = 0 ; i < size ;i++) 
-                res.vals.push_back(MatrixValue_[key][i]);
+            // the rows [req.startRow, req.endRow) of the block
+            size_t elePerRow = MatrixMeta_[key].endCol-MatrixMeta_[key].startCol;
+            size_t begin = (size_t)(req.startRow-MatrixMeta_[key].startRow)*elePerRow;
+            size_t size = (size_t)(req.endRow-req.startRow)*elePerRow;
+            CHECK_LE(begin+size,MatrixValue_[key].size());
+            const Val* p = MatrixValue_[key].data()+begin;
+            for(size_t i = 0 ; i < size ;i++) 
+                res.vals.push_back(p[i]);
             res.lens.push_back(size);
   
    }
@@ -877,8 +1452,15 @@ struct KVServerMLHandle {
 
      }
 
-std::unordered_map<Key,std::vector<Val>> MatrixValue_;
+std::unordered_map<Key,std::vector<Val,HugePageAllocator<Val>>> MatrixValue_;
 std::unordered_map<Key,ServerMatrixMeta> MatrixMeta_;
+std::unordered_map<Key,PartStats> stats_; // access statistics since the last report
+std::unordered_map<Key,int> moved_; // node id of the server a partition is migrated to
+std::unordered_map<Key,std::vector<int>> replicas_; // node ids of the read replicas of a partition
+std::unordered_map<Key,int> replicaOf_; // node id of the primary of a read replica stored here
+std::unordered_set<Key> dirty_; // partitions updated since the last sync of their replicas
+std::unordered_map<Key,std::unordered_set<Key>> partners_; // partitions paired by binary ops
+std::shared_ptr<SyncTimer> sync_;
 
 };
 
@@ -932,6 +1514,28 @@ void KVServer<Val>::Process(const Message& msg) {
     SimpleApp::Process(msg); return;
   }
 
+  if (!msg.meta.request) {
+    // the response of a forwarded request
+    KVPairs<Val> res;
+    if (msg.data.size()) {
+      CHECK_GE(msg.data.size(), (size_t)2);
+      res.keys = msg.data[0];
+      res.vals = msg.data[1];
+      if (msg.data.size() > (size_t)2) res.lens = msg.data[2];
+      if (msg.data.size() > (size_t)3) res.reqmatrixmeta = msg.data[3];
+    }
+    ForwardCallback cb;
+    {
+      std::lock_guard<std::mutex> lk(forwards_mu_);
+      auto it = forwards_.find(msg.meta.timestamp);
+      CHECK(it != forwards_.end()) << "unknown forwarded request " << msg.meta.timestamp;
+      cb = std::move(it->second);
+      forwards_.erase(it);
+    }
+    cb(res);
+    return;
+  }
+
   KVMeta meta;
   meta.cmd       = msg.meta.head;
   meta.push      = msg.meta.push;
@@ -939,6 +1543,7 @@ void KVServer<Val>::Process(const Message& msg) {
   meta.sender    = msg.meta.sender;
   meta.timestamp = msg.meta.timestamp;
   meta.customer_id = msg.meta.customer_id;
+  meta.priority  = msg.meta.priority;
 
   KVPairs<Val> data;
   int n = msg.data.size();
@@ -994,6 +1599,7 @@ void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
   msg.meta.head        = req.cmd;
   msg.meta.timestamp   = req.timestamp;
   msg.meta.recver      = req.sender;
+  msg.meta.priority    = req.priority;
   if (res.keys.size()) {
     msg.AddData(res.keys);
     msg.AddData(res.vals);
@@ -1011,74 +1617,132 @@ void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
 
 
 template <typename Val>
-void KVWorker<Val>::DefaultSlicer(
-    const KVPairs<Val>& send, const std::vector<Range>& ranges,
-    typename KVWorker<Val>::SlicedKVs* sliced) {
-  
-  sliced->resize(ranges.size());
-
-  // find the positions in msg.key
-  size_t n = ranges.size();
-  std::vector<size_t> pos(n+1);
-
-  const Key* begin = send.keys.begin();
-  const Key* end = send.keys.end();
+void KVServer<Val>::Forward(const KVMeta& req, const KVPairs<Val>& data, int recver,
+                           const ForwardCallback& cb) {
+  Defer([this, req, data, recver, cb] { SendForward(req, data, recver, cb); });
+}
 
-  for (size_t i = 0; i < n; ++i) {
-    if (i == 0) {
-      pos[0] = std::lower_bound(begin, end, ranges[0].begin()) - begin;
-      begin += pos[0];
-    } else {
-      CHECK_EQ(ranges[i-1].end(), ranges[i].begin());
+template <typename Val>
+void KVServer<Val>::SendForward(const KVMeta& req, const KVPairs<Val>& data, int recver,
+                               const ForwardCallback& cb) {
+  int ts = obj_->NewRequest(recver);
+  {
+    std::lock_guard<std::mutex> lk(forwards_mu_);
+    forwards_[ts] = cb;
+  }
+  Message msg;
+  msg.meta.app_id = obj_->app_id();
+  msg.meta.customer_id = obj_->customer_id();
+  msg.meta.request     = true;
+  msg.meta.push        = req.push;
+  msg.meta.pull        = req.pull;
+  msg.meta.head        = req.cmd;
+  msg.meta.timestamp   = ts;
+  msg.meta.recver      = recver;
+  msg.meta.priority    = req.priority;
+  if (data.keys.size()) {
+    msg.AddData(data.keys);
+    msg.AddData(data.vals);
+    if (data.lens.size()) {
+      msg.AddData(data.lens);
+    }
+    if (data.matrixmeta.size()) {
+      msg.AddData(data.matrixmeta);
+    }
+    if (data.reqmatrixmeta.size()) {
+      msg.AddData(data.reqmatrixmeta);
     }
-    size_t len = std::lower_bound(begin, end, ranges[i].end()) - begin;
-    begin += len;
-
-    pos[i+1] = pos[i] + len;
-
-    // don't send it to servers for empty kv
-    sliced->at(i).first = (len != 0);
   }
+  Postoffice::Get()->van()->Send(msg);
+}
 
-  CHECK_EQ(pos[n], send.keys.size());
 
-  if (send.keys.empty()) return;
+template <typename Val>
+void KVWorker<Val>::Slice(
+    const KVPairs<Val>& send, bool read,
+    typename KVWorker<Val>::SlicedKVs* sliced) {
+  // keys are routed by the key router, ranges is only used by user slicers
+  auto router = Postoffice::Get()->GetKeyRouter();
+  size_t n = router->num_servers();
+  sliced->resize(n);
 
+  size_t num_keys = send.keys.size();
   // the length of value
-  size_t k = 0, val_begin = 0, val_end = 0;
+  size_t k = 0;
   if (send.lens.empty()) {
-    k = send.vals.size() / send.keys.size();
-    CHECK_EQ(k * send.keys.size(), send.vals.size());
+    if (num_keys) {
+      k = send.vals.size() / num_keys;
+      CHECK_EQ(k * num_keys, send.vals.size());
+    }
   } else {
-    CHECK_EQ(send.keys.size(), send.lens.size());
-   // CHECK_EQ(send.keys.size(), send.matrixmeta.size()); // new 
+    CHECK_EQ(num_keys, send.lens.size());
   }
 
-  // slice
+  // route every key once. if the ranks are non-decreasing, then the keys of
+  // every server form one run and can be sliced without copying
+  std::vector<int> rank(num_keys);
+  std::vector<size_t> count(n, 0);
+  bool in_order = true;
+  for (size_t i = 0; i < num_keys; ++i) {
+    rank[i] = read ? router->ReadServerRank(send.keys[i]) : router->ServerRank(send.keys[i]);
+    if (i && rank[i] < rank[i-1]) in_order = false;
+    ++count[rank[i]];
+  }
+  // don't send it to servers for empty kv
   for (size_t i = 0; i < n; ++i) {
-    if (pos[i+1] == pos[i]) {
-      sliced->at(i).first = false;
-      continue;
-    }
-    sliced->at(i).first = true;
-    auto& kv = sliced->at(i).second;
-    kv.keys = send.keys.segment(pos[i], pos[i+1]);
+    sliced->at(i).first = (count[i] != 0);
+    sliced->at(i).second.priority = send.priority;
+  }
+  if (num_keys == 0) return;
 
-    // new add 
-    if(send.matrixmeta.size()) kv.matrixmeta = send.matrixmeta.segment(pos[i],pos[i+1]);
-    if(send.reqmatrixmeta.size()) kv.reqmatrixmeta = send.reqmatrixmeta.segment(pos[i],pos[i+1]);
+  if (in_order) {
+    size_t key_begin = 0, val_begin = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (!count[i]) continue;
+      size_t key_end = key_begin + count[i];
+      auto& kv = sliced->at(i).second;
+      kv.keys = send.keys.segment(key_begin, key_end);
+      if (send.matrixmeta.size()) kv.matrixmeta = send.matrixmeta.segment(key_begin, key_end);
+      if (send.reqmatrixmeta.size()) kv.reqmatrixmeta = send.reqmatrixmeta.segment(key_begin, key_end);
+      if (send.lens.size()) {
+        kv.lens = send.lens.segment(key_begin, key_end);
+        size_t val_end = val_begin;
+        for (int l : kv.lens) val_end += l;
+        kv.vals = send.vals.segment(val_begin, val_end);
+        val_begin = val_end;
+      } else {
+        kv.vals = send.vals.segment(key_begin * k, key_end * k);
+      }
+      key_begin = key_end;
+    }
+    return;
+  }
 
+  // the keys of a server are scattered, gather them
+  std::vector<size_t> val_pos;
+  if (send.lens.size()) {
+    val_pos.resize(num_keys + 1, 0);
+    for (size_t i = 0; i < num_keys; ++i) val_pos[i+1] = val_pos[i] + send.lens[i];
+    CHECK_EQ(val_pos[num_keys], send.vals.size());
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (!count[i]) continue;
+    auto& kv = sliced->at(i).second;
+    kv.keys.reserve(count[i], 0);
+    if (send.lens.size()) kv.lens.reserve(count[i], 0);
+  }
+  for (size_t i = 0; i < num_keys; ++i) {
+    auto& kv = sliced->at(rank[i]).second;
+    kv.keys.push_back(send.keys[i]);
+    if (send.matrixmeta.size()) kv.matrixmeta.push_back(send.matrixmeta[i]);
+    if (send.reqmatrixmeta.size()) kv.reqmatrixmeta.push_back(send.reqmatrixmeta[i]);
+    size_t val_begin = i * k, val_end = (i + 1) * k;
     if (send.lens.size()) {
-      kv.lens = send.lens.segment(pos[i], pos[i+1]);
-
-      for (int l : kv.lens) val_end += l;
-      kv.vals = send.vals.segment(val_begin, val_end);
-      val_begin = val_end;
-    } else {
-
-      kv.vals = send.vals.segment(pos[i]*k, pos[i+1]*k);
-
+      kv.lens.push_back(send.lens[i]);
+      val_begin = val_pos[i];
+      val_end = val_pos[i+1];
     }
+    for (size_t j = val_begin; j < val_end; ++j) kv.vals.push_back(send.vals[j]);
   }
 }
 
@@ -1087,21 +1751,40 @@ template <typename Val>
 void KVWorker<Val>::Send(int timestamp, bool push, bool pull, int cmd, const KVPairs<Val>& kvs) {
   // slice the message
   SlicedKVs sliced;
-  slicer_(kvs, Postoffice::Get()->GetServerKeyRanges(), &sliced);
+  if (default_slicer_) {
+    // pure reads may go to the replicas
+    Slice(kvs, pull && !push, &sliced);
+  } else {
+    slicer_(kvs, Postoffice::Get()->GetServerKeyRanges(), &sliced);
+  }
+
+  // a server answers every chunk
+  std::vector<std::vector<KVPairs<Val>>> chunks(sliced.size());
+  int extra = 0;
+  size_t chunked_keys = 0;
+  for (size_t i = 0; i < sliced.size(); ++i) {
+    if (!sliced[i].first) continue;
+    chunked_keys += Chunk(sliced[i].second, &chunks[i]);
+    extra += chunks[i].size() - 1;
+  }
+  if (chunked_keys && pull) {
+    std::lock_guard<std::mutex> lk(mu_);
+    chunked_keys_[timestamp] = chunked_keys;
+  }
 
   // need to add response first, since it will not always trigger the callback
   int skipped = 0;
   for (size_t i = 0; i < sliced.size(); ++i) {
     if (!sliced[i].first) ++skipped;
   }
-  obj_->AddResponse(timestamp, skipped);
+  obj_->AddResponse(timestamp, skipped - extra);
   if ((size_t)skipped == sliced.size()) {
     RunCallback(timestamp);
   }
 
   for (size_t i = 0; i < sliced.size(); ++i) {
-    const auto& s = sliced[i];
-    if (!s.first) continue;
+    if (!sliced[i].first) continue;
+    for (const auto& kvs : chunks[i]) {
     Message msg;
     msg.meta.app_id = obj_->app_id();
     msg.meta.customer_id = obj_->customer_id();
@@ -1112,7 +1795,6 @@ void KVWorker<Val>::Send(int timestamp, bool push, bool pull, int cmd, const KVP
     msg.meta.timestamp   = timestamp;
     msg.meta.recver      = Postoffice::Get()->ServerRankToID(i);
     msg.meta.priority    = kvs.priority;
-    const auto& kvs = s.second;
 
     if (kvs.keys.size()) {
 
@@ -1136,7 +1818,83 @@ void KVWorker<Val>::Send(int timestamp, bool push, bool pull, int cmd, const KVP
 
   }
     Postoffice::Get()->van()->Send(msg);
+    }
+  }
+}
+
+template <typename Val>
+size_t KVWorker<Val>::Chunk(const KVPairs<Val>& kvs, std::vector<KVPairs<Val>>* chunks) {
+  // the rows and the width of every block to cut, 0 rows if not cut
+  size_t n = kvs.keys.size();
+  std::vector<std::pair<int, size_t>> shape(n, std::make_pair(0, 0));
+  bool cut = false;
+  for (size_t i = 0; chunk_bytes_ && i < n; ++i) {
+    int rows = 0; size_t width = 0;
+    if (kvs.matrixmeta.size() && kvs.matrixmeta[i].type == psfType::PushAll &&
+        kvs.matrixmeta[i].rowIndex < 0 && kvs.vals.size()) {
+      const ServerMatrixMeta& m = kvs.matrixmeta[i];
+      rows = m.endRow - m.startRow; width = m.endCol - m.startCol;
+      if ((size_t)kvs.lens[i] != rows * width) rows = 0;
+    } else if (kvs.reqmatrixmeta.size() && kvs.reqmatrixmeta[i].type == psfType::PullAll &&
+               kvs.reqmatrixmeta[i].rowIndex < 0 && kvs.reqmatrixmeta[i].startRow >= 0) {
+      const ReqMatrixMeta& m = kvs.reqmatrixmeta[i];
+      rows = m.endRow - m.startRow; width = m.endCol - m.startCol;
+    }
+    if (rows > 1 && rows * width * sizeof(Val) > chunk_bytes_) {
+      shape[i] = std::make_pair(rows, width);
+      cut = true;
+    }
+  }
+  if (!cut) {
+    chunks->push_back(kvs);
+    return 0;
+  }
+
+  // the blocks not cut go together, their values are copied
+  KVPairs<Val> rest;
+  rest.priority = kvs.priority;
+  size_t cut_keys = 0, offset = 0;
+  for (size_t i = 0; i < n; ++i) {
+    size_t len = kvs.lens.size() ? kvs.lens[i] : 0;
+    if (!shape[i].first) {
+      rest.keys.push_back(kvs.keys[i]);
+      if (kvs.lens.size()) rest.lens.push_back(len);
+      for (size_t j = offset; j < offset + len && j < kvs.vals.size(); ++j) rest.vals.push_back(kvs.vals[j]);
+      if (kvs.matrixmeta.size()) rest.matrixmeta.push_back(kvs.matrixmeta[i]);
+      if (kvs.reqmatrixmeta.size()) rest.reqmatrixmeta.push_back(kvs.reqmatrixmeta[i]);
+      offset += len;
+      continue;
+    }
+    // the values of a chunk are a segment of the block, not copied
+    int rows = shape[i].first;
+    size_t width = shape[i].second;
+    int step = std::max<size_t>(1, chunk_bytes_ / (width * sizeof(Val)));
+    for (int r = 0; r < rows; r += step) {
+      int num = std::min(step, rows - r);
+      KVPairs<Val> c;
+      c.priority = kvs.priority;
+      c.keys.push_back(kvs.keys[i]);
+      if (kvs.matrixmeta.size()) {
+        ServerMatrixMeta m = kvs.matrixmeta[i];
+        m.rowIndex = m.startRow + r;
+        c.matrixmeta.push_back(m);
+        c.vals = kvs.vals.segment(offset + r * width, offset + (r + num) * width);
+        c.lens.push_back(num * width);
+      } else {
+        ReqMatrixMeta m = kvs.reqmatrixmeta[i];
+        m.rowIndex = m.startRow + r;
+        m.rowIndex2 = m.startRow + r + num;
+        c.reqmatrixmeta.push_back(m);
+        if (kvs.lens.size()) c.lens.push_back(0);
+      }
+      chunks->push_back(c);
+      ++cut_keys;
+    }
+    --cut_keys;
+    offset += len;
   }
+  if (rest.keys.size()) chunks->push_back(rest);
+  return cut_keys;
 }
 
 
@@ -1197,7 +1955,7 @@ int KVWorker<Val>::AddPullCB(
   int ts = obj_->NewRequest(kServerGroup);
 
 
-  AddCallback(ts, [this, ts, keys, vals, lens, cb]() mutable {
+  AddCallback(ts, [this, ts, keys, vals, reqmeta, lens, cb]() mutable {
       mu_.lock();
       auto& kvs = recv_kvs_[ts];
       mu_.unlock();
@@ -1205,37 +1963,29 @@ int KVWorker<Val>::AddPullCB(
       // do check
       size_t total_key = 0, total_val = 0;
       size_t total_req = 0 ; // new add
- 
+      // whether the keys of every server form one run of keys
+      bool runs = true;
+
       for (const auto& s : kvs) {
         Range range = FindRange(keys, s.keys.front(), s.keys.back()+1);
-        CHECK_EQ(range.size(), s.keys.size())
-            << "unmatched keys size from one server";
+        if (range.size() != s.keys.size()) runs = false;
 
         if (lens) CHECK_EQ(s.lens.size(), s.keys.size());
 
         total_key += s.keys.size();
         total_val += s.vals.size();
-        total_req += s.reqmatrixmeta.size(); // new add 
+        total_req += s.reqmatrixmeta.size(); // new add
 
       }
 
       CHECK_EQ(total_key, keys.size()) << "lost some servers?";
-      LOG(INFO)<<"total kes: "<<total_key<<" total req: "<<total_req; 
-      CHECK_EQ(total_key, total_req) << "lost some servers?"; // new add
-      LOG(INFO)<<"startcol: "<<kvs[0].reqmatrixmeta[0].startCol<<"endcol: "<<kvs[0].reqmatrixmeta[0].endCol;
-        
-      // fill vals and lens
-      std::sort(kvs.begin(), kvs.end(), [](
-          const KVPairs<Val>& a, const KVPairs<Val>& b) {
-                  return a.keys.front() < b.keys.front();
-        });
-
+      if (reqmeta.size()) CHECK_EQ(total_key, total_req) << "lost some servers?"; // new add
 
       CHECK_NOTNULL(vals);
 
       if (vals->empty()) {
         vals->resize(total_val); // std::vector
-      } else { 
+      } else {
         CHECK_EQ(vals->size(), total_val);
       }
 
@@ -1251,16 +2001,44 @@ int KVWorker<Val>::AddPullCB(
         p_lens = lens->data();
       }
 
-      for (const auto& s : kvs) {
+      if (runs) {
+        // fill vals and lens
+        std::sort(kvs.begin(), kvs.end(), [](
+            const KVPairs<Val>& a, const KVPairs<Val>& b) {
+                    return a.keys.front() < b.keys.front();
+          });
 
-        memcpy(p_vals, s.vals.data(), s.vals.size() * sizeof(Val));
-        p_vals += s.vals.size();
+        for (const auto& s : kvs) {
 
-        if (p_lens) {
-          memcpy(p_lens, s.lens.data(), s.lens.size() * sizeof(int));
-          p_lens += s.lens.size();
-        }
+          memcpy(p_vals, s.vals.data(), s.vals.size() * sizeof(Val));
+          p_vals += s.vals.size();
+
+          if (p_lens) {
+            memcpy(p_lens, s.lens.data(), s.lens.size() * sizeof(int));
+            p_lens += s.lens.size();
+          }
 
+        }
+      } else {
+        // keys are routed to servers by hashing, scatter back in key order
+        std::vector<std::pair<const Val*, int>> src(keys.size());
+        for (const auto& s : kvs) {
+          size_t k = s.lens.size() ? 0 : s.vals.size() / s.keys.size();
+          const Val* p = s.vals.data();
+          for (size_t j = 0; j < s.keys.size(); ++j) {
+            size_t pos = std::lower_bound(keys.begin(), keys.end(), s.keys[j]) - keys.begin();
+            CHECK_LT(pos, keys.size());
+            CHECK_EQ(keys[pos], s.keys[j]) << "unmatched key from one server";
+            int len = s.lens.size() ? s.lens[j] : k;
+            src[pos] = std::make_pair(p, len);
+            p += len;
+          }
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+          memcpy(p_vals, src[i].first, src[i].second * sizeof(Val));
+          p_vals += src[i].second;
+          if (p_lens) *p_lens++ = src[i].second;
+        }
       }
 
       //TODO: CHECK lens and data size
@@ -1305,9 +2083,6 @@ int KVWorker<Val>::AddPullMLCB(
       for (const auto& s : kvs) {
 
         
-        Range range = FindRange(keys, s.keys.front(), s.keys.back()+1);
-        CHECK_EQ(range.size(), s.keys.size())
-            << "unmatched keys size from one server";
 
         if (lens) CHECK_EQ(s.lens.size(), s.keys.size()); 
 
@@ -1317,17 +2092,26 @@ int KVWorker<Val>::AddPullMLCB(
        
       }
        
-      CHECK_EQ(total_key, keys.size()) << "lost some servers?";
+      // a block pulled in chunks is answered once per chunk
+      mu_.lock();
+      size_t chunked = chunked_keys_[ts];
+      chunked_keys_.erase(ts);
+      mu_.unlock();
+      CHECK_EQ(total_key, keys.size() + chunked) << "lost some servers?";
      
       // LOG(INFO)<<"total kes: "<<total_key<<" total req: "<<total_req;
 
       CHECK_EQ(total_key, total_req) << "lost some servers?"; // new add
 
 
-      // fill vals and lens
-      std::sort(kvs.begin(), kvs.end(), [](
+      // fill vals and lens in the order of the requested keys, which follows
+      // the partitions no matter how the router places keys on servers
+      auto pos = [&keys](const KVPairs<Val>& a) {
+        return std::find(keys.begin(), keys.end(), a.keys.front()) - keys.begin();
+      };
+      std::sort(kvs.begin(), kvs.end(), [&pos](
           const KVPairs<Val>& a, const KVPairs<Val>& b) {
-                  return a.keys.front() < b.keys.front();
+                  return pos(a) < pos(b);
         });
 
       CHECK_NOTNULL(vals);
@@ -1340,28 +2124,36 @@ int KVWorker<Val>::AddPullMLCB(
       // check kvs[0].reqmatrixmeta[0].type to get psffunc.
       
       psfType type = kvs[0].reqmatrixmeta[0].type;
+
+      // every key is one block of the matrix, a server may answer several blocks
+      struct Block { const ReqMatrixMeta* meta; const Val* vals; int len; };
+      std::vector<Block> blocks;
+      for (const auto& s : kvs) {
+        const Val* p = s.vals.data();
+        for (size_t j = 0; j < s.keys.size(); ++j) {
+          blocks.push_back(Block{&s.reqmatrixmeta[j], p, s.lens[j]});
+          p += s.lens[j];
+        }
+      }
+
+      int *p_lens = nullptr;
       
       switch(type){
 
       case psfType::PullAll:
         {
-   
+
+      // put every block at its position in the row-major matrix
       if (vals->empty()) {
 
         vals->resize(total_val); // std::vector
 
       } else {
 
-//        std::cout<<"add pullcb"<<vals->size()<<" "<<total_val<<std::endl;
-
         CHECK_EQ(vals->size(), total_val);
 
       }
 
-      Val* p_vals = vals->data();
-      int *p_lens = nullptr;
-
-
       if (lens) {
         if (lens->empty()) {
           lens->resize(1);
@@ -1369,22 +2161,25 @@ int KVWorker<Val>::AddPullMLCB(
           CHECK_EQ(lens->size(), 1);
         }
         p_lens = lens->data();
+        *p_lens = total_val;
       }
 
-      for (const auto& s : kvs) {
-
-        memcpy(p_vals, s.vals.data(), s.vals.size() * sizeof(Val));
-        p_vals += s.vals.size();
-
-        CHECK_EQ(s.lens.size(),1);
-        *p_lens = * p_lens + *s.lens.data();
-
-
-     //   if (p_lens) {
-     //     memcpy(p_lens, s.lens.data(), s.lens.size() * sizeof(int));
-     //     p_lens += s.lens.size();
-     //  }
-
+      int startRow = blocks[0].meta->startRow, startCol = blocks[0].meta->startCol, endCol = blocks[0].meta->endCol;
+      for (const auto& b : blocks) {
+        startRow = std::min(startRow, b.meta->startRow);
+        startCol = std::min(startCol, b.meta->startCol);
+        endCol = std::max(endCol, b.meta->endCol);
+      }
+      size_t elePerRow = endCol - startCol;
+
+      for (const auto& b : blocks) {
+        size_t width = b.meta->endCol - b.meta->startCol;
+        CHECK_EQ((size_t)b.len, width * (b.meta->endRow - b.meta->startRow));
+        Val* p_vals = vals->data() + (b.meta->startRow - startRow) * elePerRow + (b.meta->startCol - startCol);
+        for (const Val* v = b.vals; v < b.vals + b.len; v += width) {
+          memcpy(p_vals, v, width * sizeof(Val));
+          p_vals += elePerRow;
+        }
       }
 
        }
@@ -1393,6 +2188,12 @@ int KVWorker<Val>::AddPullMLCB(
       case psfType::GetRow:
        {
 
+      // concatenate the segments of every row by column, the rows ascending
+      std::sort(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) {
+          if (a.meta->rowIndex != b.meta->rowIndex) return a.meta->rowIndex < b.meta->rowIndex;
+          return a.meta->startCol < b.meta->startCol;
+        });
+
       if (vals->empty()) {
         vals->resize(total_val); // std::vector
       } else {
@@ -1400,8 +2201,6 @@ int KVWorker<Val>::AddPullMLCB(
       }
 
       Val* p_vals = vals->data();
-      int *p_lens = nullptr;
-
 
       if (lens) {
         if (lens->empty()) {
@@ -1412,15 +2211,12 @@ int KVWorker<Val>::AddPullMLCB(
         p_lens = lens->data();
       }
 
-      for (const auto& s : kvs) {
+      for (const auto& b : blocks) {
 
-        memcpy(p_vals, s.vals.data(), s.vals.size() * sizeof(Val));
-        p_vals += s.vals.size();
+        memcpy(p_vals, b.vals, b.len * sizeof(Val));
+        p_vals += b.len;
 
-        if (p_lens) {
-          memcpy(p_lens, s.lens.data(), s.lens.size() * sizeof(int));
-          p_lens += s.lens.size();
-        }
+        if (p_lens) *p_lens++ = b.len;
 
       }
 
@@ -1428,58 +2224,18 @@ int KVWorker<Val>::AddPullMLCB(
        break;
 
       case psfType::RowSum:
-       {
-
-      if (vals->empty()) {
-        vals->resize(1,0); // the size of res is 1
-      } else {
-
-        CHECK_EQ(vals->size(), 1);
-        if(*vals->data()!=0) *vals->data() = 0 ;
-        
-
-      }
-
-      Val* p_vals = vals->data();
-      int *p_lens = nullptr;
-
-
-      if (lens) {
-        if (lens->empty()) {
-          lens->resize(1);
-        } else {
-          CHECK_EQ(lens->size(), 1);
-        }
-        p_lens = lens->data();
-      }
-
-      for (const auto& s : kvs) {
-
-        CHECK_EQ(s.vals.size(),1);
-        *p_vals = *p_vals + *s.vals.data();
-
-        CHECK_EQ(*s.lens.data(),1);
-
-      }
-
-      *p_lens = 1;
-
-      }
-
-      break;
       case psfType::ColDot:
        {
 
+      // add up the partial results of the blocks
       if (vals->empty()) {
         vals->resize(1,0); // the size of res is 1
       } else {
         CHECK_EQ(vals->size(), 1);
-        if(*vals->data()!=0)*vals->data()=0;
+        *vals->data() = 0;
       }
 
       Val* p_vals = vals->data();
-      int *p_lens = nullptr;
-
 
       if (lens) {
         if (lens->empty()) {
@@ -1488,19 +2244,16 @@ int KVWorker<Val>::AddPullMLCB(
           CHECK_EQ(lens->size(), 1);
         }
         p_lens = lens->data();
+        *p_lens = 1;
       }
 
-      for (const auto& s : kvs) {
+      for (const auto& b : blocks) {
 
-        CHECK_EQ(s.vals.size(),1);
-//        std::cout<<*s.vals.data()<<std::endl;
-        *p_vals = *p_vals + *s.vals.data();
-        CHECK_EQ(*s.lens.data(),1);
+        CHECK_EQ(b.len,1);
+        *p_vals = *p_vals + *b.vals;
 
       }
 
-      *p_lens = 1;
-
       }
 
        break;
@@ -11,6 +11,8 @@
 #include "ps/simple_app.h"
 /** \brief communcating with a list of key-value paris. */
 #include "ps/kv_app.h"
+/** \brief futures for asynchronous requests */
+#include "ps/future.h"
 namespace ps {
 /** \brief Returns the number of worker nodes */
 inline int NumWorkers() { return Postoffice::Get()->num_workers(); }
@@ -106,6 +106,7 @@ class SArray {
    * \param size the length
    */
   void CopyFrom(const V* data, size_t size) {
+    if (size == 0) { clear(); return; }
     resize(size,data[0]); 
     memcpy(this->data(), data, size*sizeof(V));
   }
@@ -164,6 +165,15 @@ class SArray {
     size_ = size; capacity_ = size; ptr_.reset(data, del);
   }
 
+  /**
+   * @brief Reset the current data pointer with a deleter, allocating the
+   * reference count with alloc
+   */
+  template <typename Deleter, typename Alloc>
+  void reset(V* data, size_t size, Deleter del, Alloc alloc) {
+    size_ = size; capacity_ = size; ptr_.reset(data, del, alloc);
+  }
+
   /**
    * @brief Resizes the array to size elements
    *
@@ -3,9 +3,13 @@
  */
 #ifndef PS_SIMPLE_APP_H_
 #define PS_SIMPLE_APP_H_
+#include <functional>
+#include <memory>
 #include <string>
+#include <thread>
 #include "ps/internal/message.h"
 #include "ps/internal/postoffice.h"
+#include "ps/internal/threadsafe_queue.h"
 namespace ps {
 
 /**
@@ -40,7 +44,7 @@ class SimpleApp {
   explicit SimpleApp(int app_id, int customer_id);
 
   /** \brief deconstructor */
-  virtual ~SimpleApp() { delete obj_; obj_ = nullptr; }
+  virtual ~SimpleApp() { StopDeferred(); delete obj_; obj_ = nullptr; }
 
   /**
    * \brief send a request to a remote node
@@ -111,10 +115,26 @@ class SimpleApp {
   /** \brief process a received message */
   virtual inline void Process(const Message& msg);
 
+  /**
+   * \brief run fn in the sending thread of this app, started on the first
+   * call. A handle sends its requests through it, since \ref
+   * Customer::NewRequest blocks on a full window until the receiving thread,
+   * which runs the handle, finishes a request
+   */
+  inline void Defer(const std::function<void()>& fn);
+
+  /** \brief run the functions deferred so far and stop the sending thread */
+  inline void StopDeferred();
+
   /** \brief ps internal object */
   Customer* obj_;
 
  private:
+  std::mutex deferred_mu_;
+  /** \brief the functions to run by \ref sender_, an empty one stops it */
+  ThreadsafeQueue<std::function<void()>> deferred_;
+  std::unique_ptr<std::thread> sender_;
+
   /** \brief request handle */
   Handle request_handle_;
   /** \brief request handle */
@@ -167,6 +187,32 @@ inline void SimpleApp::Response(const SimpleData& req, const std::string& res_bo
 }
 
 
+inline void SimpleApp::Defer(const std::function<void()>& fn) {
+  CHECK(fn);
+  {
+    std::lock_guard<std::mutex> lk(deferred_mu_);
+    if (!sender_) {
+      sender_.reset(new std::thread(Postoffice::Inherit([this] {
+          while (true) {
+            std::function<void()> fn;
+            deferred_.WaitAndPop(&fn);
+            if (!fn) break;
+            fn();
+          }
+        })));
+    }
+  }
+  deferred_.Push(fn);
+}
+
+inline void SimpleApp::StopDeferred() {
+  std::lock_guard<std::mutex> lk(deferred_mu_);
+  if (!sender_) return;
+  deferred_.Push(std::function<void()>());
+  sender_->join();
+  sender_.reset();
+}
+
 inline void SimpleApp::Process(const Message& msg) {
   SimpleData recv;
   recv.sender    = msg.meta.sender;
@@ -1,369 +1,111 @@
+#ifndef _MATRIX_META_
+#define _MATRIX_META_
 
-/**
- * The meta of matrix.
- */
-class MatrixMeta {
-
-  /**
-   * Matrix basic parameters
-   */
-  private final MatrixContext matrixContext;
-
-  /**
-   * Matrix partitions parameters
-   */
-  private final Map<Integer, PartitionMeta> partitionMetas;
-
-  /**
-   * Create a MatrixMeta
-   *
-   * @param mContext matrix context
-   */
-  public MatrixMeta(MatrixContext mContext) {
-    this(mContext, new HashMap<>());
-  }
-
-  /**
-   * Create a MatrixMeta
-   *
-   * @param matrixContext matrix context
-   * @param partitionMetas matrix partitions meta
-   */
-  public MatrixMeta(MatrixContext matrixContext, Map<Integer, PartitionMeta> partitionMetas) {
-    this.matrixContext = matrixContext;
-    this.partitionMetas = partitionMetas;
-  }
-
-  /**
-   * Get matrix id
-   *
-   * @return the id
-   */
-  public int getId() {
-    return matrixContext.getMatrixId();
-  }
-
-  /**
-   * Gets row num.
-   *
-   * @return the row num
-   */
-  public int getRowNum() {
-    return matrixContext.getRowNum();
-  }
-
-  /**
-   * Gets col num.
-   *
-   * @return the col num
-   */
-  public long getColNum() {
-    return matrixContext.getColNum();
-  }
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "dmlc/logging.h"
+#include "psf/server/PartitionMeta.h"
 
-  /**
-   * Get number of non-zero elements
-   *
-   * @return number of non-zero elements
-   */
-  public long getValidIndexNum() {
-    return matrixContext.getValidIndexNum();
-  }
-
-  /**
-   * get index range start
-   */
-  public long getIndexStart() {
-    return matrixContext.getIndexStart();
-  }
 
-  /**
-   * Get index range end
-   *
-   * @return index range end
-   */
-  public long getIndexEnd() {
-    return matrixContext.getIndexEnd();
-  }
+// the app id of the matrix meta service on the scheduler and its agents on the workers.
+// it is also their customer id, since the scheduler routes a request by its app id
+const int kMatrixMetaApp = 1;
 
-  /**
-   * Gets name.
-   *
-   * @return the name
-   */
-  public String getName() {
-    return matrixContext.getName();
-  }
-
-  /**
-   * Gets row type.
-   *
-   * @return the row type
-   */
-  public RowType getRowType() {
-    return matrixContext.getRowType();
-  }
+// the key id of block i of a matrix, from which the key router derives the key of the block
+inline uint64_t BlockKeyId(int matrixId, int block) {
+  return (static_cast<uint64_t>(matrixId) << 32) | static_cast<uint32_t>(block);
+}
 
-  /**
-   * Gets attribute.
-   *
-   * @param key the key
-   * @param value the default value
-   * @return the attribute
-   */
-  public String getAttribute(String key, String value) {
-    if (!matrixContext.getAttributes().containsKey(key)) {
-      return value;
-    }
-    return matrixContext.getAttributes().get(key);
-  }
+// heads of the messages exchanged by the workers and the matrix meta service on the scheduler
+enum metaCmd{
 
-  /**
-   * Gets attribute.
-   *
-   * @param key the key
-   * @return the attribute
-   */
-  public String getAttribute(String key) {
-    return matrixContext.getAttributes().get(key);
-  }
+CreateMatrix=1, // worker -> scheduler, "name id startRow endRow startCol endCol blockRow blockCol validIndexNum",
+                // get or create a matrix
+GetMatrix,      // worker -> scheduler, "id", get a matrix
+MatrixTable,    // scheduler -> worker, a new matrix
+MatrixAlloc=64  // worker -> server, a kv cmd (not clashing with balanceCmd), allocate the blocks of a matrix
 
-  /**
-   * Is average.
-   *
-   * @return the result
-   */
-  public boolean isAverage() {
-    String average = getAttribute(MatrixConf.MATRIX_AVERAGE, MatrixConf.DEFAULT_MATRIX_AVERAGE);
-    return Boolean.parseBoolean(average);
-  }
+};
 
-  /**
-   * Is hogwild.
-   *
-   * @return the result
-   */
-  public boolean isHogwild() {
-    String hogwild = getAttribute(MatrixConf.MATRIX_HOGWILD, MatrixConf.DEFAULT_MATRIX_HOGWILD);
-    return Boolean.parseBoolean(hogwild);
-  }
 
-  /**
-   * Gets staleness.
-   *
-   * @return the staleness
-   */
-  public int getStaleness() {
-    return Integer.parseInt(getAttribute(MatrixConf.MATRIX_STALENESS, "0"));
-  }
+/**
+ * The meta of matrix, decided once by the scheduler and cached by the workers.
+ *
+ * The matrix [startRow, endRow) x [startCol, endCol) is tiled row-major into
+ * blockRow x blockCol blocks, block i is held by server rank servers[i]. The
+ * blocks are not stored, so the meta of a matrix stays one line on the wire.
+ */
+struct MatrixMeta {
 
-  /**
-   * Get partitions meta
-   *
-   * @return all partitions meta
-   */
-  public Map<Integer, PartitionMeta> getPartitionMetas() {
-    return partitionMetas;
-  }
+  int id = -1;
+  std::string name;
+  int startRow = 0;
+  int endRow = 0;
+  long startCol = 0;
+  long endCol = 0;
+  int blockRow = 0;
+  long blockCol = 0;
+  std::vector<int> servers; // block id -> server rank
 
-  /**
-   * Get matrix context
-   *
-   * @return matrix context
-   */
-  public MatrixContext getMatrixContext() {
-    return matrixContext;
-  }
+  int getId() const { return id; }
 
-  /**
-   * Add meta for a partition
-   *
-   * @param id partition id
-   * @param meta partition meta
-   */
-  public void addPartitionMeta(int id, PartitionMeta meta) {
-    partitionMetas.put(id, meta);
-  }
+  const std::string& getName() const { return name; }
 
-  /**
-   * Get meta for a partition
-   *
-   * @param partId partition id
-   * @return partition meta
-   */
-  public PartitionMeta getPartitionMeta(int partId) {
-    return partitionMetas.get(partId);
-  }
+  int getRowNum() const { return endRow - startRow; }
 
-  /**
-   * Get the stored pss for a partition
-   *
-   * @param partId partition id
-   * @return the stored pss
-   */
-  public List<ParameterServerId> getPss(int partId) {
-    PartitionMeta partitionMeta = partitionMetas.get(partId);
-    if (partitionMeta == null) {
-      return null;
-    }
-    return partitionMeta.getPss();
-  }
+  long getColNum() const { return endCol - startCol; }
 
-  /**
-   * Get the stored pss for the whole matrix
-   *
-   * @return the stored pss
-   */
-  public List<ParameterServerId> getPss() {
-    Set<ParameterServerId> pss = new HashSet<>();
-    for (PartitionMeta partMeta : partitionMetas.values()) {
-      pss.add(partMeta.getMasterPs());
-    }
-    return new ArrayList<>(pss);
-  }
+  /** \brief the number of blocks covering one row */
+  int getColBlocks() const { return (getColNum() + blockCol - 1) / blockCol; }
 
-  /**
-   * Set the stored pss for a partition
-   *
-   * @param partId partition id
-   * @param psIds the stored pss
-   */
-  public void setPss(int partId, List<ParameterServerId> psIds) {
-    PartitionMeta partitionMeta = partitionMetas.get(partId);
-    if (partitionMeta == null) {
-      return;
-    }
-    partitionMeta.setPss(psIds);
-  }
+  /** \brief the blocks, row-major */
+  std::vector<PartitionMeta> getPartitions() const {
 
-  /**
-   * Get the master stored ps for the partition
-   *
-   * @param partId partition id
-   * @return the master stored ps
-   */
-  public ParameterServerId getMasterPs(int partId) {
-    PartitionMeta partitionMeta = partitionMetas.get(partId);
-    if (partitionMeta == null) {
-      return null;
+    std::vector<PartitionMeta> parts;
+    int partId = 0;
+    for (int i = startRow; i < endRow; i += blockRow) {
+      for (long j = startCol; j < endCol; j += blockCol) {
+        parts.push_back(PartitionMeta(id, partId++, i, std::min(i + blockRow, endRow),
+                                      j, std::min(j + blockCol, endCol)));
+      }
     }
-    return partitionMeta.getMasterPs();
-  }
+    CHECK_EQ(parts.size(), servers.size()) << "matrix " << id << " has a broken meta";
+    return parts;
 
-  /**
-   * Get matrix attributes
-   *
-   * @return matrix attributes
-   */
-  public Map<String, String> getAttributes() {
-    return matrixContext.getAttributes();
   }
 
-  /**
-   * Get the block row number for the matrix
-   *
-   * @return the block row number for the matrix
-   */
-  public int getBlockRowNum() {
-    return matrixContext.getMaxRowNumInBlock();
+  /** \brief whether other has the same shape */
+  bool sameShape(int startRow, int endRow, long startCol, long endCol) const {
+    return this->startRow == startRow && this->endRow == endRow &&
+           this->startCol == startCol && this->endCol == endCol;
   }
 
-  /**
-   * Get the block column number for the matrix
-   *
-   * @return the block column number for the matrix
-   */
-  public long getBlockColNum() {
-    return matrixContext.getMaxColNumInBlock();
-  }
+  // "id name startRow endRow startCol endCol blockRow blockCol numBlocks server..."
+  friend std::ostream& operator<<(std::ostream& os, const MatrixMeta& meta) {
 
-  @Override
-  public String toString() {
-    StringBuilder sb = new StringBuilder();
-    sb.append("MatrixContext:").append(matrixContext).append("\n");
-    sb.append("partitions:").append("\n");
-    List<PartitionMeta> parts = new ArrayList<>(partitionMetas.values());
-    parts.sort((PartitionMeta p1, PartitionMeta p2) -> p1.getPartId() - p2.getPartId());
-    int size = parts.size();
-    sb.append("total partitoin number:" + size).append("\n");
-    for (int i = 0; i < size; i++) {
-      sb.append("partition ").append(parts.get(i).getPartId()).append(":").append(parts.get(i))
-          .append("\n");
-    }
+    os << meta.id << " " << meta.name << " " << meta.startRow << " " << meta.endRow << " "
+       << meta.startCol << " " << meta.endCol << " " << meta.blockRow << " " << meta.blockCol
+       << " " << meta.servers.size();
+    for (int rank : meta.servers) os << " " << rank;
+    return os;
 
-    return sb.toString();
   }
 
-  /**
-   * Remove the stored ps for all partitions
-   *
-   * @param psId ps id
-   */
-  public void removePs(ParameterServerId psId) {
-    for (PartitionMeta partMeta : partitionMetas.values()) {
-      partMeta.removePs(psId);
-    }
-  }
+  friend std::istream& operator>>(std::istream& is, MatrixMeta& meta) {
 
-  /**
-   * Add the stored ps for the partition
-   *
-   * @param partId partition id
-   * @param psId ps id
-   */
-  public void addPs(int partId, ParameterServerId psId) {
-    PartitionMeta partitionMeta = partitionMetas.get(partId);
-    if (partitionMeta == null) {
-      return;
-    }
-    partitionMeta.addReplicationPS(psId);
-  }
-
-  /**
-   * Get estimate sparsity
-   *
-   * @return estimate sparsity
-   */
-  public double getEstSparsity() {
-    return matrixContext.getEstSparsity();
-  }
+    size_t num = 0;
+    is >> meta.id >> meta.name >> meta.startRow >> meta.endRow >> meta.startCol >> meta.endCol
+       >> meta.blockRow >> meta.blockCol >> num;
+    meta.servers.resize(num);
+    for (size_t i = 0; i < num; ++i) is >> meta.servers[i];
+    return is;
 
-  /**
-   * Get matrix value type class
-   *
-   * @return null if this parameter is not set
-   * @throws ClassNotFoundException if value class is not found
-   */
-  public Class<? extends IElement> getValueClass() throws ClassNotFoundException {
-    return matrixContext.getValueType();
   }
 
-  /**
-   * Get matrix server partition class
-   *
-   * @return matrix server partition class
-   * @throws ClassNotFoundException if server partition class is not found
-   */
-  public Class<? extends IServerPartition> getPartitionClass() throws ClassNotFoundException {
-    return matrixContext.getPartitionClass();
-  }
-
-  /**
-   * Get matrix server partition storage class
-   *
-   * @return matrix server partition storage class, null means not set by user
-   * @throws ClassNotFoundException if server partition storage class is not found
-   */
-  public Class<? extends IServerPartitionStorage> getPartitionStorageClass()
-      throws ClassNotFoundException {
-    return matrixContext.getPartitionStorageClass();
-  }
-
-  /**
-   * Get PS Matrix initialization function
-   * @return PS Matrix initialization function
-   */
-  public PSMatrixInit getInitFunc() {
-    return matrixContext.getInitFunc();
-  }
 };
+
+#endif
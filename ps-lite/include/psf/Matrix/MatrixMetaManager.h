@@ -1,63 +1,56 @@
+#ifndef _MATRIX_META_MANAGER_
+#define _MATRIX_META_MANAGER_
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "psf/Matrix/MatrixMeta.h"
+
+
 /**
- * The matrix meta manager.
+ * The matrix meta manager, a versioned table of the matrices.
+ *
+ * The scheduler owns the master table, every worker caches the part it has seen.
+ * The version counts the matrices created by the scheduler, so a cache with the
+ * version of the master knows every matrix.
  */
-
 class MatrixMetaManager{
 
+  private:
+
+  mutable std::mutex mu;
 
   /**
    * Matrix id to matrix meta map
    */
-  private:
-  
-  
   std::unordered_map<int, MatrixMeta> matrixIdToMetaMap;
 
   /**
    * Matrix name to matrix id map
    */
-   
   std::unordered_map<std::string, int> matrixNameToIdMap;
 
- 
+  int version = 0;
 
 
-  /**
-   * Creates a new matrix meta manager.
-   */
   public:
-  
-  
-  MatrixMetaManager() { }
 
-  /**
-   * Add matrixes.
-   *
-   * @param matrixMetas the matrix metas
-   */
- 
- void addMatrices(std::vector<MatrixMeta> matrixMetas) {
 
-    int size = matrixMetas.size();
-    for (int i = 0; i < size; i++) {
-      addMatrix(matrixMetas[i]);
-    }
-  
-  
-
-  }
+  MatrixMetaManager() { }
 
   /**
    * Add matrix.
    *
    * @param matrixMeta the matrix meta
    */
- void addMatrix(MatrixMeta matrixMeta) {
-	 
-    this->matrixIdToMetaMap[matrixMeta.getId()]= matrixMeta;
-    this->matrixNameToIdMap[matrixMeta.getName()]= matrixMeta.getId();
+  void addMatrix(const MatrixMeta& matrixMeta) {
+
+    std::lock_guard<std::mutex> lk(mu);
+    matrixIdToMetaMap[matrixMeta.getId()] = matrixMeta;
+    matrixNameToIdMap[matrixMeta.getName()] = matrixMeta.getId();
 
-  
   }
 
   /**
@@ -67,253 +60,101 @@ class MatrixMetaManager{
    */
   void removeMatrix(int matrixId) {
 
-    MatrixMeta meta = matrixIdToMetaMap.remove(matrixId);
-
-    if (meta != null) {
-      matrixNameToIdMap.remove(meta.getName());
-    }
+    std::lock_guard<std::mutex> lk(mu);
+    auto it = matrixIdToMetaMap.find(matrixId);
+    if (it == matrixIdToMetaMap.end()) return;
+    matrixNameToIdMap.erase(it->second.getName());
+    matrixIdToMetaMap.erase(it);
 
   }
 
-
   /**
    * Gets matrix id.
    *
    * @param matrixName the matrix name
-   * @return the matrix id
+   * @return the matrix id, -1 if not exist
    */
-  int getMatrixId(String matrixName) {
+  int getMatrixId(const std::string& matrixName) const {
 
-    if (matrixNameToIdMap.count(matrixName)) {
-
-      return matrixNameToIdMap[matrixName];
-
-    } else {
-
-      return -1;
-
-    }
+    std::lock_guard<std::mutex> lk(mu);
+    auto it = matrixNameToIdMap.find(matrixName);
+    return it == matrixNameToIdMap.end() ? -1 : it->second;
 
   }
 
-
   /**
    * Gets matrix meta.
    *
    * @param matrixId the matrix id
-   * @return the matrix meta
+   * @param matrixMeta filled with the matrix meta if exists
+   * @return whether the matrix exists
    */
-   
-  MatrixMeta getMatrixMeta(int matrixId) {
+  bool getMatrixMeta(int matrixId, MatrixMeta* matrixMeta) const {
 
-    return matrixIdToMetaMap[matrixId];
+    std::lock_guard<std::mutex> lk(mu);
+    auto it = matrixIdToMetaMap.find(matrixId);
+    if (it == matrixIdToMetaMap.end()) return false;
+    *matrixMeta = it->second;
+    return true;
 
   }
 
-  /**
-   * Gets matrix meta.
-   *
-   * @param matrixName the matrix name
-   * @return the matrix meta
-   */
- MatrixMeta getMatrixMeta(String matrixName) {
+  bool exists(const std::string& matrixName) const { return getMatrixId(matrixName) >= 0; }
 
-    int matrixId = getMatrixId(matrixName);
+  bool exists(int matrixId) const {
+
+    std::lock_guard<std::mutex> lk(mu);
+    return matrixIdToMetaMap.count(matrixId) > 0;
 
-    if (matrixId == -1) {
-      return null;
-    } else {
-      return matrixIdToMetaMap.get(matrixId);
-    }
   }
 
   /**
    * Gets matrix ids.
-   *
-   * @return the matrix ids
    */
-  Set<Integer> getMatrixIds() {
-    return matrixIdToMetaMap.keySet();
-  }
+  std::vector<int> getMatrixIds() const {
+
+    std::lock_guard<std::mutex> lk(mu);
+    std::vector<int> ids;
+    for (const auto& m : matrixIdToMetaMap) ids.push_back(m.first);
+    return ids;
 
-  /**
-   * Gets matrix names.
-   *
-   * @return the matrix names
-   */
-  Set<String> getMatrixNames() {
-    return matrixNameToIdMap.keySet();
   }
 
   /**
-   * Is a matrix exist
-   *
-   * @param matrixName matrix name
-   * @return true means exist
+   * the smallest id larger than every matrix id
    */
-   bool exists(std::string matrixName) {
+  int nextMatrixId() const {
 
-    return matrixNameToIdMap.count(matrixName)==1;
+    std::lock_guard<std::mutex> lk(mu);
+    int next = 0;
+    for (const auto& m : matrixIdToMetaMap) next = std::max(next, m.first + 1);
+    return next;
 
   }
 
+  int getVersion() const {
 
-  /**
-   * Is a matrix exist
-   *
-   * @param matrixId matrix id
-   * @return true means exist
-   */
-  bool exists(int matrixId) {
-    return matrixIdToMetaMap.count(matrixId)==1;
-  }
-
-  /**
-   * Get all matrices meta
-   *
-   * @return all matrices meta
-   */
-   std::unordered_map<int, MatrixMeta>& getMatrixMetas() {
-
-    return matrixIdToMetaMap;
+    std::lock_guard<std::mutex> lk(mu);
+    return version;
 
   }
 
-  /**
-   * Get the stored pss for a matrix partition
-   *
-   * @param matrixId matrix id
-   * @param partId   partition id
-   * @return the stored pss
-   */
-  public List<ParameterServerId> getPss(int matrixId, int partId) {
-    MatrixMeta matrixMeta = matrixIdToMetaMap.get(matrixId);
-    if (matrixMeta == null) {
-      return null;
-    }
-
-    return matrixMeta.getPss(partId);
-  }
+  /** \brief raise the version to at least v */
+  void updateVersion(int v) {
 
-  /**
-   * Get the stored pss for a matrix
-   *
-   * @param matrixId matrix id
-   * @return the stored pss
-   */
-  public List<ParameterServerId> getPss(int matrixId) {
-    MatrixMeta matrixMeta = matrixIdToMetaMap.get(matrixId);
-    if (matrixMeta == null) {
-      return null;
-    }
+    std::lock_guard<std::mutex> lk(mu);
+    version = std::max(version, v);
 
-    return matrixMeta.getPss();
   }
 
-  /**
-   * Remove the matrix
-   *
-   * @param matrixName matrix name
-   */
-  public void removeMatrix(String matrixName) {
-    if (matrixNameToIdMap.containsKey(matrixName)) {
-      int matrixId = matrixNameToIdMap.remove(matrixName);
-      matrixIdToMetaMap.remove(matrixId);
-    }
-  }
+  void clear() {
 
-  /**
-   * Remove all matrices
-   */
-  public void clear() {
+    std::lock_guard<std::mutex> lk(mu);
     matrixIdToMetaMap.clear();
     matrixNameToIdMap.clear();
-  }
-
-  /**
-   * Get the master stored ps for a matrix partition
-   *
-   * @param matrixId matrix id
-   * @param partId   partition id
-   * @return the master stored ps
-   */
-  public ParameterServerId getMasterPs(int matrixId, int partId) {
-    MatrixMeta matrixMeta = matrixIdToMetaMap.get(matrixId);
-    if (matrixMeta == null) {
-      return null;
-    }
-
-    return matrixMeta.getMasterPs(partId);
-  }
-
-  /**
-   * Remove matrices
-   *
-   * @param matrixIds matrix ids
-   */
-  public void removeMatrices(List<Integer> matrixIds) {
-    int size = matrixIds.size();
-    for (int i = 0; i < size; i++) {
-      removeMatrix(matrixIds.get(i));
-    }
-  }
 
-  /**
-   * Remove the stored ps for all matrix partitions
-   *
-   * @param psId ps id
-   */
-  public void removePs(ParameterServerId psId) {
-    for (MatrixMeta matrixMeta : matrixIdToMetaMap.values()) {
-      matrixMeta.removePs(psId);
-    }
-  }
-
-  /**
-   * Set the stored pss for a matrix partition
-   *
-   * @param matrixId matrix id
-   * @param partId   partition id
-   * @param psIds    the stored pss
-   */
-  public void setPss(int matrixId, int partId, List<ParameterServerId> psIds) {
-    MatrixMeta matrixMeta = matrixIdToMetaMap.get(matrixId);
-    if (matrixMeta == null) {
-      return;
-    }
-
-    matrixMeta.setPss(partId, psIds);
-  }
-
-  /**
-   * Add a the stored ps for a matrix partition
-   *
-   * @param matrixId matrix id
-   * @param partId
-   * @param psId     ps id
-   */
-  public void addPs(int matrixId, int partId, ParameterServerId psId) {
-    MatrixMeta matrixMeta = matrixIdToMetaMap.get(matrixId);
-    if (matrixMeta == null) {
-      return;
-    }
-
-    matrixMeta.addPs(partId, psId);
-  }
-
-  /**
-   * Get estimate sparsity
-   *
-   * @param matrixId matrix id
-   * @return estimate sparsity
-   */
-  public double getEstSparsity(int matrixId) {
-    MatrixMeta meta = matrixIdToMetaMap.get(matrixId);
-    if (meta == null) {
-      return 1.0;
-    } else {
-      return meta.getEstSparsity();
-    }
   }
 
 };
+
+#endif
@@ -1,66 +1,51 @@
-public class PartContext {
-  private int startRow;
-  private int endRow;
-  private long startCol;
-  private long endCol;
-  private int indexNum;
+#ifndef _PART_CONTEXT_
+#define _PART_CONTEXT_
 
-  public PartContext(int startRow, int endRow, long startCol, long endCol, int indexNum) {
-    this.startRow = startRow;
-    this.endRow = endRow;
-    this.startCol = startCol;
-    this.endCol = endCol;
-    this.indexNum = indexNum;
-  }
+#include<ostream>
 
-  public int getStartRow() {
-    return startRow;
-  }
+/**
+ * A user specified matrix partition
+ */
+class PartContext {
+  private:
+  int startRow;
+  int endRow;
+  long startCol;
+  long endCol;
+  int indexNum;
 
-  public void setStartRow(int startRow) {
-    this.startRow = startRow;
- }
+  public:
+  PartContext(int startRow, int endRow, long startCol, long endCol, int indexNum)
+      : startRow(startRow), endRow(endRow), startCol(startCol), endCol(endCol),
+        indexNum(indexNum) {}
 
-  public int getEndRow() {
-    return endRow;
-  }
+  int getStartRow() const { return startRow; }
 
-  public void setEndRow(int endRow) {
-    this.endRow = endRow;
-  }
+  void setStartRow(int startRow) { this->startRow = startRow; }
 
-  public long getStartCol() {
-    return startCol;
-  }
+  int getEndRow() const { return endRow; }
 
-  public void setStartCol(long startCol) {
-    this.startCol = startCol;
-  }
+  void setEndRow(int endRow) { this->endRow = endRow; }
 
-  public long getEndCol() {
-    return endCol;
-  }
+  long getStartCol() const { return startCol; }
 
-  public void setEndCol(long endCol) {
-    this.endCol = endCol;
-  }
+  void setStartCol(long startCol) { this->startCol = startCol; }
 
-  public int getIndexNum() {
-    return indexNum;
-  }
+  long getEndCol() const { return endCol; }
 
-  public void setIndexNum(int indexNum) {
-    this.indexNum = indexNum;
-  }
+  void setEndCol(long endCol) { this->endCol = endCol; }
 
-  @Override
-  public String toString() {
-    return "PartContext{" +
-        "startRow=" + startRow +
-        ", endRow=" + endRow +
-        ", startCol=" + startCol +
-        ", endCol=" + endCol +
-        ", indexNum=" + indexNum +
-        '}';
+  int getIndexNum() const { return indexNum; }
+
+  void setIndexNum(int indexNum) { this->indexNum = indexNum; }
+
+  friend std::ostream& operator<<(std::ostream& os, const PartContext& part) {
+    return os << "PartContext{startRow=" << part.startRow
+              << ", endRow=" << part.endRow
+              << ", startCol=" << part.startCol
+              << ", endCol=" << part.endCol
+              << ", indexNum=" << part.indexNum << '}';
   }
-}
+};
+
+#endif
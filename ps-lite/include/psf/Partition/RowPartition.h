@@ -1,14 +1,21 @@
 #include "psf/server/serverMatrixMeta.h"
+#include "psf/Matrix/MatrixMeta.h"
 #include "dmlc/logging.h"
 #include "ps/internal/postoffice.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 #include "ps/range.h"
+#include "ps/sarray.h"
 
-// Row based partition for a parameter matrix [startRow, endRow) [startCol, endCol)
-// @param matrix the origin matrix value
-// @param matrixmeta the origin matrixmeta
-// @param PartitionMatrix the row base partitioned matrix value
-// @param the meta for every partitioned matrix
+// Block based partition for a parameter matrix [startRow, endRow) [startCol, endCol)
+// the blocks and their servers are decided by the matrix meta service on the scheduler
+// (RangePartitioner), so a 1 x N vector is split by columns over all the servers and a
+// matrix with many rows is tiled in 2D.
+// the blocks of a matrix are ordered row-major, i.e. the blocks covering the same rows
+// are adjacent and sorted by column.
 
 
 using namespace ps;
@@ -19,122 +26,294 @@ class Partition{
 
 private:
 
+ // the routing of one matrix, compiled once when the matrix is registered, so a lookup
+ // is a few arithmetic operations on flat arrays
+ struct Layout{
 
- std::unordered_map<int,std::vector<int> > MatrixToPS; // matrixId to Ps server rank 
- std::unordered_map<int,std::unordered_map<int,int>> MatrixToRowToPS; // matrixId->(RowIndex->PS) matrixId-> RowId->PS server rank 
+  MatrixMeta meta; // the blocks size and the ps server rank of every block
+  int colBlocks; // the number of blocks covering one row
+  std::vector<PartitionMeta> parts;
+  std::vector<Key> keys; // block id to key
 
+  // every block row (column) but the last has blockRow rows (blockCol columns), then
+  // the block of a row is found by a division, otherwise by searching the boundaries
+  bool uniformRows;
+  bool uniformCols;
+  std::vector<long> rowStarts; // the first row of every block row, ascending
+  std::vector<long> colStarts; // the first column of every block column, ascending
+
+  mutable std::atomic<int> priority; // of the requests of the matrix, may change
+
+  // the block row covering row
+  int RowBlock(int row) const {
+    return uniformRows ? (row-meta.startRow)/meta.blockRow : Locate(rowStarts,row);
+  }
+
+  // the block column covering col
+  int ColBlock(long col) const {
+    return uniformCols ? (col-meta.startCol)/meta.blockCol : Locate(colStarts,col);
+  }
+
+ };
+
+ // the index of the last element of starts not larger than x, branch-free
+ static int Locate(const std::vector<long>& starts, long x){
+
+   const long* base = starts.data();
+   size_t n = starts.size();
+   while(n>1){
+     size_t half = n/2;
+     base = (base[half]<=x) ? base+half : base;
+     n -= half;
+   }
+   return base-starts.data();
+
+ }
+
+ // matrix ids are allocated densely by the scheduler, so they index a table of chunks
+ // of kChunk layouts, allocated on demand. the ids given by the user may be large, which
+ // are kept in a map instead, copied on every registration. a layout never changes once
+ // registered and is published by an atomic pointer, so the lookups take no lock
+ static const int kChunk = 256;
+ static const int kDenseIds = kChunk*256;
+ typedef std::atomic<const Layout*> Slot;
+ typedef std::unordered_map<int,const Layout*> SparseMap;
+ std::atomic<Slot*> DenseLayout[kDenseIds/kChunk];
+ std::shared_ptr<const SparseMap> SparseLayout;
+ std::vector<std::unique_ptr<Layout>> Layouts; // owns the layouts, written by Register
+
+ // the priority of the requests of every matrix, see SetPriority
+ std::unordered_map<int,int> Priorities;
+
+ // the layout of matrix, nullptr if it is not registered
+ const Layout* find(int matrixId) const {
+
+   if(matrixId>=0 && matrixId<kDenseIds){
+     const Slot* chunk = DenseLayout[matrixId/kChunk].load(std::memory_order_acquire);
+     return chunk ? chunk[matrixId%kChunk].load(std::memory_order_acquire) : nullptr;
+   }
+   std::shared_ptr<const SparseMap> sparse = std::atomic_load(&SparseLayout);
+   if(!sparse) return nullptr;
+   auto it = sparse->find(matrixId);
+   return it==sparse->end() ? nullptr : it->second;
+
+ }
+
+ const Layout& layout(int matrixId) const {
+
+   const Layout* l = find(matrixId);
+   CHECK(l)<<"matrixId "<<matrixId<<" not exist";
+   return *l;
+
+ }
 
 
 public:
 
+// Register and SetPriority must not run concurrently, the other methods are threadsafe
+// and take no lock
+
+Partition(){ for(auto& chunk : DenseLayout) chunk.store(nullptr); }
+
+~Partition(){ for(auto& chunk : DenseLayout) delete[] chunk.load(); }
+
+Partition(const Partition&) = delete;
+Partition& operator=(const Partition&) = delete;
+
+bool HasMatrix(int matrixId) const { return find(matrixId)!=nullptr; }
+
+// compile the routing of a matrix created by the scheduler, only done at the first time
+void Register(const MatrixMeta& matrixmeta){
+
+    int matrixId = matrixmeta.getId();
+    if(HasMatrix(matrixId)) return;
+    CHECK_GE(matrixId,0);
+
+    Layout* l = new Layout();
+    Layouts.emplace_back(l);
+    l->meta = matrixmeta;
+    l->parts = matrixmeta.getPartitions();
+    l->colBlocks = matrixmeta.getColBlocks();
+    auto it = Priorities.find(matrixId);
+    l->priority = it==Priorities.end() ? 0 : it->second;
+
+    // the keys only depend on the matrix, the block and the server holding it, so all
+    // the workers derive the same keys. migrations keep the base router, so they are fixed.
+    // a router placing the keys itself put the block on the server of its key id already
+    auto router = Postoffice::Get()->GetKeyRouter();
+    for(size_t i = 0 ;i< l->parts.size();i++){
+      Key id = BlockKeyId(matrixId,i);
+      l->keys.push_back(router->places_keys() ? id : router->KeyOfServer(matrixmeta.servers[i],id));
+    }
+
+    for(size_t i = 0 ;i< l->parts.size();i+=l->colBlocks) l->rowStarts.push_back(l->parts[i].startRow);
+    for(int i = 0 ;i< l->colBlocks;i++) l->colStarts.push_back(l->parts[i].startCol);
+    l->uniformRows = l->uniformCols = true;
+    for(size_t i = 0 ;i< l->rowStarts.size();i++)
+      if(l->rowStarts[i]!=matrixmeta.startRow+(long)i*matrixmeta.blockRow) l->uniformRows = false;
+    for(size_t i = 0 ;i< l->colStarts.size();i++)
+      if(l->colStarts[i]!=matrixmeta.startCol+(long)i*matrixmeta.blockCol) l->uniformCols = false;
+
+    // published once complete
+    if(matrixId<kDenseIds){
+      std::atomic<Slot*>& chunk = DenseLayout[matrixId/kChunk];
+      if(!chunk.load()) chunk.store(new Slot[kChunk](),std::memory_order_release);
+      chunk.load()[matrixId%kChunk].store(l,std::memory_order_release);
+    }else{
+      std::shared_ptr<const SparseMap> old = std::atomic_load(&SparseLayout);
+      std::shared_ptr<SparseMap> sparse = old ? std::make_shared<SparseMap>(*old) : std::make_shared<SparseMap>();
+      (*sparse)[matrixId] = l;
+      std::atomic_store(&SparseLayout,std::shared_ptr<const SparseMap>(sparse));
+    }
+
+}
 
-std::vector<int>& MatrixToPs(int matrixId){
+// the priority of the requests of matrix, 0 by default. it may be set before the matrix
+// is registered
+void SetPriority(int matrixId, int priority){
 
- if(MatrixToPS.find(matrixId)!=MatrixToPS.end())
-          return MatrixToPS[matrixId];
- else {LOG(ERROR)<<"matrixId not exist";}
+  Priorities[matrixId] = priority;
+  const Layout* l = find(matrixId);
+  if(l) l->priority = priority;
 
 }
 
-int MatrixRowToPs(int matrixId, int rowId){
-if(MatrixToRowToPS.find(matrixId)!=MatrixToRowToPS.end()){
-       if( MatrixToRowToPS[matrixId].find(rowId)!=MatrixToRowToPS[matrixId].end())return MatrixToRowToPS[matrixId][rowId];
-       else LOG(ERROR)<<"rowid not exit in matrix";
+int Priority(int matrixId) const {
+
+  const Layout* l = find(matrixId);
+  return l ? l->priority.load(std::memory_order_relaxed) : 0;
+
 }
-else {LOG(ERROR)<<"matrixId not exist";}
+
+// the blocks of matrix
+const std::vector<PartitionMeta>& MatrixToParts(int matrixId) const { return layout(matrixId).parts; }
+
+// the ps server rank of every block of matrix
+const std::vector<int>& MatrixToPs(int matrixId) const { return layout(matrixId).meta.servers; }
+
+// the key of every block of matrix
+const std::vector<Key>& MatrixToKeys(int matrixId) const { return layout(matrixId).keys; }
+
+// the blocks covering rowId, sorted by column
+std::vector<int> RowToParts(int matrixId, int rowId) const {
+
+  const Layout& l = layout(matrixId);
+  CHECK_GE(rowId,l.meta.startRow); CHECK_LT(rowId,l.meta.endRow);
+  int first = l.RowBlock(rowId)*l.colBlocks;
+  std::vector<int> ret;
+  for(int i = first; i< first+l.colBlocks;i++) ret.push_back(i);
+  return ret;
+
 }
 
-std::unordered_map<int,int>& MatrixToPsRow(int matrixId){
+// the keys of the blocks covering rowId, sorted by column
+std::vector<Key> RowToKeys(int matrixId, int rowId) const {
 
+  const Layout& l = layout(matrixId);
+  CHECK_GE(rowId,l.meta.startRow); CHECK_LT(rowId,l.meta.endRow);
+  auto first = l.keys.begin()+l.RowBlock(rowId)*l.colBlocks;
+  return std::vector<Key>(first,first+l.colBlocks);
 
-if(MatrixToRowToPS.find(matrixId)!=MatrixToRowToPS.end()){
-   
-        return MatrixToRowToPS[matrixId];
-       
 }
-else {LOG(ERROR)<<"matrixId not exist";}
+
+// the number of blocks covering a row of matrix
+int RowBlocks(int matrixId) const { return layout(matrixId).colBlocks; }
+
+// the keys of the blocks covering each of rows[0..n), RowBlocks of them per row sorted by
+// column, into out. the block rows of a batch are found first by a loop without branches,
+// which the compiler vectorizes
+void RowsToKeys(int matrixId, const int* rows, size_t n, Key* out) const {
+
+  const Layout& l = layout(matrixId);
+  const int colBlocks = l.colBlocks;
+  int first[64];
+  for(size_t i = 0 ;i< n;i+=64){
+    size_t m = std::min<size_t>(64,n-i);
+    int lo = rows[i], hi = rows[i];
+    for(size_t j = 0 ;j< m;j++){ lo = std::min(lo,rows[i+j]); hi = std::max(hi,rows[i+j]); }
+    CHECK_GE(lo,l.meta.startRow); CHECK_LT(hi,l.meta.endRow);
+    if(l.uniformRows){
+      const int startRow = l.meta.startRow, blockRow = l.meta.blockRow;
+      for(size_t j = 0 ;j< m;j++) first[j] = (rows[i+j]-startRow)/blockRow*colBlocks;
+    }else{
+      for(size_t j = 0 ;j< m;j++) first[j] = Locate(l.rowStarts,rows[i+j])*colBlocks;
+    }
+    for(size_t j = 0 ;j< m;j++)
+      std::copy(l.keys.data()+first[j],l.keys.data()+first[j]+colBlocks,out+(i+j)*colBlocks);
+  }
 
 }
 
-void RowPartition(const std::vector<Val>& matrix, const ServerMatrixMeta& matrixmeta, std::vector<std::vector<Val>> & PartitionMatrix, std::vector<ServerMatrixMeta>& PartitionMeta){
+// the blocks covering colId, sorted by row
+std::vector<int> ColToParts(int matrixId, int colId) const {
 
+  const Layout& l = layout(matrixId);
+  CHECK_GE(colId,l.meta.startCol); CHECK_LT(colId,l.meta.endCol);
+  std::vector<int> ret;
+  for(size_t i = l.ColBlock(colId); i< l.parts.size();i+=l.colBlocks) ret.push_back(i);
+  return ret;
 
-    size_t  matrixLen = matrix.size(); //
+}
 
 
-    int matrixId = matrixmeta.matrixId;
-    psfType type = matrixmeta.type;
-    CHECK_EQ(type,psfType::PushAll); // only PushAll use RowPartition
-     
-
-
-    //
-    int startRow = matrixmeta.startRow;
-    int startCol = matrixmeta.startCol;
-    int endRow = matrixmeta.endRow;
-    int endCol = matrixmeta.endCol;
-    int elePerRow = endCol-startCol;
-    int elePerCol = endRow-startRow;
-    int eleTotal = elePerRow*elePerCol;
-    CHECK_EQ((size_t)eleTotal,matrixLen);
-
-    // compute the startRow and endRow for every server
-    const std::vector<Range>& ranges = Postoffice::Get()->GetServerKeyRanges();
-    size_t size = ranges.size();
-    
-
-    std::vector<int> RowNum(size,elePerCol/size);
-    for(size_t i = 0 ; i< elePerCol%size ;i++) {
-    RowNum[i]++;
-   }
- 
+// cut a row-major matrix into its blocks, the values of every block are row-major and
+// concatenated into PartitionVals in the block order
+void BlockPartition(const std::vector<Val>& matrix, const ServerMatrixMeta& matrixmeta, std::vector<Val>& PartitionVals, std::vector<int>& lens, std::vector<ServerMatrixMeta>& PartitionMeta) const {
 
-  int realSize=0;
-  for(auto& e:RowNum) if(e!=0) realSize++;   
-   
 
-   //PartitionMatrix.resize(realSize);
-   //PartitionMeta.resize(realSize);
+    int matrixId = matrixmeta.matrixId;
+    psfType type = matrixmeta.type;
+    CHECK_EQ(type,psfType::PushAll); // only PushAll use BlockPartition
 
-   std::vector<int> startPos;
-   startPos.push_back(startRow);
-   for(int i = 1; i<realSize;i++) { int PrevEndRow = startPos[i-1]+RowNum[i-1]; startPos.push_back(PrevEndRow); }
+    const Layout& l = layout(matrixId);
+    CHECK_EQ(matrixmeta.startRow,l.meta.startRow); CHECK_EQ(matrixmeta.endRow,l.meta.endRow);
+    CHECK_EQ(matrixmeta.startCol,l.meta.startCol); CHECK_EQ(matrixmeta.endCol,l.meta.endCol);
 
+    int elePerRow = matrixmeta.endCol-matrixmeta.startCol;
+    int elePerCol = matrixmeta.endRow-matrixmeta.startRow;
+    CHECK_EQ((size_t)elePerRow*elePerCol,matrix.size());
 
-   for(int i = 0 ; i <realSize ;i++){
+    PartitionVals.reserve(matrix.size());
 
-    if(RowNum[i]!=0){
+    for(const auto& part : l.parts){
 
-     // 
-     MatrixToPS[matrixId].push_back(i);
-     for(int j = 0 ; j <RowNum[i];j++) MatrixToRowToPS[matrixId][startPos[i]+j] = i;
-  
+      for(int r = part.startRow; r< part.endRow;r++){
 
-    int startEle = (startPos[i]-startRow)*elePerRow;
-    int endEle = startEle + RowNum[i]* elePerRow;
+        auto itStart = matrix.begin()+(size_t)(r-matrixmeta.startRow)*elePerRow+(part.startCol-matrixmeta.startCol);
+        PartitionVals.insert(PartitionVals.end(),itStart,itStart+(part.endCol-part.startCol));
 
-    typename  std::vector<Val>::const_iterator itStart  = matrix.begin();
-    itStart+=startEle;
-    typename  std::vector<Val>::const_iterator itEnd  = matrix.begin();
-    itEnd+=endEle;
+      }
 
-    std::vector<Val> parMatrix(itStart,itEnd);
-    
-    PartitionMatrix.push_back(parMatrix);
+      lens.push_back(part.size());
 
-    ServerMatrixMeta parMeta(type, matrixId, i, startPos[i],startPos[i]+RowNum[i],startCol,endCol,-1); // ServerMatrixMeta(psfType type, int matrixId, int partId, int startRow, int endRow, int startCol, int endCol, int rowIndex)
-    PartitionMeta.push_back(parMeta);
+      ServerMatrixMeta parMeta(type, matrixId, part.partId, part.startRow,part.endRow,part.startCol,part.endCol,-1); // ServerMatrixMeta(psfType type, int matrixId, int partId, int startRow, int endRow, int startCol, int endCol, int rowIndex)
+      PartitionMeta.push_back(parMeta);
 
-  }
+    }
 
- 
 }
 
+// cut one row of a matrix into the segments of the blocks covering it, the segments
+// are adjacent in row, so only lens and metas are generated, straight into the arrays sent
+void RowSplit(const std::vector<Val>& row, const ServerMatrixMeta& rowmeta, SArray<int>& lens, SArray<ServerMatrixMeta>& PartitionMeta) const {
+
+    int matrixId = rowmeta.matrixId;
+    const Layout& l = layout(matrixId);
+    CHECK_EQ(row.size(),(size_t)(l.meta.endCol-l.meta.startCol));
 
+    CHECK_GE(rowmeta.rowIndex,l.meta.startRow); CHECK_LT(rowmeta.rowIndex,l.meta.endRow);
+    int first = l.RowBlock(rowmeta.rowIndex)*l.colBlocks;
+    lens.reserve(l.colBlocks,0);
+    PartitionMeta.reserve(l.colBlocks,ServerMatrixMeta());
+    for(int i = first; i< first+l.colBlocks; i++){
 
+      const auto& part = l.parts[i];
+      lens.push_back(part.endCol-part.startCol);
+      ServerMatrixMeta parMeta(rowmeta.type, matrixId, part.partId, part.startRow,part.endRow,part.startCol,part.endCol,rowmeta.rowIndex);
+      PartitionMeta.push_back(parMeta);
 
+    }
 
-    
 }
 
 };
@@ -1,99 +1,196 @@
 #include "ps/kv_app.h"
+#include "ps/future.h"
 #include "psf/Partition/RowPartition.h"
+#include "psf/Matrix/PSMatrixMetaManager.h"
+#include "psf/Matrix/MatrixContext.h"
 #include "psf/psf/PSFunc.h"
 #include "ps/base.h"
 #include <vector>
 #include "psf/server/serverMatrixMeta.h"
 #include "psf/client/ReqMatrixMeta.h"
+#include<algorithm>
 #include<unordered_map>
+#include<memory>
+#include<mutex>
+#include<sstream>
+#include<string>
 
 using namespace ps;
 
+// matrix partitions and keys, shared by all the clients of a worker process. the routing
+// of a matrix never changes once registered, so the compute threads read it without a lock
+template<typename Val>
+struct ClientRouting{
+
+ Partition<Val> par; // the matrices known to this process, filled from the meta agent
+
+ std::mutex mu; // serializes the registrations and the priority changes of par
+
+};
+
+// a client owns one KVWorker (one customer and its receiving thread), so every
+// compute thread of a worker process should use its own client; clients created
+// with the sharing constructor use the same matrix routing and connections.
 template<typename Val>
 class Client{
 
 private:
 
  KVWorker<Val> kv;
- 
- Partition<Val> par; 
- 
- int globalId;
 
- std::unordered_map<int,std::vector<Key>> matrixToKey;
- std::unordered_map<int,std::unordered_map<int,Key>> matrixRowToKey;
+ std::shared_ptr<ClientRouting<Val>> route;
 
 public:
 
 
- Client(int app_id, int customer_id):kv(app_id,customer_id),globalId(0){
+ Client(int app_id, int customer_id):kv(app_id,customer_id),route(std::make_shared<ClientRouting<Val>>()){
 
- //kv = KVWorker<Val>(app_id,customer_id);
+   // the scheduler moves partitions between servers at runtime
+   kv.set_request_handle([](const SimpleData& req, SimpleApp* app){
+       if(req.head==balanceCmd::RouterUpdate) UpdateRouter(req.body);
+       app->Response(req);
+     });
 
- this->par = Partition<Val>();
+   // the matrix metas broadcast by the scheduler are cached from now on
+   PSAgentMatrixMetaManager::Get();
 
  }
 
- std::vector<Key>& findKey(int matrixId,std::vector<int> ps, std::unordered_map<int,int> psRow){ // rowId to ps rank
+ // route the partitions listed in body, "key primary [replica ...]" per line, to
+ // their new servers, reads are spread over the primary and the replicas
+ static void UpdateRouter(const std::string& body){
+
+   std::unordered_map<Key,int> moved;
+   std::unordered_map<Key,std::vector<int>> replicas;
+   std::istringstream lines(body);
+   std::string line;
+   while(std::getline(lines,line)){
+     std::istringstream is(line);
+     Key key; int rank;
+     if(!(is>>key>>rank)) continue;
+     moved[key]=rank;
+     while(is>>rank) replicas[key].push_back(rank);
+   }
 
-   if(matrixToKey.find(matrixId)!=matrixToKey.end()) return matrixToKey[matrixId];
+   auto router = Postoffice::Get()->GetKeyRouter();
+   auto migrated = std::dynamic_pointer_cast<const MigratedKeyRouter>(router);
+   Postoffice::Get()->UpdateKeyRouter(std::make_shared<MigratedKeyRouter>(migrated ? migrated->base() : router, moved, replicas));
 
-   std::vector<Key> new_key;
-   const std::vector<Range>& ranges = Postoffice::Get()->GetServerKeyRanges();
-   for(size_t i = 0 ;i< ps.size();i++)  new_key.push_back(ranges[ps[i]].begin()+globalId);
-   matrixToKey[matrixId]=new_key;
-    
-   std::unordered_map<int,Key> newpsRow;
-   for(auto & e: psRow){
-     
-        newpsRow[e.first] = ranges[e.second].begin()+globalId;
+ }
 
-    }
-   
-   this->matrixRowToKey[matrixId] = newpsRow;
+ // a client for another thread sharing the matrix routing of other
+ Client(int app_id, int customer_id, const Client& other):kv(app_id,customer_id),route(other.route){
+
+ }
+
+ // the priority of the pushes and pulls of a matrix, 0 by default. with the p3 van a
+ // message of a higher priority overtakes the slices of lower ones, on the sender and
+ // on the receiver. give the layers used first by the forward pass the highest
+ // priorities, e.g. minus the layer index, so their gradients go out first
+ void SetPriority(int matrixId, int priority){
 
-   globalId++;
+   std::lock_guard<std::mutex> lk(route->mu);
+   route->par.SetPriority(matrixId,priority);
 
-   return matrixToKey[matrixId];
  }
 
-  Key findRowKey(int matrixId, int rowId){
+ // the key of every block of matrix, see Partition::Register
+ const std::vector<Key>& findKey(int matrixId){
 
-     
-       return this->matrixRowToKey[matrixId][rowId]; 
+   return route->par.MatrixToKeys(matrixId);
+
+ }
+
+ // the keys of some blocks of matrix
+ std::vector<Key> findKey(int matrixId, const std::vector<int>& parts){
 
+   const std::vector<Key>& all = findKey(matrixId);
+   std::vector<Key> keys;
+   for(int i : parts) keys.push_back(all[i]);
+   return keys;
 
+ }
+
+ // make sure the blocks of matrix are known, asking the scheduler on the first use. if
+ // shape is given and no worker created the matrix yet, it is created under matrixId.
+ // a known matrix is found without a lock, route->mu is only taken to register a new one
+ void Lookup(int matrixId, const ServerMatrixMeta* shape = nullptr){
+
+   if(route->par.HasMatrix(matrixId)) return;
+
+   MatrixMeta meta;
+   PSAgentMatrixMetaManager* agent = PSAgentMatrixMetaManager::Get();
+   if(!agent->getMatrixMeta(matrixId,&meta)){
+     CHECK(shape) << "matrix "<<matrixId<<" does not exist";
+     meta = agent->createMatrix(std::to_string(matrixId),matrixId,shape->startRow,shape->endRow,shape->startCol,shape->endCol);
+     CHECK_EQ(meta.getId(),matrixId) << "matrix id "<<matrixId<<" is taken by another matrix";
    }
+   std::lock_guard<std::mutex> lk(route->mu);
+   route->par.Register(meta);
 
- 
+ }
+
+ // create the matrix described by context, or get it if some worker created it already.
+ // the scheduler decides the id (unless context has one), the blocks (unless context
+ // sets the block size) and the servers once, so the matrix is routed the same way on
+ // every worker. the servers allocate and zero the blocks before this returns, so the
+ // first push pays no allocation. returns the matrix id
+ int CreateMatrix(MatrixContext context){
+
+   context.init();
+   long startCol = context.getIndexStart(), endCol = context.getIndexEnd();
+   MatrixMeta meta = PSAgentMatrixMetaManager::Get()->createMatrix(context.getName(),context.getMatrixId(),
+       0,context.getRowNum(),startCol,endCol,context.getMaxRowNumInBlock(),context.getMaxColNumInBlock(),
+       context.getValidIndexNum());
+   CHECK(meta.sameShape(0,context.getRowNum(),startCol,endCol)) << "matrix "<<context.getName()<<" exists with another shape";
+
+   {
+     std::lock_guard<std::mutex> lk(route->mu);
+     route->par.Register(meta);
+   }
+   int matrixId = meta.getId();
+   const std::vector<Key>& keys = findKey(matrixId);
 
+   std::vector<int> lens(keys.size(),0);
+   std::vector<ServerMatrixMeta> metas;
+   for(const auto& part : meta.getPartitions())
+     metas.push_back(ServerMatrixMeta(psfType::PushAll,matrixId,part.partId,part.startRow,part.endRow,part.startCol,part.endCol,-1));
+   kv.Wait(kv.Push(keys,std::vector<Val>(),lens,metas,metaCmd::MatrixAlloc));
 
+   return matrixId;
+
+ }
 
- int Push(std::vector<Val>& matrix, ServerMatrixMeta meta){
+ // create a rows x cols matrix called name, see above
+ int CreateMatrix(const std::string& name, int rows, long cols){
+
+   return CreateMatrix(MatrixContext(name,rows,cols));
+
+ }
+
+
+ using Callback = typename KVWorker<Val>::Callback;
+
+ int Push(std::vector<Val>& matrix, ServerMatrixMeta meta, const Callback& cb = nullptr){
 
    psfType type = meta.type;
-  
+
    switch(type){
 
    case psfType::PushAll:
     {
-     
-     std::vector<std::vector<float>> partitionMatrix;
-     std::vector<ServerMatrixMeta> partitionMeta;
-     this->par.RowPartition(matrix, meta,partitionMatrix,partitionMeta);
-     std::vector<int> lens;
-     for(size_t i = 0 ; i < partitionMatrix.size();i++) lens.push_back(partitionMatrix[i].size());
 
-     /////////
-//     std::cout<<"partitionMatrix size: "<<partitionMatrix.size()<<std::endl;
-//     for(auto & e: partitionMeta) std::cout<< e.partId << std::endl;
-      
-     //////////
+     std::vector<Val> vals;
+     std::vector<int> lens;
+     std::vector<ServerMatrixMeta> partitionMeta;
+     Lookup(meta.matrixId,&meta);
+     route->par.BlockPartition(matrix, meta,vals,lens,partitionMeta);
 
      int matrixId = meta.matrixId;
-     const std::vector<Key>& keys = findKey(matrixId,this->par.MatrixToPs(matrixId),this->par.MatrixToPsRow(matrixId));
+     const std::vector<Key>& keys = findKey(matrixId);
      // keys , vals
-      int ts = kv.Push(keys,matrix,lens, partitionMeta);
+      int priority = priorityOf(matrixId);
+      int ts = kv.Push(keys,vals,lens, partitionMeta, 0, cb, priority);
       return ts;
      
      }
@@ -105,18 +202,17 @@ public:
      {
       int matrixId = meta.matrixId;
       int rowId = meta.rowIndex;
-      
-      //int ps =  this->par.MatrixRowTops(matrixId, rowId); // RowPartition, row exit on one ps machine
-      
-      //const std::vector<Range>& ranges = Postoffice::Get()->GetServerKeyRanges();
-      
-      std::vector<int> lens{(int)matrix.size()};
 
-      Key key = findRowKey(matrixId,rowId);
-      
-      std::vector<Key> keys{key};// for the purpose of send the update request to ps server , not to store it, so not need to generate a new key,     
-      std::vector<ServerMatrixMeta> metas{meta};
-      int ts = kv.Push(keys,matrix,lens,metas);
+      // the row is cut into the column blocks covering it, built right into the arrays sent
+      Lookup(matrixId);
+      SArray<Key> keys(route->par.RowBlocks(matrixId),0);
+      route->par.RowsToKeys(matrixId,&rowId,1,keys.data());
+      SArray<int> lens;
+      SArray<ServerMatrixMeta> metas;
+      route->par.RowSplit(matrix,meta,lens,metas);
+
+      int priority = priorityOf(matrixId);
+      int ts = kv.ZPush(keys,SArray<Val>(matrix),lens,metas, 0, cb, priority);
       return ts;
       
      }
@@ -126,35 +222,63 @@ public:
 
   default:
 
-    LOG(ERROR)<<"unsupporeted psfType";
+    LOG(FATAL)<<"unsupported psfType "<<static_cast<int>(type)<<" to push";
 
 
   }
+  return -1;
  }
 
 
   void Wait(int timestamp) { kv.Wait(timestamp); }
 
+  // non-blocking check whether the request of timestamp has finished
+  bool Test(int timestamp) { return kv.Test(timestamp); }
+
+  // asynchronous Push, the returned future is ready once all servers applied the push
+  Future PushAsync(std::vector<Val>& matrix, ServerMatrixMeta meta){
+
+    Promise done;
+    done.set_timestamp(Push(matrix, meta, [done]() { done.Set(); }));
+    return done.GetFuture();
+
+  }
+
+  // asynchronous Pull, vals and lens are filled once the returned future is ready,
+  // so they must stay alive until then
+  Future PullAsync(std::vector<Val>& vals, std::vector<int>& lens, ReqMatrixMeta req){
+
+    Promise done;
+    done.set_timestamp(Pull(vals, lens, req, [done]() { done.Set(); }));
+    return done.GetFuture();
+
+  }
+
 
   //kv.Pull(keys,&ret,req,&lens_));
   
-  int Pull(std::vector<Val>& vals, std::vector<int>& lens, ReqMatrixMeta req){
+  int Pull(std::vector<Val>& vals, std::vector<int>& lens, ReqMatrixMeta req, const Callback& cb = nullptr){
  
         psfType type = req.type;
-        const std::vector<Range>& ranges = Postoffice::Get()->GetServerKeyRanges();
         
         switch(type){
        
          case psfType::GetRow:
+         case psfType::RowSum:
           {
+               // one request for every block covering the row, built right into the
+               // arrays sent
                int matrixId = req.matrixId;
                int rowId = req.rowIndex;
-               int ps = this->par.MatrixRowToPs(matrixId,rowId);
-               std::vector<Key> keys{ranges[ps].begin()};
-               req.key = findRowKey(matrixId,rowId);
-               std::vector<ReqMatrixMeta> reqs(1,req);
-               
-               int ts = kv.Pull(keys,&vals,reqs,&lens);
+               Lookup(matrixId);
+               int n = route->par.RowBlocks(matrixId);
+               SArray<Key> keys(n,0);
+               route->par.RowsToKeys(matrixId,&rowId,1,keys.data());
+               SArray<ReqMatrixMeta> reqs(n,req);
+               for(int i = 0 ; i < n;i++) reqs[i].key = keys[i];
+
+               int priority = priorityOf(matrixId);
+               int ts = kv.ZPull(keys,&vals,reqs,&lens,0,cb,priority);
                return ts;
 
           }
@@ -163,55 +287,58 @@ public:
              {
 
                int matrixId = req.matrixId;
-               const std::vector<int>& ps = this->par.MatrixToPs(matrixId);
-               const  std::vector<Key>& keys = findKey(matrixId,ps,this->par.MatrixToPsRow(matrixId));
-               std::vector<ReqMatrixMeta> reqs(ps.size(),req);
+               Lookup(matrixId);
+               const std::vector<Key>& keys = findKey(matrixId);
+               const auto& parts = route->par.MatrixToParts(matrixId);
+               std::vector<ReqMatrixMeta> reqs(keys.size(),req);
                for(size_t i = 0 ; i < reqs.size();i++){
                      ReqMatrixMeta& meta = reqs[i];
                      meta.key = keys[i];
+                     // the block shape lets the worker pull a large block in chunks
+                     meta.setStartRow(parts[i].startRow); meta.setEndRow(parts[i].endRow);
+                     meta.setStartCol(parts[i].startCol); meta.setEndCol(parts[i].endCol);
                 }
-               int ts = kv.Pull(keys,&vals,reqs,&lens);
+               int priority = priorityOf(matrixId);
+               int ts = kv.Pull(keys,&vals,reqs,&lens,0,cb,priority);
                return ts;
              
             }
              break;
-           case psfType::RowSum:
-             {
-
-               int matrixId = req.matrixId;
-               int rowId = req.rowIndex;
-               int ps = this->par.MatrixRowToPs(matrixId,rowId);
-               std::vector<Key> keys{ranges[ps].begin()};
-               req.key = findRowKey(matrixId,rowId);
-               std::vector<ReqMatrixMeta> reqs(1,req);
-               int ts = kv.Pull(keys,&vals,reqs,&lens);
-               return ts;
-
-             }
-            break;
 
            case psfType::ColDot:
             {
 
+                // every block of column1 is paired with the block of column2 covering
+                // the same rows, which must be on the same server
                 int matrixId1 = req.matrixId;
                 int matrixId2 = req.matrixId2;
-                const std::vector<int>& ps1 = this->par.MatrixToPs(matrixId1); // same for matrix2
-                const std::vector<int>& ps2 = this->par.MatrixToPs(matrixId2); // same for matrix2
+                Lookup(matrixId1);
+                Lookup(matrixId2);
+                std::vector<int> parts1 = route->par.ColToParts(matrixId1,req.colIndex);
+                std::vector<int> parts2 = route->par.ColToParts(matrixId2,req.colIndex2);
+                CHECK_EQ(parts1.size(),parts2.size()) << "matrix "<<matrixId1<<" and "<<matrixId2<<" are partitioned differently";
+
+                const std::vector<PartitionMeta>& blocks1 = route->par.MatrixToParts(matrixId1);
+                const std::vector<PartitionMeta>& blocks2 = route->par.MatrixToParts(matrixId2);
+                for(size_t i = 0 ;i < parts1.size();i++){
+                     CHECK_EQ(blocks1[parts1[i]].startRow,blocks2[parts2[i]].startRow);
+                     CHECK_EQ(blocks1[parts1[i]].endRow,blocks2[parts2[i]].endRow);
+                     CHECK_EQ(route->par.MatrixToPs(matrixId1)[parts1[i]],route->par.MatrixToPs(matrixId2)[parts2[i]])
+                         << "column "<<req.colIndex<<" and "<<req.colIndex2<<" are on different servers";
+                }
 
-                const std::vector<Key>& keys1 = findKey(matrixId1,ps1,this->par.MatrixToPsRow(matrixId1));
-                const std::vector<Key>& keys2 = findKey(matrixId2,ps2,this->par.MatrixToPsRow(matrixId2));
-                std::vector<ReqMatrixMeta> reqs(ps1.size(),req);
+                const std::vector<Key> keys1 = findKey(matrixId1,parts1);
+                const std::vector<Key> keys2 = findKey(matrixId2,parts2);
+                std::vector<ReqMatrixMeta> reqs(keys1.size(),req);
             
                 for(size_t i = 0 ;i < reqs.size();i++){
                      ReqMatrixMeta& meta = reqs[i];
                      meta.key = keys1[i];
                      meta.key2= keys2[i];           
                }
-               
-               for(auto e : keys1) std::cout<< e << std::endl;
-               for(auto e : keys2) std::cout<< e << std::endl;
 
-               int ts = kv.Pull(keys1,&vals,reqs,&lens); // use keys2 is ok , 
+               int priority = priorityOf(matrixId1);
+               int ts = kv.Pull(keys1,&vals,reqs,&lens,0,cb,priority); // use keys2 is ok , 
                return ts;
 
             }
@@ -219,10 +346,44 @@ public:
             break;
 
            default:
-               LOG(ERROR)<<"not supported psfType";
+               LOG(FATAL)<<"unsupported psfType "<<static_cast<int>(type)<<" to pull";
 
 
         }
+        return -1;
+
+  }
+
+  // GetRow of many rows of a matrix at once, req gives the matrix. vals gets the distinct
+  // rows in ascending order, lens the length of their segments, RowBlocks of the matrix per row.
+  // the blocks of all the rows are routed in one batch
+  int PullRows(std::vector<Val>& vals, std::vector<int>& lens, ReqMatrixMeta req,
+               const std::vector<int>& rows, const Callback& cb = nullptr){
+
+    CHECK(req.type==psfType::GetRow) << "only GetRow pulls many rows";
+    int matrixId = req.matrixId;
+    Lookup(matrixId);
+    std::vector<int> sorted(rows);
+    std::sort(sorted.begin(),sorted.end());
+    sorted.erase(std::unique(sorted.begin(),sorted.end()),sorted.end());
+    size_t n = route->par.RowBlocks(matrixId);
+    SArray<Key> keys(sorted.size()*n,0);
+    route->par.RowsToKeys(matrixId,sorted.data(),sorted.size(),keys.data());
+    SArray<ReqMatrixMeta> reqs(keys.size(),req);
+    for(size_t i = 0 ; i < reqs.size();i++){
+      reqs[i].key = keys[i];
+      reqs[i].rowIndex = sorted[i/n];
+    }
+    return kv.ZPull(keys,&vals,reqs,&lens,0,cb,priorityOf(matrixId));
+
+  }
+
+private:
+
+  // the priority of matrix
+  int priorityOf(int matrixId){
+
+    return route->par.Priority(matrixId);
 
   }
 
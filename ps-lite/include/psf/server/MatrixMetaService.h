@@ -0,0 +1,113 @@
+#ifndef _MATRIX_META_SERVICE_
+#define _MATRIX_META_SERVICE_
+
+#include <sstream>
+#include <string>
+#include "ps/simple_app.h"
+#include "psf/Matrix/MatrixMeta.h"
+#include "psf/Matrix/MatrixMetaManager.h"
+#include "psf/server/RangePartitioner.h"
+
+using namespace ps;
+
+/**
+ * Allocates the matrices, run by the scheduler.
+ *
+ * A matrix is created once, by the first worker asking for its name: the
+ * service picks the matrix id, splits the matrix into blocks and places them
+ * on the servers. The meta is returned to the worker and broadcast to all the
+ * workers with the new table version, so every worker routes the matrix the
+ * same way whatever the order it creates its matrices in.
+ */
+class MatrixMetaService : public SimpleApp {
+
+ public:
+
+  MatrixMetaService() : SimpleApp(kMatrixMetaApp, kMatrixMetaApp) {
+
+    set_request_handle([this](const SimpleData& req, SimpleApp* app) {
+        std::istringstream is(req.body);
+        std::ostringstream os;
+        switch (req.head) {
+          case metaCmd::CreateMatrix: {
+            std::string name; int id, startRow, endRow, blockRow; long startCol, endCol, blockCol, validIndexNum;
+            is >> name >> id >> startRow >> endRow >> startCol >> endCol >> blockRow >> blockCol >> validIndexNum;
+            MatrixMeta meta;
+            bool created = false;
+            int existing = table_.getMatrixId(name);
+            if (existing >= 0) {
+              table_.getMatrixMeta(existing, &meta);
+            } else {
+              MatrixContext context(name, endRow - startRow, endCol - startCol, blockRow, blockCol);
+              context.setMatrixId(id);
+              context.setValidIndexNum(validIndexNum);
+              meta = Allocate(context, startRow, startCol);
+              table_.addMatrix(meta);
+              table_.updateVersion(table_.getVersion() + 1);
+              created = true;
+            }
+            os << table_.getVersion() << "\n" << meta;
+            Response(req, os.str());
+            // a new request may block for a slot, which only the receiving
+            // thread frees, so another thread sends it
+            if (created) {
+              std::string table = os.str();
+              Defer([this, table] { Request(metaCmd::MatrixTable, table, kWorkerGroup); });
+            }
+            break;
+          }
+          case metaCmd::GetMatrix: {
+            int id = -1;
+            is >> id;
+            MatrixMeta meta;
+            os << table_.getVersion() << "\n";
+            if (table_.getMatrixMeta(id, &meta)) os << meta;
+            Response(req, os.str());
+            break;
+          }
+          default:
+            LOG(WARNING) << "unknown matrix meta request " << req.head;
+            Response(req);
+        }
+      });
+
+  }
+
+ private:
+
+  /**
+   * decide the id, the blocks and the servers of a new matrix
+   *
+   * @param context the shape and the block size asked by the worker, the matrix id is
+   *        picked by the service if it is -1 or taken
+   * @param startRow startCol the origin of the matrix
+   */
+  MatrixMeta Allocate(MatrixContext context, int startRow, long startCol) {
+
+    MatrixMeta meta;
+    int id = context.getMatrixId();
+    meta.id = (id >= 0 && !table_.exists(id)) ? id : table_.nextMatrixId();
+    meta.name = context.getName();
+    meta.startRow = startRow; meta.endRow = startRow + context.getRowNum();
+    meta.startCol = startCol; meta.endCol = startCol + context.getColNum();
+
+    context.setMatrixId(meta.id);
+    RangePartitioner partitioner;
+    partitioner.init(context);
+    for (const auto& part : partitioner.getPartitions()) {
+      meta.servers.push_back(partitioner.assignPartToServer(part.partId));
+    }
+    meta.blockRow = partitioner.getContext().getMaxRowNumInBlock();
+    meta.blockCol = partitioner.getContext().getMaxColNumInBlock();
+
+    PS_VLOG(1) << "create matrix " << meta.name << " id " << meta.id << " with "
+               << meta.servers.size() << " blocks";
+    return meta;
+
+  }
+
+  MatrixMetaManager table_;
+
+};
+
+#endif
@@ -0,0 +1,312 @@
+#ifndef _PARTITION_BALANCER_
+#define _PARTITION_BALANCER_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ps/simple_app.h"
+#include "ps/internal/postoffice.h"
+#include "psf/server/PartitionStats.h"
+
+using namespace ps;
+
+/**
+ * Moves matrix partitions from overloaded servers to idle ones, run by the scheduler.
+ *
+ * Every round, the servers report the requests and bytes of every partition since
+ * the last round, and the partitions it must stay with: the blocks of the same index
+ * and shape of other matrices, which the partitioner placed together so binary ops
+ * such as ColDot may pair them, and the ones binary ops paired with it.
+ * The cost of a partition is its bytes plus PS_BALANCE_REQUEST_BYTES per request,
+ * and the load of a server is the cost of its partitions. The partitions paired on
+ * a server form a group, which is moved and replicated as a whole. While the most
+ * loaded server has more than PS_BALANCE_RATIO times the load of the least loaded
+ * one, its largest group which lowers the maximum is moved to the least loaded
+ * server, at most PS_BALANCE_MAX_MOVES per round.
+ *
+ * A partition is moved by a two-phase handoff without stopping the workers:
+ * 1. the old server sends the partition to the new one and forwards all the
+ *    later requests about it, the responses go through the old server;
+ * 2. the workers get the new routing, which bumps their router version, then
+ *    the old server drops the partition but keeps forwarding requests in flight.
+ *
+ * A group with a partition read more than PS_REPLICA_THRESHOLD times per second gets read
+ * replicas on the PS_REPLICA_NUM least loaded other servers. Workers spread
+ * their pulls over the primary and the replicas, while pushes go to the primary,
+ * which sends the updated partitions to the replicas every PS_REPLICA_STALENESS
+ * milliseconds. Once the rate drops below half of the threshold, the workers
+ * stop reading the replicas, then the replicas are dropped.
+ */
+class PartitionBalancer : public SimpleApp {
+
+ public:
+
+  PartitionBalancer(int app_id, int customer_id) : SimpleApp(app_id, customer_id) {
+
+    set_response_handle([this](const SimpleData& res, SimpleApp* app) {
+        if (res.head != balanceCmd::PartStatsReq) return;
+        std::lock_guard<std::mutex> lk(mu_);
+        reports_[res.sender] = res.body;
+      });
+
+  }
+
+  virtual ~PartitionBalancer() { Stop(); }
+
+  /**
+   * start balancing every interval seconds in a background thread
+   */
+  void Start(int interval) {
+
+    CHECK_GT(interval, 0);
+    stop_ = false;
+    thread_ = std::unique_ptr<std::thread>(new std::thread(Postoffice::Inherit([this, interval]() {
+        while (true) {
+          {
+            std::unique_lock<std::mutex> lk(stop_mu_);
+            if (stop_cond_.wait_for(lk, std::chrono::seconds(interval), [this] { return stop_; })) break;
+          }
+          Balance();
+        }
+      })));
+
+  }
+
+  /**
+   * stop balancing, waits for the current round. must be called before Finalize
+   */
+  void Stop() {
+
+    if (!thread_) return;
+    {
+      std::lock_guard<std::mutex> lk(stop_mu_);
+      stop_ = true;
+    }
+    stop_cond_.notify_all();
+    thread_->join();
+    thread_.reset();
+
+  }
+
+  /**
+   * run one round
+   */
+  void Balance() {
+
+    Postoffice* po = Postoffice::Get();
+    int num_servers = po->num_servers();
+
+    // collect the statistics
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      reports_.clear();
+    }
+    Wait(Request(balanceCmd::PartStatsReq, "", kServerGroup));
+
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+
+    // the partitions paired on one server form a group, which is moved and
+    // replicated as a whole
+    double request_bytes = atof(GetEnv("PS_BALANCE_REQUEST_BYTES", std::string("1024")).c_str());
+    std::vector<double> load(num_servers, 0);
+    std::unordered_map<Key, uint64_t> requests; // of a partition and its replicas
+    std::unordered_map<Key, int> primary;
+    std::unordered_map<Key, double> cost; // of a primary
+    std::unordered_map<Key, Key> parent; // union-find of the groups
+    std::vector<std::pair<Key, Key>> pairs;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      for (const auto& r : reports_) {
+        int rank = po->IDtoRank(r.first);
+        std::istringstream is(r.second);
+        Key key; uint64_t req, bytes; int replica; size_t num_partners;
+        while (is >> key >> req >> bytes >> replica >> num_partners) {
+          // a request costs the same as this many bytes
+          double c = bytes + req * request_bytes;
+          load[rank] += c;
+          requests[key] += req;
+          for (size_t i = 0; i < num_partners; ++i) {
+            Key partner;
+            is >> partner;
+            if (!replica) pairs.push_back(std::make_pair(key, partner));
+          }
+          if (replica) continue;
+          primary[key] = rank;
+          cost[key] = c;
+          parent[key] = key;
+        }
+      }
+    }
+    std::function<Key(Key)> find = [&parent, &find](Key k) {
+      return parent[k] == k ? k : parent[k] = find(parent[k]);
+    };
+    for (const auto& p : pairs) {
+      auto partner = primary.find(p.second);
+      if (partner == primary.end() || partner->second != primary[p.first]) continue;
+      parent[find(p.first)] = find(p.second);
+    }
+    std::unordered_map<Key, Group> groups; // by root
+    for (const auto& p : primary) {
+      Group& g = groups[find(p.first)];
+      g.keys.push_back(p.first);
+      g.rank = p.second;
+      g.cost += cost[p.first];
+      g.requests = std::max(g.requests, requests[p.first]);
+      if (replicas_.count(p.first)) g.replicated = true;
+    }
+
+    // replicate the hot groups, drop the replicas of the cold ones
+    double threshold = atof(GetEnv("PS_REPLICA_THRESHOLD", std::string("0")).c_str());
+    int num_replicas = std::min(GetEnv("PS_REPLICA_NUM", 2), num_servers - 1);
+    std::vector<std::pair<const Group*, std::vector<int>>> replicate;
+    std::vector<const Group*> unreplicate;
+    if (threshold > 0 && seconds > 0) {
+      for (const auto& it : groups) {
+        const Group& g = it.second;
+        double rate = g.requests / seconds;
+        if (!g.replicated && rate > threshold && num_replicas > 0) {
+          std::vector<int> ranks;
+          for (int i = 0; i < num_servers; ++i) if (i != g.rank) ranks.push_back(i);
+          std::sort(ranks.begin(), ranks.end(), [&load](int a, int b) { return load[a] < load[b]; });
+          ranks.resize(num_replicas);
+          replicate.push_back(std::make_pair(&g, ranks));
+        } else if (g.replicated && rate < threshold / 2) {
+          unreplicate.push_back(&g);
+        }
+      }
+    }
+
+    // plan the moves of the groups not replicated
+    std::vector<std::vector<const Group*>> parts(num_servers);
+    for (const auto& it : groups) {
+      if (!it.second.replicated && it.second.cost > 0) parts[it.second.rank].push_back(&it.second);
+    }
+    double ratio = atof(GetEnv("PS_BALANCE_RATIO", std::string("1.5")).c_str());
+    int max_moves = GetEnv("PS_BALANCE_MAX_MOVES", 1);
+    std::vector<std::pair<const Group*, std::pair<int, int>>> moves; // group, from, to
+    for (int m = 0; m < max_moves; ++m) {
+      int hi = std::max_element(load.begin(), load.end()) - load.begin();
+      int lo = std::min_element(load.begin(), load.end()) - load.begin();
+      if (hi == lo || load[hi] <= load[lo] * ratio) break;
+      // the largest group which keeps the new load of lo below the old load of hi
+      int best = -1;
+      for (size_t i = 0; i < parts[hi].size(); ++i) {
+        if (parts[hi][i]->cost < load[hi] - load[lo] &&
+            (best < 0 || parts[hi][i]->cost > parts[hi][best]->cost)) best = i;
+      }
+      if (best < 0) break;
+      const Group* g = parts[hi][best];
+      parts[hi].erase(parts[hi].begin() + best);
+      parts[lo].push_back(g);
+      load[hi] -= g->cost;
+      load[lo] += g->cost;
+      moves.push_back(std::make_pair(g, std::make_pair(hi, lo)));
+    }
+    if (moves.empty() && replicate.empty() && unreplicate.empty()) return;
+
+    // phase one, a group goes in one message, so it is never split
+    for (const auto& m : moves) {
+      PS_VLOG(1) << "migrate " << m.first->keys.size() << " partitions from server "
+                 << m.second.first << " to server " << m.second.second;
+      std::ostringstream os;
+      os << m.second.second;
+      for (Key key : m.first->keys) os << " " << key;
+      Wait(Request(balanceCmd::PartMigrate, os.str(), po->ServerRankToID(m.second.first)));
+    }
+    // the workers read the replicas after the router update, by when the
+    // replicas of the whole group exist
+    for (const auto& r : replicate) {
+      for (Key key : r.first->keys) {
+        PS_VLOG(1) << "replicate partition " << key << " to " << r.second.size() << " servers";
+        std::ostringstream os;
+        os << key;
+        for (int rank : r.second) os << " " << rank;
+        Wait(Request(balanceCmd::PartReplicate, os.str(), po->ServerRankToID(r.first->rank)));
+        replicas_[key] = r.second;
+      }
+    }
+    for (const Group* g : unreplicate) {
+      for (Key key : g->keys) replicas_.erase(key);
+    }
+
+    // switch the workers
+    auto base = po->GetKeyRouter();
+    for (const auto& m : moves) {
+      for (Key key : m.first->keys) {
+        if (base->ServerRank(key) == m.second.second) {
+          moved_.erase(key);
+        } else {
+          moved_[key] = m.second.second;
+        }
+      }
+    }
+    // "key primary [replica ...]" per line
+    std::ostringstream os;
+    for (const auto& m : moved_) {
+      os << m.first << " " << m.second;
+      if (replicas_.count(m.first)) {
+        for (int rank : replicas_[m.first]) os << " " << rank;
+      }
+      os << "\n";
+    }
+    for (const auto& r : replicas_) {
+      if (moved_.count(r.first)) continue;
+      os << r.first << " " << base->ServerRank(r.first);
+      for (int rank : r.second) os << " " << rank;
+      os << "\n";
+    }
+    Wait(Request(balanceCmd::RouterUpdate, os.str(), kWorkerGroup));
+
+    // phase two
+    for (const auto& m : moves) {
+      std::ostringstream os;
+      for (Key key : m.first->keys) os << key << " ";
+      Wait(Request(balanceCmd::PartCommit, os.str(), po->ServerRankToID(m.second.first)));
+    }
+    for (const Group* g : unreplicate) {
+      for (Key key : g->keys) {
+        PS_VLOG(1) << "drop the replicas of partition " << key;
+        std::ostringstream os;
+        os << key;
+        Wait(Request(balanceCmd::PartUnreplicate, os.str(), po->ServerRankToID(g->rank)));
+      }
+    }
+
+  }
+
+ private:
+
+  // partitions on one server placed together or paired by binary ops, which
+  // must stay together
+  struct Group {
+    std::vector<Key> keys;
+    int rank = 0;
+    double cost = 0;
+    uint64_t requests = 0; // of the most requested partition
+    bool replicated = false;
+  };
+
+  std::mutex mu_;
+  std::unordered_map<int, std::string> reports_; // server node id -> statistics
+  std::unordered_map<Key, int> moved_; // partition -> server rank, if not the default one
+  std::unordered_map<Key, std::vector<int>> replicas_; // partition -> ranks of the read replicas
+  std::chrono::steady_clock::time_point last_ = std::chrono::steady_clock::now(); // the last round
+
+  std::unique_ptr<std::thread> thread_;
+  std::mutex stop_mu_;
+  std::condition_variable stop_cond_;
+  bool stop_ = false;
+
+};
+
+#endif
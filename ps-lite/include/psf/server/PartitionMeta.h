@@ -1 +1,31 @@
+#ifndef _PARTITION_META_
+#define _PARTITION_META_
 
+/**
+ * A block [startRow, endRow) x [startCol, endCol) of a matrix
+ */
+struct PartitionMeta {
+
+  int matrixId;
+  int partId;
+  int startRow;
+  int endRow;
+  long startCol;
+  long endCol;
+
+  PartitionMeta(int matrixId, int partId, int startRow, int endRow, long startCol, long endCol)
+      : matrixId(matrixId), partId(partId), startRow(startRow), endRow(endRow),
+        startCol(startCol), endCol(endCol) {}
+
+  int getPartId() const { return partId; }
+
+  bool containsRow(int row) const { return row >= startRow && row < endRow; }
+
+  bool containsCol(long col) const { return col >= startCol && col < endCol; }
+
+  /** \brief the number of elements in the block */
+  long size() const { return (endRow - startRow) * (endCol - startCol); }
+
+};
+
+#endif
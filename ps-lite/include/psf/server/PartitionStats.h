@@ -0,0 +1,34 @@
+#ifndef _PARTITION_STATS_
+#define _PARTITION_STATS_
+
+#include <cstdint>
+
+
+// heads of the messages exchanged by the scheduler, the servers and the workers
+// to move matrix partitions between servers at runtime
+enum balanceCmd{
+
+PartStatsReq=1, // scheduler -> server, report and reset the access statistics
+PartMigrate,    // scheduler -> server, hand a partition over to another server
+PartInstall,    // server -> server, the state of a migrated partition
+RouterUpdate,   // scheduler -> worker, the servers of every migrated or replicated partition
+PartCommit,     // scheduler -> server, drop a migrated partition
+PartReplicate,  // scheduler -> server, copy a partition to read replicas on other servers
+PartReplica,    // server -> server, the state of a read replica
+PartUnreplicate,// scheduler -> server, drop the read replicas of a partition
+PartDrop,       // server -> server, drop a read replica
+ReplicaSync     // server -> itself, push the updated partitions to their replicas
+
+};
+
+
+// the access statistics of one partition since the last report
+struct PartStats{
+
+uint64_t requests = 0;
+uint64_t bytes = 0;
+
+};
+
+
+#endif
@@ -10,21 +10,24 @@
  * Matrix partitioner interface.
  */
 class Partitioner {
-  
-/**
+
+ public:
+
+  virtual ~Partitioner() {}
+
+  /**
    * Init matrix partitioner
    *
    * @param mContext matrix context
-   * @param conf
    */
-  void init(MatrixContext mContext, Configuration conf)=0;
+  virtual void init(const MatrixContext& mContext)=0;
 
   /**
    * Generate the partitions for the matrix
    *
    * @return the partitions for the matrix
    */
-  std::vector<PartitionMeta> getPartitions()=0;
+  virtual std::vector<PartitionMeta> getPartitions()=0;
 
   /**
    * Assign a matrix partition to a parameter server
@@ -32,9 +35,8 @@ class Partitioner {
    * @param partId matrix partition id
    * @return parameter server index
    */
-  int assignPartToServer(int partId)=0;
+  virtual int assignPartToServer(int partId)=0;
 
-}
+};
 
 #endif
-
@@ -1,5 +1,22 @@
+#ifndef _RANGE_PARTITIONER_
+#define _RANGE_PARTITIONER_
+
+#include <algorithm>
+#include <vector>
+#include "ps/internal/postoffice.h"
+#include "ps/internal/utils.h"
+#include "psf/Matrix/MatrixMeta.h"
+#include "psf/server/Partitioner.h"
+
+using namespace ps;
+
 /**
  * Base class of range partitioner
+ *
+ * Splits a matrix into blockRow x blockCol blocks, so a single row vector is
+ * cut into column blocks spread over all servers and a matrix with many rows
+ * is tiled in 2D. The blocks are assigned to the servers round-robin, or to the
+ * server of their key if the key router places the keys, such as consistent hashing.
  */
 
 class RangePartitioner : public Partitioner {
@@ -13,39 +30,34 @@ class RangePartitioner : public Partitioner {
    MatrixContext mContext;
 
   /**
-   * Application configuration
+   * the expected number of elements of one block
    */
-  // Configuration conf;
-  
-  long DEFAULT_PARTITION_SIZE; // 
+  long DEFAULT_PARTITION_SIZE;
   int maxPartNum;
+  int serverNum;
 
   
   public :
 
 
-    void init(MatrixContext mContext, Configuration conf) override {
+    void init(const MatrixContext& mContext) override {
 
     this->mContext = mContext;
-    this->conf = conf;
-
+    this->mContext.init();
 
-    // read from conf file
+    // read from os environ
 
-    long defaultPartSize = conf.getLong(AngelConf.ANGEL_MODEL_PARTITIONER_PARTITION_SIZE,
-            AngelConf.DEFAULT_ANGEL_MODEL_PARTITIONER_PARTITION_SIZE);
+    long defaultPartSize = GetEnv("PS_PARTITION_SIZE", 500000);
 
-    int maxPartNumTotal = conf.getInt(AngelConf.ANGEL_MODEL_PARTITIONER_MAX_PARTITION_NUM,
-            AngelConf.DEFAULT_ANGEL_MODEL_PARTITIONER_MAX_PARTITION_NUM);
+    int maxPartNumTotal = GetEnv("PS_MAX_PARTITION_NUM", 10000);
 
-    int psNum = conf.getInt(AngelConf.ANGEL_PS_NUMBER, AngelConf.DEFAULT_ANGEL_PS_NUMBER);
+    serverNum = Postoffice::Get()->num_servers();
 
-    int partNumPerServer =
-            conf.getInt(AngelConf.ANGEL_MODEL_PARTITIONER_PARTITION_NUM_PERSERVER, -1); 
+    int partNumPerServer = GetEnv("PS_PARTITION_NUM_PER_SERVER", -1);
 
 
     if (partNumPerServer > 0) {
-      maxPartNum = Math.min(maxPartNumTotal, psNum * partNumPerServer);
+      maxPartNum = std::min(maxPartNumTotal, serverNum * partNumPerServer);
     } else {
       maxPartNum = maxPartNumTotal;
     }
@@ -75,10 +87,6 @@ class RangePartitioner : public Partitioner {
 
     int blockRow = mContext.getMaxRowNumInBlock();
     long blockCol = mContext.getMaxColNumInBlock();
-    int serverNum = conf.getInt(AngelConf.ANGEL_PS_NUMBER, AngelConf.DEFAULT_ANGEL_PS_NUMBER); // read from os environ
-
-
-//    LOG.info("start to split matrix " + mContext);
 
     double range = col;
 
@@ -95,17 +103,20 @@ class RangePartitioner : public Partitioner {
 
     if (blockRow < 0) {
       if (row > serverNum)
-        blockRow = (int) Math.min(row / serverNum,
-                Math.max(row / maxPartNum, Math.max(1, partSize / range)));
+        blockRow = (int) std::min<long>(row / serverNum,
+                std::max<long>(row / maxPartNum, std::max<long>(1, partSize / range)));
       else
         blockRow = row;
     }
 
     if (blockCol < 0)
-      blockCol = Math.min(Math.max(100, (long)(range / serverNum)),
-              Math.max(partSize / blockRow, (long) (row * (range / maxPartNum / blockRow))));
+      blockCol = std::min(std::max(100L, (long)(range / serverNum)),
+              std::max(partSize / blockRow, (long) (row * (range / maxPartNum / blockRow))));
 
-    LOG.info("blockRow = " + blockRow + ", blockCol=" + blockCol);
+    CHECK_GT(blockRow, 0);
+    CHECK_GT(blockCol, 0);
+
+    PS_VLOG(1) << "matrix " << matrixId << " blockRow = " << blockRow << ", blockCol = " << blockCol;
 
     mContext.setMaxRowNumInBlock(blockRow);
     mContext.setMaxColNumInBlock(blockCol);
@@ -121,14 +132,13 @@ class RangePartitioner : public Partitioner {
         startCol = j;
         endRow = (i <= (row - blockRow)) ? (i + blockRow) : row;
         endCol = (j <= (end - blockCol)) ? (j + blockCol) : end;
-        partitions.add(new PartitionMeta(matrixId, id++, startRow, endRow, startCol, endCol));
+        partitions.push_back(PartitionMeta(matrixId, id++, startRow, endRow, startCol, endCol));
 
         j = (j <= (end - blockCol)) ? (j + blockCol) : end;
       }
       i = (i <= (row - blockRow)) ? (i + blockRow) : row;
     }
 
-//    LOG.info("partition count: " + partitions.size());
     return partitions;
   }
 
@@ -136,30 +146,15 @@ class RangePartitioner : public Partitioner {
   
  int assignPartToServer(int partId) override {
 
-    int serverNum = conf.getInt(AngelConf.ANGEL_PS_NUMBER, AngelConf.DEFAULT_ANGEL_PS_NUMBER); // read from os environ
+    auto router = Postoffice::Get()->GetKeyRouter();
+    if (router->places_keys())
+      return router->ServerRank(BlockKeyId(mContext.getMatrixId(), partId));
     return partId % serverNum;
   }
 
-/*
-  public static void main(String [] args) {
-    MatrixContext matrix1 = new MatrixContext();
-    matrix1.setRowNum(1);
-    matrix1.setColNum(-1);
-    matrix1.setMaxRowNumInBlock(1);
-    matrix1.setMaxColNumInBlock(-1);
-    matrix1.setValidIndexNum(252830411);
-    matrix1.setRowType(RowType.T_FLOAT_SPARSE_LONGKEY);
-    matrix1.setName("w1");
-    matrix1.setIndexStart(Long.MIN_VALUE);
-    matrix1.setIndexEnd(Long.MAX_VALUE);
-
-    Configuration conf = new Configuration();
-    RangePartitioner partitioner = new RangePartitioner();
-
-    partitioner.init(matrix1, conf);
-    partitioner.getPartitions();
-  }
-*/
+ /** \brief the context with the block size decided by getPartitions */
+ const MatrixContext& getContext() const { return mContext; }
 
 };
 
+#endif
@@ -11,3 +11,16 @@ endif
 
 PS_LDFLAGS_SO = -L$(DEPS_PATH)/lib -lprotobuf-lite -lzmq
 PS_LDFLAGS_A = $(addprefix $(DEPS_PATH)/lib/, libprotobuf-lite.a libzmq.a)
+
+# the codecs of PS_COMPRESS
+ifdef USE_LZ4
+PS_LDFLAGS_SO += -llz4
+endif
+ifdef USE_ZSTD
+PS_LDFLAGS_SO += -lzstd
+endif
+
+# shm_open of the shm van
+ifeq ($(shell uname), Linux)
+PS_LDFLAGS_SO += -lrt
+endif
@@ -0,0 +1,84 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_BUFFER_POOL_H_
+#define PS_BUFFER_POOL_H_
+#include <mutex>
+#include <vector>
+#include "ps/sarray.h"
+#include "./slab.h"
+namespace ps {
+
+/**
+ * \brief a pool of receive buffers
+ *
+ * Buffers are rounded up to a power of two between 4KB and 64MB and go back
+ * to the free list of their size when the last SArray using them is released,
+ * from any thread. Larger buffers are not pooled.
+ */
+class BufferPool {
+ public:
+  /** \brief the pool of the process, never destroyed since buffers may outlive
+   * the vans */
+  static BufferPool* Get() {
+    static BufferPool* pool = new BufferPool();
+    return pool;
+  }
+
+  /** \brief a buffer of size bytes, not initialized */
+  SArray<char> Alloc(size_t size) {
+    SArray<char> buf;
+    if (size == 0) return buf;
+    int c = Class(size);
+    if (c < 0) {
+      buf.reset(new char[size], size, [](char* p) { delete[] p; });
+      return buf;
+    }
+    char* p = nullptr;
+    {
+      std::lock_guard<std::mutex> lk(free_[c].mu);
+      if (!free_[c].bufs.empty()) {
+        p = free_[c].bufs.back();
+        free_[c].bufs.pop_back();
+      }
+    }
+    if (!p) {
+      ++PoolAllocs();
+      p = new char[static_cast<size_t>(1) << (c + kMinShift)];
+    }
+    buf.reset(p, size, [this, c](char* p) { Release(p, c); }, SlabAllocator<char>());
+    return buf;
+  }
+
+ private:
+  static const int kMinShift = 12;
+  static const int kNumClasses = 15;
+  /** \brief the free buffers kept per size, at most 64MB in total for a size */
+  static const size_t kMaxBytes = 64 << 20;
+
+  /** \brief the size class of size bytes, -1 if not pooled */
+  static int Class(size_t size) {
+    int c = 0;
+    while ((static_cast<size_t>(1) << (c + kMinShift)) < size) ++c;
+    return c < kNumClasses ? c : -1;
+  }
+
+  void Release(char* p, int c) {
+    {
+      std::lock_guard<std::mutex> lk(free_[c].mu);
+      if (free_[c].bufs.size() < (kMaxBytes >> (c + kMinShift))) {
+        free_[c].bufs.push_back(p);
+        return;
+      }
+    }
+    delete[] p;
+  }
+
+  struct FreeList {
+    std::mutex mu;
+    std::vector<char*> bufs;
+  };
+  FreeList free_[kNumClasses];
+};
+}  // namespace ps
+#endif  // PS_BUFFER_POOL_H_
@@ -0,0 +1,201 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_COMPRESSOR_H_
+#define PS_COMPRESSOR_H_
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#ifdef DMLC_USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef DMLC_USE_ZSTD
+#include <zstd.h>
+#endif
+#include "ps/internal/message.h"
+#include "ps/internal/utils.h"
+#include "./buffer_pool.h"
+namespace ps {
+
+/**
+ * \brief compresses the data of the data messages sent by a van
+ *
+ * A data of PS_COMPRESS_BYTES bytes or more is compressed if it is worth it
+ * for its data type: if the compressed size is below PS_COMPRESS_MAX_RATIO of
+ * the original, and the time saved on a link of PS_COMPRESS_LINK_MBPS is more
+ * than the time spent compressing, both averaged over the recent data. Every
+ * PS_COMPRESS_PROBE-th data of a type is compressed anyway to keep measuring.
+ *
+ * A compressed data starts with its original size, uint64, and its codec is
+ * in Meta::codec.
+ */
+class Compressor {
+ public:
+  enum Codec : uint8_t { NONE = 0, LZ4 = 1, ZSTD = 2 };
+
+  /** \brief the compressor configured by PS_COMPRESS, nullptr if not */
+  static Compressor* Create() {
+    std::string name = GetEnv("PS_COMPRESS", std::string());
+    if (name.empty()) return nullptr;
+    Codec codec = NONE;
+    if (name == "lz4") {
+#ifdef DMLC_USE_LZ4
+      codec = LZ4;
+#else
+      LOG(FATAL) << "compile with USE_LZ4=1 to use lz4";
+#endif
+    } else if (name == "zstd") {
+#ifdef DMLC_USE_ZSTD
+      codec = ZSTD;
+#else
+      LOG(FATAL) << "compile with USE_ZSTD=1 to use zstd";
+#endif
+    } else {
+      LOG(FATAL) << "unsupported PS_COMPRESS: " << name;
+    }
+    return new Compressor(codec);
+  }
+
+  /** \brief compress the data of msg worth it */
+  void Compress(Message* msg) {
+    auto& meta = msg->meta;
+    for (size_t i = 0; i < msg->data.size(); ++i) {
+      const SArray<char>& raw = msg->data[i];
+      if (raw.size() < min_bytes_) continue;
+      int type = i < meta.data_type.size() ? static_cast<int>(meta.data_type[i]) : 0;
+      if (!Worth(type)) continue;
+      auto start = std::chrono::steady_clock::now();
+      SArray<char> out = BufferPool::Get()->Alloc(sizeof(uint64_t) + Bound(raw.size()));
+      uint64_t size = raw.size();
+      memcpy(out.data(), &size, sizeof(size));
+      size_t n = Encode(raw, out.data() + sizeof(size), out.size() - sizeof(size));
+      double usec = std::chrono::duration<double, std::micro>(
+          std::chrono::steady_clock::now() - start).count();
+      Measure(type, raw.size(), n ? n : raw.size(), usec);
+      if (n == 0 || n + sizeof(size) >= raw.size()) continue;
+      if (meta.codec.empty()) meta.codec.resize(msg->data.size(), NONE);
+      meta.codec[i] = codec_;
+      msg->data[i] = out.segment(0, n + sizeof(size));
+    }
+  }
+
+  /** \brief decompress the data of msg compressed, into pooled buffers */
+  static void Decompress(Message* msg) {
+    auto& codec = msg->meta.codec;
+    CHECK_EQ(codec.size(), msg->data.size()) << "corrupted message";
+    for (size_t i = 0; i < codec.size(); ++i) {
+      if (codec[i] == NONE) continue;
+      const SArray<char>& in = msg->data[i];
+      CHECK_GE(in.size(), sizeof(uint64_t)) << "corrupted message";
+      uint64_t size;
+      memcpy(&size, in.data(), sizeof(size));
+      SArray<char> out = BufferPool::Get()->Alloc(size);
+      const char* src = in.data() + sizeof(size);
+      size_t src_size = in.size() - sizeof(size);
+      // unused if built without both codecs
+      (void)src;
+      (void)src_size;
+      bool ok = false;
+      if (codec[i] == LZ4) {
+#ifdef DMLC_USE_LZ4
+        ok = LZ4_decompress_safe(src, out.data(), src_size, size) == static_cast<int>(size);
+#endif
+      } else if (codec[i] == ZSTD) {
+#ifdef DMLC_USE_ZSTD
+        ok = ZSTD_decompress(out.data(), size, src, src_size) == size;
+#endif
+      }
+      CHECK(ok) << "failed to decompress data with codec " << static_cast<int>(codec[i]);
+      msg->data[i] = out;
+    }
+    codec.clear();
+  }
+
+ private:
+  explicit Compressor(Codec codec) : codec_(codec) {
+    min_bytes_ = GetEnv("PS_COMPRESS_BYTES", 4096);
+    level_ = GetEnv("PS_COMPRESS_LEVEL", 1);
+    probe_ = GetEnv("PS_COMPRESS_PROBE", 64);
+    max_ratio_ = atof(GetEnv("PS_COMPRESS_MAX_RATIO", std::string("0.8")).c_str());
+    link_mbps_ = GetEnv("PS_COMPRESS_LINK_MBPS", 1250);
+  }
+
+  /** \brief the recent compression of a data type */
+  struct Stats {
+    /** \brief compressed / original size */
+    double ratio = 0;
+    /** \brief original bytes compressed per usec, i.e. MB/s */
+    double speed = 0;
+    /** \brief the data skipped since the last compressed */
+    int skipped = 0;
+    bool measured = false;
+  };
+
+  bool Worth(int type) {
+    std::lock_guard<std::mutex> lk(mu_);
+    Stats& s = stats_[type];
+    if (!s.measured) return true;
+    // the time spent per byte, 1/speed, against the time saved on the link
+    bool worth = s.ratio <= max_ratio_ &&
+                 (link_mbps_ <= 0 || s.speed * (1 - s.ratio) > link_mbps_);
+    if (worth || ++s.skipped >= probe_) {
+      s.skipped = 0;
+      return true;
+    }
+    return false;
+  }
+
+  void Measure(int type, size_t raw, size_t compressed, double usec) {
+    std::lock_guard<std::mutex> lk(mu_);
+    Stats& s = stats_[type];
+    double ratio = static_cast<double>(compressed) / raw;
+    double speed = raw / std::max(usec, 1e-3);
+    if (!s.measured) {
+      s.ratio = ratio;
+      s.speed = speed;
+      s.measured = true;
+    } else {
+      s.ratio = 0.8 * s.ratio + 0.2 * ratio;
+      s.speed = 0.8 * s.speed + 0.2 * speed;
+    }
+  }
+
+  size_t Bound(size_t size) const {
+#ifdef DMLC_USE_LZ4
+    if (codec_ == LZ4) return LZ4_compressBound(size);
+#endif
+#ifdef DMLC_USE_ZSTD
+    if (codec_ == ZSTD) return ZSTD_compressBound(size);
+#endif
+    return size;
+  }
+
+  /** \brief compress in into out, return the size, 0 on failure */
+  size_t Encode(const SArray<char>& in, char* out, size_t capacity) {
+#ifdef DMLC_USE_LZ4
+    if (codec_ == LZ4) {
+      return LZ4_compress_default(in.data(), out, in.size(), capacity);
+    }
+#endif
+#ifdef DMLC_USE_ZSTD
+    if (codec_ == ZSTD) {
+      size_t n = ZSTD_compress(out, capacity, in.data(), in.size(), level_);
+      return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    return 0;
+  }
+
+  Codec codec_;
+  size_t min_bytes_;
+  int level_;
+  int probe_;
+  double max_ratio_;
+  int link_mbps_;
+  std::mutex mu_;
+  /** \brief data type -> its recent compression */
+  Stats stats_[16];
+};
+}  // namespace ps
+#endif  // PS_COMPRESSOR_H_
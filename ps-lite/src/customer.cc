@@ -11,8 +11,12 @@ const int Meta::kEmpty = std::numeric_limits<int>::max();
 
 Customer::Customer(int app_id, int customer_id, const Customer::RecvHandle& recv_handle)
     : app_id_(app_id), customer_id_(customer_id), recv_handle_(recv_handle) {
+  window_ = GetEnv("PS_REQUEST_WINDOW", 4096);
+  CHECK_GT(window_, 0) << "PS_REQUEST_WINDOW must be positive";
+  slots_ = std::unique_ptr<RequestSlot[]>(new RequestSlot[window_]);
   Postoffice::Get()->AddCustomer(this);
-  recv_thread_ = std::unique_ptr<std::thread>(new std::thread(&Customer::Receiving, this));
+  recv_thread_ = std::unique_ptr<std::thread>(new std::thread(
+      Postoffice::Inherit(std::bind(&Customer::Receiving, this))));
 }
 
 Customer::~Customer() {
@@ -24,27 +28,56 @@ Customer::~Customer() {
 }
 
 int Customer::NewRequest(int recver) {
-  std::lock_guard<std::mutex> lk(tracker_mu_);
   int num = Postoffice::Get()->GetNodeIDs(recver).size();
-  tracker_.push_back(std::make_pair(num, 0));
-  return tracker_.size() - 1;
+  std::lock_guard<std::mutex> submit_lk(submit_mu_);
+  int ts = next_timestamp_;
+  // wrap at a multiple of the window so that ts % window_ stays continuous
+  int wrap = std::numeric_limits<int>::max() / window_ * window_;
+  next_timestamp_ = (next_timestamp_ + 1) % wrap;
+
+  auto& s = slot(ts);
+  std::unique_lock<std::mutex> lk(s.mu);
+  if (s.timestamp != -1 && !s.done()) {
+    PS_VLOG(2) << "request window (" << window_ << ") is full, wait for request "
+               << s.timestamp;
+    s.cond.wait(lk, [&s] { return s.done(); });
+  }
+  s.timestamp = ts;
+  s.expected = num;
+  s.received = 0;
+  return ts;
 }
 
 void Customer::WaitRequest(int timestamp) {
-  std::unique_lock<std::mutex> lk(tracker_mu_);
-  tracker_cond_.wait(lk, [this, timestamp]{
-      return tracker_[timestamp].first == tracker_[timestamp].second;
+  auto& s = slot(timestamp);
+  std::unique_lock<std::mutex> lk(s.mu);
+  s.cond.wait(lk, [&s, timestamp] {
+      return s.timestamp != timestamp || s.done();
     });
 }
 
+bool Customer::TestRequest(int timestamp) {
+  auto& s = slot(timestamp);
+  std::lock_guard<std::mutex> lk(s.mu);
+  return s.timestamp != timestamp || s.done();
+}
+
 int Customer::NumResponse(int timestamp) {
-  std::lock_guard<std::mutex> lk(tracker_mu_);
-  return tracker_[timestamp].second;
+  auto& s = slot(timestamp);
+  std::lock_guard<std::mutex> lk(s.mu);
+  CHECK_EQ(s.timestamp, timestamp) << "request " << timestamp << " is recycled";
+  return s.received;
 }
 
 void Customer::AddResponse(int timestamp, int num) {
-  std::lock_guard<std::mutex> lk(tracker_mu_);
-  tracker_[timestamp].second += num;
+  auto& s = slot(timestamp);
+  {
+    std::lock_guard<std::mutex> lk(s.mu);
+    CHECK_EQ(s.timestamp, timestamp) << "request " << timestamp << " is recycled";
+    s.received += num;
+    if (!s.done()) return;
+  }
+  s.cond.notify_all();
 }
 
 void Customer::Receiving() {
@@ -57,9 +90,18 @@ void Customer::Receiving() {
     }
     recv_handle_(recv);
     if (!recv.meta.request) {
-      std::lock_guard<std::mutex> lk(tracker_mu_);
-      tracker_[recv.meta.timestamp].second++;
-      tracker_cond_.notify_all();
+      auto& s = slot(recv.meta.timestamp);
+      {
+        std::lock_guard<std::mutex> lk(s.mu);
+        if (s.timestamp != recv.meta.timestamp) {
+          LOG(WARNING) << "drop the response of a recycled request: "
+                       << recv.DebugString();
+          continue;
+        }
+        ++s.received;
+        if (!s.done()) continue;
+      }
+      s.cond.notify_all();
     }
   }
 }
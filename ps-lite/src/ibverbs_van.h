@@ -564,14 +564,17 @@ class IBVerbsVan : public Van {
     return port;
   }
 
+  bool CanConnectLazily() override { return false; }
+
   void Connect(const Node &node) override {
     PS_VLOG(1) << "Connecting to " << my_node_.ShortDebugString();
     CHECK_NE(node.id, node.kEmpty);
     CHECK_NE(node.port, node.kEmpty);
     CHECK(node.hostname.size());
 
-    // worker doesn't need to connect to the other workers. same for server
-    if ((node.role == my_node_.role) && (node.id != my_node_.id)) {
+    // worker doesn't need to connect to the other workers, but its neighbors
+    // in the barrier tree. servers connect to each other
+    if (!NeedConnect(node)) {
       return;
     }
 
@@ -0,0 +1,140 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_LOCAL_VAN_H_
+#define PS_LOCAL_VAN_H_
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include "ps/internal/threadsafe_queue.h"
+namespace ps {
+
+/**
+ * \brief Van between the nodes running as threads of one process
+ *
+ * A node is known by its port only. A message is handed to the receiver by
+ * pointer, neither its meta packed nor its data copied, so the data is shared
+ * with the sender. See \ref Postoffice::Create for running the nodes.
+ */
+class LocalVan : public Van {
+ public:
+  LocalVan() {}
+  virtual ~LocalVan() {}
+
+ protected:
+  void Stop() override {
+    PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
+    Van::Stop();
+    Registry* reg = GetRegistry();
+    {
+      std::lock_guard<std::mutex> lk(reg->mu);
+      auto it = reg->vans.find(port_);
+      if (it != reg->vans.end() && it->second == this) {
+        reg->vans.erase(it);
+        reg->stopped.insert(port_);
+      }
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    ports_.clear();
+  }
+
+  int Bind(const Node& node, int max_retry) override {
+    Registry* reg = GetRegistry();
+    std::lock_guard<std::mutex> lk(reg->mu);
+    int port = node.port;
+    unsigned seed = static_cast<unsigned>(time(NULL) + port);
+    for (int i = 0; i < max_retry + 1; ++i) {
+      if (reg->vans.find(port) == reg->vans.end()) {
+        reg->vans[port] = this;
+        reg->stopped.erase(port);
+        port_ = port;
+        reg->cond.notify_all();
+        return port;
+      }
+      port = 10000 + rand_r(&seed) % 40000;
+    }
+    return -1;
+  }
+
+  void Connect(const Node& node) override {
+    CHECK_NE(node.id, node.kEmpty);
+    CHECK_NE(node.port, node.kEmpty);
+    // worker doesn't need to connect to the other workers, but its neighbors
+    // in the barrier tree. servers connect to each other
+    if (!NeedConnect(node)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    ports_[node.id] = node.port;
+  }
+
+  bool CanConnectInParallel() override { return true; }
+
+  int SendMsg(const Message& msg) override {
+    int id = msg.meta.recver;
+    CHECK_NE(id, Meta::kEmpty);
+    int port;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = ports_.find(id);
+      if (it == ports_.end()) {
+        LOG(WARNING) << "there is no socket to node " << id;
+        return -1;
+      }
+      port = it->second;
+    }
+    std::unique_ptr<Message> copy(new Message(msg));
+    copy->meta.sender = my_node_.id;
+    int bytes = 0;
+    for (const auto& d : msg.data) bytes += d.size();
+    copy->meta.data_size = bytes;
+    // the scheduler may not be bound yet. a message to a node stopped is lost
+    // as on a network. pushed under the lock, so the receiver is not destroyed
+    // meanwhile, and what it did not receive before stopping is freed with it
+    Registry* reg = GetRegistry();
+    std::unique_lock<std::mutex> lk(reg->mu);
+    reg->cond.wait(lk, [reg, port] {
+        return reg->vans.count(port) > 0 || reg->stopped.count(port) > 0;
+      });
+    auto it = reg->vans.find(port);
+    if (it == reg->vans.end()) {
+      LOG(WARNING) << "node " << id << " stopped, drop " << msg.DebugString();
+      return msg.meta.data_size;
+    }
+    it->second->recv_queue_.Push(std::move(copy));
+    return bytes;
+  }
+
+  int RecvMsg(Message* msg) override {
+    std::unique_ptr<Message> recved;
+    recv_queue_.WaitAndPop(&recved);
+    *msg = std::move(*recved);
+    msg->meta.recver = my_node_.id;
+    return msg->meta.data_size;
+  }
+
+ private:
+  /** \brief the vans of the process by port */
+  struct Registry {
+    std::mutex mu;
+    std::condition_variable cond;
+    std::unordered_map<int, LocalVan*> vans;
+    /** \brief the ports of the vans stopped and not bound again */
+    std::unordered_set<int> stopped;
+  };
+
+  static Registry* GetRegistry() {
+    static Registry* reg = new Registry();
+    return reg;
+  }
+
+  int port_ = -1;
+  std::mutex mu_;
+  /** \brief node id to the port of the node */
+  std::unordered_map<int, int> ports_;
+  ThreadsafeQueue<std::unique_ptr<Message>> recv_queue_;
+};
+}  // namespace ps
+#endif  // PS_LOCAL_VAN_H_
@@ -3,11 +3,24 @@
  */
 #ifndef PS_P3_VAN_H_
 #define PS_P3_VAN_H_
+#include <atomic>
+#include <climits>
+#include <map>
 #include <memory>
+#include <utility>
+#include <vector>
 namespace ps {
 
 /**
  * \brief P3 based Van implementation
+ *
+ * Data messages larger than PS_P3_SLICE_BYTES are cut into slices, which are
+ * sent one by one by a single sender thread in the order of their priority, so
+ * a message of a higher priority overtakes the slices left of a lower one. The
+ * receiver puts the slices back together and hands the messages to the
+ * customers by priority too. Only the messages of the same priority keep
+ * their order, so a message which must stay ahead of the later ones to the
+ * same node, such as the state of a migrated partition, is sent at INT_MAX.
  */
 class P3Van : public ZMQVan {
  public:
@@ -18,6 +31,7 @@ class P3Van : public ZMQVan {
   void Start(int customer_id) override {
     start_mu_.lock();
     if (init_stage == 0) {
+      slice_bytes_ = GetEnv("PS_P3_SLICE_BYTES", 1 << 16);
       // start sender
       sender_thread_ = std::unique_ptr<std::thread>(
             new std::thread(&P3Van::Sending, this));
@@ -30,10 +44,46 @@ class P3Van : public ZMQVan {
   void Stop() override {
     ZMQVan::Stop();
     sender_thread_->join();
+    if (reader_thread_) {
+      reader_thread_->join();
+      reader_thread_.reset();
+    }
+    slices_.clear();
   }
 
+  // P3 already sends through its own prioritized sender thread
+  bool UseAsyncSend() override { return false; }
+
   int SendMsg(const Message& msg) override {
-    send_queue_.Push(msg);
+    size_t bytes = 0;
+    for (const auto& d : msg.data) bytes += d.size();
+    if (!msg.meta.control.empty() || bytes <= slice_bytes_) {
+      send_queue_.Push(msg);
+      return 0;
+    }
+    // every slice but the last has slice_bytes_ bytes of the data, a data is
+    // split over slices, zero-copy
+    Message slice;
+    slice.meta = msg.meta;
+    slice.meta.slice_id = next_slice_id_++;
+    slice.meta.num_slices = (bytes + slice_bytes_ - 1) / slice_bytes_;
+    size_t i = 0, offset = 0;
+    for (int k = 0; k < slice.meta.num_slices; ++k) {
+      slice.meta.slice_index = k;
+      slice.meta.slice_frame = i;
+      slice.data.clear();
+      for (size_t left = slice_bytes_; left > 0 && i < msg.data.size(); ) {
+        size_t n = std::min(left, msg.data[i].size() - offset);
+        slice.data.push_back(msg.data[i].segment(offset, offset + n));
+        left -= n;
+        offset += n;
+        if (offset == msg.data[i].size()) {
+          ++i;
+          offset = 0;
+        }
+      }
+      send_queue_.Push(slice);
+    }
     return 0;
   }
 
@@ -49,11 +99,92 @@ class P3Van : public ZMQVan {
     }
   }
 
+  int RecvMsg(Message* msg) override {
+    // only the receiving thread of Van calls it, after binding
+    if (!reader_thread_) {
+      reader_thread_ = std::unique_ptr<std::thread>(
+          new std::thread(&P3Van::Reading, this));
+    }
+    recv_queue_.WaitAndPop(msg);
+    return msg->meta.data_size;
+  }
+
  private:
+  /**
+   * \brief the thread function receiving the messages and their slices, until
+   * the TERMINATE message
+   */
+  void Reading() {
+    while (true) {
+      Message msg;
+      if (ZMQVan::RecvMsg(&msg) == -1) {
+        LOG(WARNING) << "failed to receive a message";
+        continue;
+      }
+      if (!msg.meta.control.empty()) {
+        if (msg.meta.control.cmd == Control::TERMINATE) {
+          // after the data received before
+          msg.meta.priority = INT_MIN;
+          recv_queue_.Push(msg);
+          break;
+        }
+        recv_queue_.Push(msg);
+        continue;
+      }
+      if (msg.meta.slice_id == Meta::kEmpty || Merge(&msg)) recv_queue_.Push(msg);
+    }
+  }
+
+  /**
+   * \brief add a slice to its message
+   * \return true if msg is replaced by the whole message
+   */
+  bool Merge(Message* msg) {
+    // the slices of a sender arrive in order through one connection
+    const Meta& meta = msg->meta;
+    auto id = std::make_pair(meta.sender, meta.slice_id);
+    auto& pieces = slices_[id];
+    if (pieces.size() < meta.data_type.size()) pieces.resize(meta.data_type.size());
+    for (size_t i = 0; i < msg->data.size(); ++i) {
+      CHECK_LT(meta.slice_frame + i, pieces.size()) << "corrupted slice";
+      pieces[meta.slice_frame + i].push_back(msg->data[i]);
+    }
+    if (meta.slice_index + 1 < meta.num_slices) return false;
+
+    msg->data.clear();
+    for (auto& parts : pieces) {
+      if (parts.size() == 1) {
+        msg->data.push_back(parts[0]);
+        continue;
+      }
+      size_t size = 0;
+      for (const auto& p : parts) size += p.size();
+      SArray<char> data(size, 0);
+      size_t offset = 0;
+      for (const auto& p : parts) {
+        memcpy(data.data() + offset, p.data(), p.size());
+        offset += p.size();
+      }
+      msg->data.push_back(data);
+    }
+    msg->meta.slice_id = Meta::kEmpty;
+    slices_.erase(id);
+    return true;
+  }
+
   /** the thread for sending messages */
   std::unique_ptr<std::thread> sender_thread_;
   ThreadsafePQueue send_queue_;
   int init_stage = 0;
+  /** \brief the largest message sent whole */
+  size_t slice_bytes_ = 1 << 16;
+  std::atomic<int> next_slice_id_{0};
+  /** \brief the thread reading the socket and merging the slices */
+  std::unique_ptr<std::thread> reader_thread_;
+  /** \brief the whole messages received, by priority */
+  ThreadsafePQueue recv_queue_;
+  /** \brief (sender, slice id) -> the parts of every data received so far */
+  std::map<std::pair<int, int>, std::vector<std::vector<SArray<char>>>> slices_;
 };
 }  // namespace ps
 
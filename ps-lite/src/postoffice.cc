@@ -40,7 +40,7 @@ void Postoffice::InitEnvironment() {
 
 
 void Postoffice::Start(int customer_id, const char* argv0, const bool do_barrier) {
-
+  auto begin = std::chrono::steady_clock::now();
   start_mu_.lock();
 
   if (init_stage_ == 0) {
@@ -82,10 +82,9 @@ void Postoffice::Start(int customer_id, const char* argv0, const bool do_barrier
   start_mu_.unlock();
 
   // start van
+  auto init = std::chrono::steady_clock::now();
   van_->Start(customer_id);
-
-  
-  
+  auto started = std::chrono::steady_clock::now();
 
   start_mu_.lock();
   if (init_stage_ == 1) {
@@ -99,6 +98,13 @@ void Postoffice::Start(int customer_id, const char* argv0, const bool do_barrier
   // do a barrier here
   if (do_barrier) Barrier(customer_id, kWorkerGroup + kServerGroup + kScheduler);
 
+  auto ms = [](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+  };
+  PS_VLOG(1) << "customer " << customer_id << " started in "
+             << ms(begin, std::chrono::steady_clock::now()) << " ms: init "
+             << ms(begin, init) << " ms, van " << ms(init, started) << " ms, barrier "
+             << ms(started, std::chrono::steady_clock::now()) << " ms";
 }
 
 
@@ -113,7 +119,11 @@ void Postoffice::Finalize(const int customer_id, const bool do_barrier) {
     customers_.clear();
     node_ids_.clear();
     barrier_done_.clear();
+    barrier_group_.clear();
     server_key_ranges_.clear();
+    key_router_mu_.lock();
+    key_router_.reset();
+    key_router_mu_.unlock();
     heartbeats_.clear();
     if (exit_callback_) exit_callback_();
   }
@@ -128,6 +138,7 @@ void Postoffice::AddCustomer(Customer* customer) {
   CHECK_EQ(customers_[app_id].count(customer_id), (size_t) 0) << "customer_id " \
     << customer_id << " already exists\n";
   customers_[app_id].insert(std::make_pair(customer_id, customer));
+  customers_cond_.notify_all();
   std::unique_lock<std::mutex> ulk(barrier_mu_);
   barrier_done_[app_id].insert(std::make_pair(customer_id, false));
 }
@@ -146,36 +157,32 @@ void Postoffice::RemoveCustomer(Customer* customer) {
 
 Customer* Postoffice::GetCustomer(int app_id, int customer_id, int timeout) const {
   Customer* obj = nullptr;
-  for (int i = 0; i < timeout * 1000 + 1; ++i) {
-    {
-      std::lock_guard<std::mutex> lk(mu_);
-      const auto it = customers_.find(app_id);
-      if (it != customers_.end()) {
-        std::unordered_map<int, Customer*> customers_in_app = it->second;
-        obj = customers_in_app[customer_id];
-        break;
-      }
-    }
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  }
+  auto find = [this, app_id, customer_id, &obj] {
+    const auto it = customers_.find(app_id);
+    if (it == customers_.end()) return false;
+    const auto c = it->second.find(customer_id);
+    if (c == it->second.end()) return false;
+    obj = c->second;
+    return true;
+  };
+  // woken up by AddCustomer
+  std::unique_lock<std::mutex> lk(mu_);
+  customers_cond_.wait_for(lk, std::chrono::seconds(timeout), find);
   return obj;
 }
 
 void Postoffice::Barrier(int customer_id, int node_group) {
-  if (GetNodeIDs(node_group).size() <= 1) return;
-  auto role = van_->my_node().role;
-  if (role == Node::SCHEDULER) {
-    CHECK(node_group & kScheduler);
-  } else if (role == Node::WORKER) {
-    CHECK(node_group & kWorkerGroup);
-  } else if (role == Node::SERVER) {
-    CHECK(node_group & kServerGroup);
-  }
+  const auto& ids = GetNodeIDs(node_group);
+  if (ids.size() <= 1) return;
+  CHECK(std::find(ids.begin(), ids.end(), van_->my_node().id) != ids.end())
+      << "node " << van_->my_node().id << " is not in group " << node_group;
 
   std::unique_lock<std::mutex> ulk(barrier_mu_);
   barrier_done_[0][customer_id] = false;
+  barrier_group_[customer_id] = node_group;
   Message req;
-  req.meta.recver = kScheduler;
+  // up the barrier tree of the van
+  req.meta.recver = van_->BarrierEntry(node_group);
   req.meta.request = true;
   req.meta.control.cmd = Control::BARRIER;
   req.meta.app_id = 0;
@@ -188,6 +195,12 @@ void Postoffice::Barrier(int customer_id, int node_group) {
     });
 }
 
+void Postoffice::AddNodeGroup(int group, const std::vector<int>& ids) {
+  std::lock_guard<std::mutex> lk(mu_);
+  CHECK_EQ(node_ids_.count(group), 0U) << "group " << group << " exists";
+  node_ids_[group] = ids;
+}
+
 const std::vector<Range>& Postoffice::GetServerKeyRanges() {
   server_key_ranges_mu_.lock();
   if (server_key_ranges_.empty()) {
@@ -201,14 +214,35 @@ const std::vector<Range>& Postoffice::GetServerKeyRanges() {
   return server_key_ranges_;
 }
 
+std::shared_ptr<const KeyRouter> Postoffice::GetKeyRouter() {
+  std::lock_guard<std::mutex> lk(key_router_mu_);
+  if (!key_router_) {
+    key_router_.reset(KeyRouter::Create(
+        GetEnv("PS_KEY_ROUTER", std::string("range")), num_servers_));
+  }
+  return key_router_;
+}
+
+void Postoffice::UpdateKeyRouter(const std::shared_ptr<KeyRouter>& router) {
+  CHECK(router);
+  CHECK_EQ(router->num_servers(), num_servers_);
+  std::lock_guard<std::mutex> lk(key_router_mu_);
+  router->set_version(key_router_ ? key_router_->version() + 1 : 0);
+  key_router_ = router;
+  PS_VLOG(1) << "key router is updated to version " << router->version();
+}
+
 void Postoffice::Manage(const Message& recv) {
   CHECK(!recv.meta.control.empty());
   const auto& ctrl = recv.meta.control;
   if (ctrl.cmd == Control::BARRIER && !recv.meta.request) {
     barrier_mu_.lock();
-    auto size = barrier_done_[recv.meta.app_id].size();
-    for (size_t customer_id = 0; customer_id < size; customer_id++) {
-      barrier_done_[recv.meta.app_id][customer_id] = true;
+    // only the customers waiting for this group, others may wait for another
+    for (auto& it : barrier_done_[recv.meta.app_id]) {
+      auto group = barrier_group_.find(it.first);
+      if (group != barrier_group_.end() && group->second == ctrl.barrier_group) {
+        it.second = true;
+      }
     }
     barrier_mu_.unlock();
     barrier_cond_.notify_all();
@@ -3,14 +3,24 @@
  */
 #ifndef PS_RESENDER_H_
 #define PS_RESENDER_H_
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <vector>
-#include <unordered_set>
 #include <unordered_map>
+#include "./timing_wheel.h"
 namespace ps {
 
 /**
  * \brief resend a messsage if no ack is received within a given time
+ *
+ * The messages to a node are numbered from 1. Every message to a node carries
+ * the sequence number the messages from it are all received before, ack, and
+ * which ones after it are received, sack, so a response acknowledges its
+ * request. A node not sending anything back within two ticks of timeout / 8
+ * sends an ACK message instead. A receiver remembers the last kWindow
+ * sequence numbers to drop the duplicates and the ones beyond, which come
+ * again.
  */
 class Resender {
  public:
@@ -21,30 +31,42 @@ class Resender {
     timeout_ = timeout;
     max_num_retry_ = max_num_retry;
     van_ = van;
+    tick_ms_ = std::max(1, timeout / 8);
+    timeout_ticks_ = std::max(1, timeout / tick_ms_);
+    wheel_ = TimingWheel<Timer>(Tick());
     monitor_ = new std::thread(&Resender::Monitoring, this);
   }
   ~Resender() {
-    exit_ = true;
+    {
+      std::lock_guard<std::mutex> lk(exit_mu_);
+      exit_ = true;
+    }
+    exit_cv_.notify_all();
     monitor_->join();
     delete monitor_;
   }
 
   /**
-   * \brief add an outgoining message
-   *
+   * \brief send an outgoing message, kept till it is acknowledged
+   * \return the number of bytes sent
    */
-  void AddOutgoing(const Message& msg) {
-    if (msg.meta.control.cmd == Control::ACK) return;
-    CHECK_NE(msg.meta.timestamp, Meta::kEmpty) << msg.DebugString();
-    auto key = GetKey(msg);
-    std::lock_guard<std::mutex> lk(mu_);
-    // already buffered, which often due to call Send by the monitor thread
-    if (send_buff_.find(key) != send_buff_.end()) return;
-
-    auto& ent = send_buff_[key];
-    ent.msg = msg;
-    ent.send = Now();
-    ent.num_retry = 0;
+  int Send(Message* msg) {
+    if (msg->meta.control.cmd == Control::TERMINATE) return van_->SendRaw(*msg);
+    int recver = msg->meta.recver;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      Peer& peer = peers_[recver];
+      uint32_t seq = peer.next_seq++;
+      msg->meta.seq = seq;
+      Stamp(recver, peer, msg);
+      // kept before sending, since once the reply arrives the van may stop
+      // and delete the resender before this thread gets back to it
+      auto& ent = peer.unacked[seq];
+      ent.msg = *msg;
+      ent.num_retry = 0;
+      wheel_.Add(Tick() + timeout_ticks_, Timer{recver, seq});
+    }
+    return van_->SendRaw(*msg);
   }
 
   /**
@@ -53,88 +75,165 @@ class Resender {
    */
   bool AddIncomming(const Message& msg) {
     // a message can be received by multiple times
-    if (msg.meta.control.cmd == Control::TERMINATE) {
-      return false;
-    } else if (msg.meta.control.cmd == Control::ACK) {
-      mu_.lock();
-      auto key = msg.meta.control.msg_sig;
-      auto it = send_buff_.find(key);
-      if (it != send_buff_.end()) send_buff_.erase(it);
-      mu_.unlock();
+    if (msg.meta.control.cmd == Control::TERMINATE) return false;
+    int sender = msg.meta.sender;
+    if (sender == Meta::kEmpty) return false;
+    std::lock_guard<std::mutex> lk(mu_);
+    Peer& peer = peers_[sender];
+    if (msg.meta.ack) Acknowledge(msg.meta.ack, msg.meta.sack, &peer);
+    if (msg.meta.control.cmd == Control::ACK) return true;
+    // from a node not resending yet
+    uint32_t seq = msg.meta.seq;
+    if (seq == 0) return false;
+
+    // acknowledged by the next message back, or an ACK message
+    pending_acks_.insert(std::make_pair(sender, Tick()));
+    int32_t d = static_cast<int32_t>(seq - peer.next);
+    if (d >= kWindow) {
+      LOG(WARNING) << "Drop message beyond the window: " << msg.DebugString();
+      return true;
+    }
+    if (d < 0 || ((peer.window >> d) & 1)) {
+      LOG(WARNING) << "Duplicated message: " << msg.DebugString();
       return true;
-    } else {
-      mu_.lock();
-      auto key = GetKey(msg);
-      auto it = acked_.find(key);
-      bool duplicated = it != acked_.end();
-      if (!duplicated) acked_.insert(key);
-      mu_.unlock();
-      // send back ack message (even if it is duplicated)
-      Message ack;
-      ack.meta.recver = msg.meta.sender;
-      ack.meta.sender = msg.meta.recver;
-      ack.meta.control.cmd = Control::ACK;
-      ack.meta.control.msg_sig = key;
-      van_->Send(ack);
-      // warning
-      if (duplicated) LOG(WARNING) << "Duplicated message: " << msg.DebugString();
-      return duplicated;
     }
+    peer.window |= 1ULL << d;
+    while (peer.window & 1) {
+      peer.window >>= 1;
+      ++peer.next;
+    }
+    return false;
   }
 
+  /** \brief forget node id, which restarts */
+  void Reset(int id) {
+    std::lock_guard<std::mutex> lk(mu_);
+    peers_.erase(id);
+    pending_acks_.erase(id);
+  }
+
+  /** \brief whether sequence number a is before b, across the wraparound */
+  static bool Before(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) < 0;
+  }
+
+  /** \brief the sequence numbers a receiver keeps track of after ack */
+  static const int kWindow = 64;
+
  private:
-  using Time = std::chrono::milliseconds;
   // the buffer entry
   struct Entry {
     Message msg;
-    Time send;
     int num_retry = 0;
   };
-  std::unordered_map<uint64_t, Entry> send_buff_;
+  /** \brief what a node knows of the messages to and from another one */
+  struct Peer {
+    /** \brief the sequence number of the next message to send */
+    uint32_t next_seq = 1;
+    /** \brief the messages sent before it are all acknowledged */
+    uint32_t una = 1;
+    /** \brief the messages sent not acknowledged, by sequence number */
+    std::unordered_map<uint32_t, Entry> unacked;
+    /** \brief the messages received before it are all received */
+    uint32_t next = 1;
+    /** \brief bit i: the message of sequence number next + i is received */
+    uint64_t window = 0;
+  };
+  /** \brief the retransmission timer of a message */
+  struct Timer {
+    int recver;
+    uint32_t seq;
+  };
+
+  /** \brief piggyback what is received from node id on msg, mu_ is held */
+  void Stamp(int id, const Peer& peer, Message* msg) {
+    msg->meta.ack = peer.next;
+    msg->meta.sack = peer.window;
+    pending_acks_.erase(id);
+  }
 
-  uint64_t GetKey(const Message& msg) {
-    CHECK_NE(msg.meta.timestamp, Meta::kEmpty) << msg.DebugString();
-    uint16_t id = msg.meta.app_id;
-    uint8_t sender = msg.meta.sender == Node::kEmpty ?
-                     van_->my_node().id : msg.meta.sender;
-    uint8_t recver = msg.meta.recver;
-    return (static_cast<uint64_t>(id) << 48) |
-        (static_cast<uint64_t>(sender) << 40) |
-        (static_cast<uint64_t>(recver) << 32) |
-        (msg.meta.timestamp << 1) | msg.meta.request;
+  /** \brief drop the messages to peer acknowledged, mu_ is held */
+  void Acknowledge(uint32_t ack, uint64_t sack, Peer* peer) {
+    for (; Before(peer->una, ack) && Before(peer->una, peer->next_seq); ++peer->una) {
+      peer->unacked.erase(peer->una);
+    }
+    for (uint32_t i = 0; sack; ++i, sack >>= 1) {
+      if (sack & 1) peer->unacked.erase(ack + i);
+    }
   }
-  Time Now() {
-    return std::chrono::duration_cast<Time>(
-        std::chrono::high_resolution_clock::now().time_since_epoch());
+
+  uint64_t Tick() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() / tick_ms_;
   }
 
   void Monitoring() {
-    while (!exit_) {
-      std::this_thread::sleep_for(Time(timeout_));
+    std::vector<Timer> expired;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lk(exit_mu_);
+        if (exit_cv_.wait_for(lk, std::chrono::milliseconds(tick_ms_),
+                              [this] { return exit_; })) break;
+      }
       std::vector<Message> resend;
-      Time now = Now();
+      uint64_t now = Tick();
       mu_.lock();
-      for (auto& it : send_buff_) {
-        if (it.second.send + Time(timeout_) * (1+it.second.num_retry) < now) {
-          resend.push_back(it.second.msg);
-          ++it.second.num_retry;
-          LOG(WARNING) << van_->my_node().ShortDebugString()
-                       << ": Timeout to get the ACK message. Resend (retry="
-                       << it.second.num_retry << ") " << it.second.msg.DebugString();
-          CHECK_LT(it.second.num_retry, max_num_retry_);
+      expired.clear();
+      wheel_.Advance(now, &expired);
+      for (const auto& t : expired) {
+        auto peer = peers_.find(t.recver);
+        if (peer == peers_.end()) continue;
+        auto it = peer->second.unacked.find(t.seq);
+        // acknowledged
+        if (it == peer->second.unacked.end()) continue;
+        // beyond the window of the receiver, which drops it till the ones
+        // before are acknowledged, so it is not lost
+        if (!Before(t.seq, peer->second.una + kWindow)) {
+          wheel_.Add(now + timeout_ticks_, t);
+          continue;
+        }
+        ++it->second.num_retry;
+        LOG(WARNING) << van_->my_node().ShortDebugString()
+                     << ": Timeout to get the ACK message. Resend (retry="
+                     << it->second.num_retry << ") " << it->second.msg.DebugString();
+        CHECK_LT(it->second.num_retry, max_num_retry_);
+        Stamp(t.recver, peer->second, &it->second.msg);
+        resend.push_back(it->second.msg);
+        wheel_.Add(now + timeout_ticks_, t);
+      }
+      // nothing is sent back for a tick
+      for (auto it = pending_acks_.begin(); it != pending_acks_.end();) {
+        if (it->second >= now) {
+          ++it;
+          continue;
         }
+        const Peer& peer = peers_[it->first];
+        Message ack;
+        ack.meta.recver = it->first;
+        ack.meta.control.cmd = Control::ACK;
+        ack.meta.ack = peer.next;
+        ack.meta.sack = peer.window;
+        resend.push_back(ack);
+        it = pending_acks_.erase(it);
       }
       mu_.unlock();
 
-      for (const auto& msg : resend) van_->Send(msg);
+      for (const auto& msg : resend) van_->SendRaw(msg);
     }
   }
   std::thread* monitor_;
-  std::unordered_set<uint64_t> acked_;
-  std::atomic<bool> exit_{false};
+  std::unordered_map<int, Peer> peers_;
+  /** \brief the nodes to acknowledge, with the tick since when */
+  std::unordered_map<int, uint64_t> pending_acks_;
+  TimingWheel<Timer> wheel_;
+  bool exit_ = false;
+  std::mutex exit_mu_;
+  std::condition_variable exit_cv_;
   std::mutex mu_;
   int timeout_;
   int max_num_retry_;
+  int tick_ms_;
+  uint64_t timeout_ticks_;
   Van* van_;
 };
 }  // namespace ps
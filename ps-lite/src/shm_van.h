@@ -0,0 +1,512 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_SHM_VAN_H_
+#define PS_SHM_VAN_H_
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+namespace ps {
+
+/**
+ * \brief a single-producer single-consumer byte ring in POSIX shared memory
+ *
+ * Positions only grow, the byte of position p is data[p % capacity]. Records
+ * are 8-byte aligned and never wrap: a record not fitting before the end is
+ * preceded by a padding record up to the end. Records are released out of
+ * order, head only passes the ones released.
+ */
+struct ShmRing {
+  static const uint64_t kMagic = 0x70736c6974657368ULL;
+  static const size_t kHeaderSize = 256;
+  /** \brief set last by the creator */
+  std::atomic<uint64_t> magic;
+  uint64_t capacity;
+  /** \brief the first byte not released by the consumer */
+  alignas(64) std::atomic<uint64_t> head;
+  /** \brief the first byte not written by the producer */
+  alignas(64) std::atomic<uint64_t> tail;
+  /** \brief the end of the records the consumer received */
+  alignas(64) std::atomic<uint64_t> received;
+  /** \brief set while the consumer sleeps, so the producer wakes it up */
+  std::atomic<uint32_t> sleeping;
+  /** \brief the messages too large for the ring the consumer received over ZMQ */
+  std::atomic<uint64_t> fallbacks;
+
+  char* data() { return reinterpret_cast<char*>(this) + kHeaderSize; }
+};
+static_assert(sizeof(ShmRing) <= ShmRing::kHeaderSize, "the header of ShmRing is too large");
+
+/**
+ * \brief the header of a record in a ring, followed by the sizes of the data,
+ * the meta, then the data, each 8-byte aligned
+ */
+struct ShmRecord {
+  static const uint32_t kPadding = 0xffffffff;
+  /** \brief the bytes of the record including this header */
+  uint32_t size;
+  /** \brief the bytes of the packed meta, kPadding for a padding record */
+  uint32_t meta_size;
+  uint32_t num_data;
+  uint32_t reserved;
+};
+
+/**
+ * \brief shared memory based Van for processes on the same machine
+ *
+ * Data messages between a worker and a server on the same host go through a
+ * ring per sender and receiver, created by the receiver. The payload is copied
+ * once into the ring by the sender, and the receiver passes slices of the ring
+ * to the customers as SArray without copying; the space is reused once they are
+ * released. Control messages, the scheduler and remote nodes use ZMQ, as does
+ * a message larger than a ring. It is sent once the receiver received what is
+ * in the ring, and the ring is not written again until the receiver got it, so
+ * it stays in order.
+ *
+ * A polling thread moves the messages of the rings into a queue and wakes up
+ * \ref RecvMsg through a pipe polled together with the ZMQ socket. Once the
+ * rings are idle it sleeps on a named semaphore the senders post.
+ */
+class ShmVan : public ZMQVan {
+ public:
+  ShmVan() {}
+  virtual ~ShmVan() {}
+
+ protected:
+  void Start(int customer_id) override {
+    start_mu_.lock();
+    if (wake_[0] < 0) {
+      CHECK_EQ(pipe(wake_), 0) << strerror(errno);
+      fcntl(wake_[0], F_SETFL, O_NONBLOCK);
+      fcntl(wake_[1], F_SETFL, O_NONBLOCK);
+      capacity_ = GetEnv("PS_SHM_RING_SIZE", 64) * (1ULL << 20);
+      job_ = GetEnv("DMLC_PS_ROOT_PORT", 0);
+    }
+    start_mu_.unlock();
+    ZMQVan::Start(customer_id);
+  }
+
+  void Stop() override {
+    ZMQVan::Stop();
+    if (wake_[0] < 0) return;
+    if (poll_thread_) {
+      polling_ = false;
+      sem_post(sem_);
+      poll_thread_->join();
+      poll_thread_.reset();
+      sem_close(sem_);
+      sem_unlink(sem_name_.c_str());
+      sem_ = nullptr;
+    }
+    // the inbound rings stay mapped, customers may still hold their data
+    for (auto& in : inbound_) shm_unlink(in->name.c_str());
+    inbound_.clear();
+    for (auto& out : outbound_) {
+      if (out.second->ring) munmap(out.second->ring, out.second->bytes);
+      if (out.second->sem) sem_close(out.second->sem);
+    }
+    outbound_.clear();
+    close(wake_[0]);
+    close(wake_[1]);
+    wake_[0] = wake_[1] = -1;
+  }
+
+  // the ring from a node is created when connecting to it
+  bool CanConnectLazily() override { return false; }
+
+  void Connect(const Node& node) override {
+    ZMQVan::Connect(node);
+    if (!Local(node)) return;
+    // the ring from node to me, the ring from me to node is opened on the first
+    // send. the semaphore the senders wake me up with exists before any ring
+    std::lock_guard<std::mutex> lk(inbound_mu_);
+    if (!sem_) {
+      sem_name_ = SemName(my_node_.id);
+      sem_unlink(sem_name_.c_str());
+      sem_ = sem_open(sem_name_.c_str(), O_CREAT | O_EXCL, 0600, 0);
+      CHECK(sem_ != SEM_FAILED) << "failed to create " << sem_name_ << ": " << strerror(errno);
+      polling_ = true;
+      poll_thread_ = std::unique_ptr<std::thread>(
+          new std::thread(&ShmVan::Polling, this));
+    }
+    std::string name = RingName(node.id, my_node_.id);
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    CHECK_GE(fd, 0) << "failed to create " << name << ": " << strerror(errno);
+    size_t bytes = ShmRing::kHeaderSize + capacity_;
+    CHECK_EQ(ftruncate(fd, bytes), 0) << strerror(errno);
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(p != MAP_FAILED) << strerror(errno);
+    auto in = std::make_shared<Inbound>();
+    in->name = name;
+    in->sender = node.id;
+    in->ring = static_cast<ShmRing*>(p);
+    in->ring->capacity = capacity_;
+    in->ring->head.store(0);
+    in->ring->tail.store(0);
+    in->ring->received.store(0);
+    in->ring->sleeping.store(0);
+    in->ring->fallbacks.store(0);
+    in->ring->magic.store(ShmRing::kMagic, std::memory_order_release);
+    inbound_.push_back(in);
+    // the polling thread may sleep without watching the new ring
+    sem_post(sem_);
+    PS_VLOG(1) << "shared memory ring from node " << node.id;
+  }
+
+  int SendMsg(const Message& msg) override {
+    if (!msg.meta.control.empty()) return ZMQVan::SendMsg(msg);
+    Outbound* out = GetOutbound(msg.meta.recver);
+    if (!out) return ZMQVan::SendMsg(msg);
+    std::lock_guard<std::mutex> lk(out->mu);
+    if (!out->ring) Open(out, msg.meta.recver);
+    ShmRing* ring = out->ring;
+
+    int meta_size; char* meta_buf;
+    PackMeta(msg.meta, &meta_buf, &meta_size);
+    size_t n = msg.data.size();
+    size_t size = Align(sizeof(ShmRecord) + n * sizeof(uint64_t)) + Align(meta_size);
+    for (const auto& d : msg.data) size += Align(d.size());
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (size > ring->capacity) {
+      // too large for the ring. over ZMQ once the receiver got the records
+      // before it
+      FreeMeta(meta_buf, meta_size);
+      for (int i = 0; ring->received.load(std::memory_order_acquire) != tail; ++i) Backoff(i);
+      ++out->fallbacks;
+      return ZMQVan::SendMsg(msg);
+    }
+    // and the next record waits until the receiver got it
+    for (int i = 0; ring->fallbacks.load(std::memory_order_acquire) < out->fallbacks; ++i) {
+      Backoff(i);
+    }
+
+    // wait for the space, and pad to the end if the record does not fit there
+    size_t offset = tail % ring->capacity;
+    size_t pad = offset + size > ring->capacity ? ring->capacity - offset : 0;
+    for (int i = 0; tail + pad + size - ring->head.load(std::memory_order_acquire) > ring->capacity; ++i) {
+      Backoff(i);
+    }
+    if (pad) {
+      ShmRecord* r = reinterpret_cast<ShmRecord*>(ring->data() + offset);
+      r->size = pad;
+      r->meta_size = ShmRecord::kPadding;
+      tail += pad;
+      offset = 0;
+    }
+
+    char* p = ring->data() + offset;
+    ShmRecord* r = reinterpret_cast<ShmRecord*>(p);
+    r->size = size;
+    r->meta_size = meta_size;
+    r->num_data = n;
+    uint64_t* sizes = reinterpret_cast<uint64_t*>(p + sizeof(ShmRecord));
+    p += Align(sizeof(ShmRecord) + n * sizeof(uint64_t));
+    memcpy(p, meta_buf, meta_size);
+    p += Align(meta_size);
+    FreeMeta(meta_buf, meta_size);
+    int send_bytes = meta_size;
+    for (size_t i = 0; i < n; ++i) {
+      sizes[i] = msg.data[i].size();
+      memcpy(p, msg.data[i].data(), sizes[i]);
+      p += Align(sizes[i]);
+      send_bytes += sizes[i];
+    }
+    ring->tail.store(tail + size, std::memory_order_seq_cst);
+    if (ring->sleeping.load(std::memory_order_seq_cst) && ring->sleeping.exchange(0)) {
+      sem_post(out->sem);
+    }
+    return send_bytes;
+  }
+
+  int RecvMsg(Message* msg) override {
+    zmq_pollitem_t items[2];
+    items[0].socket = receiver_;
+    items[0].events = ZMQ_POLLIN;
+    items[1].socket = nullptr;
+    items[1].fd = wake_[0];
+    items[1].events = ZMQ_POLLIN;
+    while (true) {
+      if (HasPending()) return RecvZMQ(msg);
+      // ZMQ first, a data message of a ring may wait for the customer a control
+      // message starts
+      items[0].revents = items[1].revents = 0;
+      int ready = zmq_poll(items, 1, 0);
+      if (ready == 0) {
+        Recved recved;
+        if (inbox_.TryPop(&recved)) {
+          recved.ring->received.store(recved.end, std::memory_order_release);
+          *msg = std::move(recved.msg);
+          return recved.bytes;
+        }
+        ready = zmq_poll(items, 2, -1);
+      }
+      if (ready == -1) {
+        if (errno == EINTR) continue;
+        LOG(WARNING) << "failed to poll. errno: " << errno << " " << zmq_strerror(errno);
+        return -1;
+      }
+      if (items[0].revents) return RecvZMQ(msg);
+      if (items[1].revents) {
+        waking_ = false;
+        char buf[64];
+        while (read(wake_[0], buf, sizeof(buf)) > 0) { }
+      }
+    }
+  }
+
+ private:
+  /** \brief a ring this process receives from */
+  struct Inbound {
+    std::string name;
+    int sender;
+    ShmRing* ring;
+    /** \brief the next position to read, ahead of head by the records in use */
+    uint64_t read = 0;
+    /** \brief start -> end of the records released out of order */
+    std::map<uint64_t, uint64_t> released;
+    std::mutex mu;
+
+    /** \brief release a record, and advance head over the released ones */
+    void Release(uint64_t start, uint64_t end) {
+      std::lock_guard<std::mutex> lk(mu);
+      released[start] = end;
+      uint64_t head = ring->head.load(std::memory_order_relaxed);
+      while (!released.empty() && released.begin()->first == head) {
+        head = released.begin()->second;
+        released.erase(released.begin());
+      }
+      ring->head.store(head, std::memory_order_release);
+    }
+  };
+
+  /** \brief a message read from a ring */
+  struct Recved {
+    Message msg;
+    int bytes = 0;
+    ShmRing* ring = nullptr;
+    /** \brief the end of its record in the ring */
+    uint64_t end = 0;
+  };
+
+  /** \brief a ring this process sends to */
+  struct Outbound {
+    ShmRing* ring = nullptr;
+    size_t bytes = 0;
+    /** \brief the messages too large for the ring sent over ZMQ */
+    uint64_t fallbacks = 0;
+    /** \brief the semaphore the receiver sleeps on */
+    sem_t* sem = nullptr;
+    std::mutex mu;
+  };
+
+  /**
+   * \brief receive over ZMQ, counting the data messages from a node with a
+   * ring, which were too large for it
+   */
+  int RecvZMQ(Message* msg) {
+    int recv_bytes = ZMQVan::RecvMsg(msg);
+    if (recv_bytes == -1 || !msg->meta.control.empty()) return recv_bytes;
+    std::lock_guard<std::mutex> lk(inbound_mu_);
+    for (auto& in : inbound_) {
+      if (in->sender == msg->meta.sender) {
+        in->ring->fallbacks.fetch_add(1, std::memory_order_release);
+        break;
+      }
+    }
+    return recv_bytes;
+  }
+
+  /**
+   * \brief the thread function moving the records of the inbound rings into
+   * \ref inbox_, spinning a while once they are empty before it sleeps
+   */
+  void Polling() {
+    int idle = 0;
+    while (polling_) {
+      std::vector<std::shared_ptr<Inbound>> rings;
+      {
+        std::lock_guard<std::mutex> lk(inbound_mu_);
+        rings = inbound_;
+      }
+      bool got = false;
+      for (auto& in : rings) {
+        while (Read(in)) got = true;
+      }
+      if (got) {
+        idle = 0;
+        if (!waking_.exchange(true)) {
+          char c = 0;
+          CHECK_EQ(write(wake_[1], &c, 1), 1);
+        }
+      } else if (idle < kSpin) {
+        std::this_thread::yield();
+        ++idle;
+      } else {
+        Sleep(rings);
+        idle = 0;
+      }
+    }
+  }
+
+  /**
+   * \brief wait on \ref sem_ until a sender writes to an empty ring, a ring is
+   * added or the van stops
+   */
+  void Sleep(const std::vector<std::shared_ptr<Inbound>>& rings) {
+    // a sender either sees the flag or wrote its record before we look
+    for (auto& in : rings) in->ring->sleeping.store(1, std::memory_order_seq_cst);
+    bool empty = true;
+    for (auto& in : rings) {
+      if (in->read != in->ring->tail.load(std::memory_order_seq_cst)) empty = false;
+    }
+    if (empty && polling_) {
+      while (sem_wait(sem_) != 0 && errno == EINTR) { }
+    }
+    for (auto& in : rings) in->ring->sleeping.store(0, std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief move one record of a ring into \ref inbox_
+   * \return false if the ring is empty
+   */
+  bool Read(const std::shared_ptr<Inbound>& in) {
+    ShmRing* ring = in->ring;
+    if (in->read == ring->tail.load(std::memory_order_acquire)) return false;
+    uint64_t start = in->read;
+    char* p = ring->data() + start % ring->capacity;
+    const ShmRecord* r = reinterpret_cast<const ShmRecord*>(p);
+    in->read += r->size;
+    if (r->meta_size == ShmRecord::kPadding) {
+      in->Release(start, in->read);
+      return true;
+    }
+
+    Recved recved;
+    recved.ring = ring;
+    recved.end = in->read;
+    Message* msg = &recved.msg;
+    const uint64_t* sizes = reinterpret_cast<const uint64_t*>(p + sizeof(ShmRecord));
+    p += Align(sizeof(ShmRecord) + r->num_data * sizeof(uint64_t));
+    UnpackMeta(p, r->meta_size, &msg->meta);
+    msg->meta.sender = in->sender;
+    msg->meta.recver = my_node_.id;
+    recved.bytes = r->meta_size;
+    p += Align(r->meta_size);
+    // the record is released once all its data are
+    uint64_t end = in->read;
+    std::shared_ptr<void> hold(nullptr, [in, start, end](void*) { in->Release(start, end); });
+    for (uint32_t i = 0; i < r->num_data; ++i) {
+      SArray<char> data;
+      data.reset(p, sizes[i], [hold](char*) { });
+      msg->data.push_back(data);
+      p += Align(sizes[i]);
+      recved.bytes += sizes[i];
+    }
+    inbox_.Push(std::move(recved));
+    return true;
+  }
+
+  /** \brief map the ring from me to node id, created by the node */
+  void Open(Outbound* out, int id) {
+    std::string name = RingName(my_node_.id, id);
+    int fd = -1;
+    for (int i = 0; (fd = shm_open(name.c_str(), O_RDWR, 0600)) < 0; ++i) {
+      CHECK_LT(i, 100000) << "failed to open " << name << ": " << strerror(errno);
+      Backoff(i);
+    }
+    struct stat st;
+    for (int i = 0; fstat(fd, &st) == 0 && (size_t)st.st_size < ShmRing::kHeaderSize; ++i) {
+      Backoff(i);
+    }
+    out->bytes = st.st_size;
+    void* p = mmap(nullptr, out->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(p != MAP_FAILED) << strerror(errno);
+    out->ring = static_cast<ShmRing*>(p);
+    for (int i = 0; out->ring->magic.load(std::memory_order_acquire) != ShmRing::kMagic; ++i) {
+      Backoff(i);
+    }
+    std::string sem_name = SemName(id);
+    out->sem = sem_open(sem_name.c_str(), 0);
+    CHECK(out->sem != SEM_FAILED) << "failed to open " << sem_name << ": " << strerror(errno);
+  }
+
+  /** \brief the outbound ring of node id, nullptr if it is not local */
+  Outbound* GetOutbound(int id) {
+    std::lock_guard<std::mutex> lk(outbound_mu_);
+    auto it = outbound_.find(id);
+    if (it != outbound_.end()) return it->second.get();
+    Outbound* out = nullptr;
+    if (local_.count(id)) {
+      out = new Outbound();
+      outbound_[id].reset(out);
+    }
+    return out;
+  }
+
+  /**
+   * \brief whether data messages to and from node go through shared memory,
+   * remembers the local nodes for \ref GetOutbound
+   */
+  bool Local(const Node& node) {
+    if (node.id == my_node_.id || node.id == Node::kEmpty || my_node_.id == Node::kEmpty) return false;
+    if (node.role == Node::SCHEDULER || my_node_.role == Node::SCHEDULER) return false;
+    if (node.role == my_node_.role) return false;
+    if (node.hostname != my_node_.hostname) return false;
+    std::lock_guard<std::mutex> lk(outbound_mu_);
+    local_.insert(node.id);
+    return true;
+  }
+
+  std::string RingName(int sender, int recver) {
+    return "/ps-" + std::to_string(job_) + "-" + std::to_string(sender) + "-" + std::to_string(recver);
+  }
+
+  std::string SemName(int recver) {
+    return "/ps-" + std::to_string(job_) + "-" + std::to_string(recver);
+  }
+
+  static size_t Align(size_t n) { return (n + 7) & ~static_cast<size_t>(7); }
+
+  /** \brief spin first, then sleep up to 100 microseconds */
+  static void Backoff(int i) {
+    if (i < 1000) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(i < 2000 ? 10 : 100));
+    }
+  }
+
+  /** \brief the times the polling thread yields before it sleeps */
+  static const int kSpin = 1000;
+  size_t capacity_ = 0;
+  int job_ = 0;
+  int wake_[2] = {-1, -1};
+  /** \brief whether a wake-up is in the pipe */
+  std::atomic<bool> waking_{false};
+  std::atomic<bool> polling_{false};
+  std::unique_ptr<std::thread> poll_thread_;
+  /** \brief the polling thread sleeps on it, created with the first ring */
+  sem_t* sem_ = nullptr;
+  std::string sem_name_;
+  std::mutex inbound_mu_;
+  std::vector<std::shared_ptr<Inbound>> inbound_;
+  std::mutex outbound_mu_;
+  std::unordered_map<int, std::unique_ptr<Outbound>> outbound_;
+  std::unordered_set<int> local_;
+  /** \brief the messages read from the rings */
+  SlabQueue<Recved> inbox_;
+};
+}  // namespace ps
+
+#endif  // PS_SHM_VAN_H_
@@ -0,0 +1,182 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_SLAB_H_
+#define PS_SLAB_H_
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+namespace ps {
+
+/**
+ * \brief the number of blocks the pools of this process took from the heap,
+ * reported per message with PS_ALLOC_STATS
+ */
+inline std::atomic<uint64_t>& PoolAllocs() {
+  static std::atomic<uint64_t> num{0};
+  return num;
+}
+
+/**
+ * \brief the number of operator new calls of this process, by anyone. only
+ * counted if built with COUNT_ALLOCS=1, which replaces the global operator
+ * new, see van.cc
+ */
+inline std::atomic<uint64_t>& HeapAllocs() {
+  static std::atomic<uint64_t> num{0};
+  return num;
+}
+
+/**
+ * \brief a pool of blocks of Size bytes
+ *
+ * Every thread allocates from and frees to its own free list without locking.
+ * A thread freeing more than it allocates, such as a thread releasing the
+ * received data, moves batches of blocks to a shared depot, where the threads
+ * allocating more take them from.
+ */
+template <size_t Size>
+class Slab {
+ public:
+  static void* Alloc() {
+    if (CacheDestroyed()) {
+      ++PoolAllocs();
+      return ::operator new(kBlockSize);
+    }
+    Cache& c = LocalCache();
+    if (!c.head) c.Refill();
+    if (c.head) {
+      Block* b = c.head;
+      c.head = b->next;
+      --c.count;
+      return b;
+    }
+    ++PoolAllocs();
+    return ::operator new(kBlockSize);
+  }
+
+  static void Free(void* p) {
+    if (CacheDestroyed()) {
+      ::operator delete(p);
+      return;
+    }
+    Cache& c = LocalCache();
+    Block* b = static_cast<Block*>(p);
+    b->next = c.head;
+    c.head = b;
+    if (++c.count >= 2 * kBatch) c.Flush();
+  }
+
+ private:
+  struct Block { Block* next; };
+  static const size_t kBlockSize = Size < sizeof(Block) ? sizeof(Block) : Size;
+  /** \brief the blocks moved between a thread and the depot at once */
+  static const size_t kBatch = 64;
+  /** \brief the batches kept in the depot, more are freed */
+  static const size_t kDepotSize = 256;
+
+  struct Depot {
+    Depot() { batches.reserve(kDepotSize); }
+    std::mutex mu;
+    std::vector<Block*> batches;
+  };
+
+  static Depot* GetDepot() {
+    static Depot* depot = new Depot();
+    return depot;
+  }
+
+  struct Cache {
+    Block* head = nullptr;
+    size_t count = 0;
+
+    ~Cache() {
+      while (count >= kBatch) Flush();
+      while (head) {
+        Block* b = head;
+        head = b->next;
+        ::operator delete(b);
+      }
+      count = 0;
+      // the destructors of the later thread_locals may still free blocks
+      CacheDestroyed() = true;
+    }
+
+    /** \brief take a batch from the depot */
+    void Refill() {
+      Depot* depot = GetDepot();
+      std::lock_guard<std::mutex> lk(depot->mu);
+      if (depot->batches.empty()) return;
+      head = depot->batches.back();
+      depot->batches.pop_back();
+      count = kBatch;
+    }
+
+    /** \brief move a batch to the depot */
+    void Flush() {
+      Block* batch = head;
+      Block* last = head;
+      for (size_t i = 1; i < kBatch; ++i) last = last->next;
+      head = last->next;
+      last->next = nullptr;
+      count -= kBatch;
+      Depot* depot = GetDepot();
+      {
+        std::lock_guard<std::mutex> lk(depot->mu);
+        if (depot->batches.size() < kDepotSize) {
+          depot->batches.push_back(batch);
+          return;
+        }
+      }
+      while (batch) {
+        Block* b = batch;
+        batch = b->next;
+        ::operator delete(b);
+      }
+    }
+  };
+
+  static Cache& LocalCache() {
+    static thread_local Cache cache;
+    return cache;
+  }
+
+  /** \brief whether the cache of this thread is destroyed, so the heap is used */
+  static bool& CacheDestroyed() {
+    static thread_local bool destroyed = false;
+    return destroyed;
+  }
+};
+
+/**
+ * \brief an allocator of single objects from \ref Slab, for the control
+ * blocks of shared_ptr
+ */
+template <typename T>
+struct SlabAllocator {
+  typedef T value_type;
+  SlabAllocator() {}
+  template <typename U>
+  SlabAllocator(const SlabAllocator<U>&) {}  // NOLINT(*)
+
+  T* allocate(size_t n) {
+    if (n == 1) return static_cast<T*>(Slab<sizeof(T)>::Alloc());
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (n == 1) {
+      Slab<sizeof(T)>::Free(p);
+    } else {
+      ::operator delete(p);
+    }
+  }
+};
+
+template <typename T, typename U>
+inline bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&) { return true; }
+template <typename T, typename U>
+inline bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&) { return false; }
+}  // namespace ps
+#endif  // PS_SLAB_H_
@@ -0,0 +1,570 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_TCP_VAN_H_
+#define PS_TCP_VAN_H_
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "ps/internal/threadsafe_queue.h"
+#include "./buffer_pool.h"
+namespace ps {
+
+/**
+ * \brief Van on plain TCP sockets
+ *
+ * A message is sent by one sendmsg of its header, meta and data, the data not
+ * copied, and with MSG_ZEROCOPY from PS_TCP_ZEROCOPY_BYTES bytes on, in which
+ * case the data is held until the kernel is done with it. One epoll thread
+ * reads all the connections, non-blocking, into buffers of \ref BufferPool
+ * given to the customers as they are, and releases the data of the zero-copy
+ * sends once their sockets report it done. A connection failing to send is
+ * closed and connected again on the next send.
+ */
+class TcpVan : public Van {
+ public:
+  TcpVan() {}
+  virtual ~TcpVan() {}
+
+ protected:
+  /** \brief the header of a message, followed by the data sizes, the meta and the data */
+  struct Header {
+    static const uint32_t kMagic = 0x50535450;  // "PTSP"
+    uint32_t magic;
+    int32_t sender;
+    uint32_t meta_size;
+    uint32_t num_data;
+  };
+
+  /** \brief the sending side of a connection */
+  struct Peer {
+    int fd = -1;
+    /** \brief the node connected to, to connect again after a failure */
+    Node node;
+    std::mutex mu;
+    bool zerocopy = false;
+    /** \brief the number of zero-copy sends so far */
+    uint32_t zc_sent = 0;
+    /** \brief the buffers of zero-copy sends and the number of the last send
+     * using them, until the kernel is done */
+    std::deque<std::pair<uint32_t, std::vector<SArray<char>>>> zc_pending;
+  };
+
+  void Start(int customer_id) override {
+    start_mu_.lock();
+    if (epoll_fd_ < 0) {
+      epoll_fd_ = epoll_create1(0);
+      CHECK_GE(epoll_fd_, 0) << strerror(errno);
+      wake_fd_ = eventfd(0, EFD_NONBLOCK);
+      CHECK_GE(wake_fd_, 0) << strerror(errno);
+      Watch(wake_fd_);
+      sndbuf_ = GetEnv("PS_TCP_SNDBUF", 0);
+      rcvbuf_ = GetEnv("PS_TCP_RCVBUF", 0);
+      nodelay_ = GetEnv("PS_TCP_NODELAY", 1);
+      zerocopy_bytes_ = GetEnv("PS_TCP_ZEROCOPY_BYTES", 1 << 16);
+    }
+    start_mu_.unlock();
+    Van::Start(customer_id);
+  }
+
+  void Stop() override {
+    PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
+    Van::Stop();
+    uint64_t one = 1;
+    CHECK_EQ(write(wake_fd_, &one, sizeof(one)), (ssize_t)sizeof(one));
+    if (poll_thread_) {
+      poll_thread_->join();
+      poll_thread_.reset();
+    }
+    for (auto& c : conns_) close(c.first);
+    conns_.clear();
+    // the kernel keeps the pages of the pending zero-copy sends
+    for (auto& it : senders_) Disconnect(it.second.get());
+    senders_.clear();
+    close(listen_fd_);
+    close(wake_fd_);
+    close(epoll_fd_);
+    listen_fd_ = wake_fd_ = epoll_fd_ = -1;
+  }
+
+  int Bind(const Node& node, int max_retry) override {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    CHECK_GE(listen_fd_, 0) << "create socket failed: " << strerror(errno);
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    int port = node.port;
+    unsigned seed = static_cast<unsigned>(time(NULL) + port);
+    for (int i = 0; i < max_retry + 1; ++i) {
+      sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      addr.sin_port = htons(port);
+      if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) break;
+      if (i == max_retry) {
+        return -1;
+      }
+      port = 10000 + rand_r(&seed) % 40000;
+    }
+    CHECK_EQ(listen(listen_fd_, 1024), 0) << strerror(errno);
+    Watch(listen_fd_);
+    poll_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&TcpVan::Polling, this));
+    return port;
+  }
+
+  void Connect(const Node& node) override {
+    CHECK_NE(node.id, node.kEmpty);
+    CHECK_NE(node.port, node.kEmpty);
+    CHECK(node.hostname.size());
+    Peer* peer = GetPeer(node.id, true);
+    std::lock_guard<std::mutex> lk(peer->mu);
+    Disconnect(peer);
+    // worker doesn't need to connect to the other workers, but its neighbors
+    // in the barrier tree. servers connect to each other
+    if (!NeedConnect(node)) {
+      return;
+    }
+    // the node may not listen yet
+    int retry = GetEnv("PS_TCP_CONNECT_RETRY", 600);
+    peer->node = node;
+    CHECK(Dial(peer, retry)) << "connect to " << node.hostname << ":" << node.port
+                             << " failed: " << strerror(errno);
+  }
+
+  bool CanConnectInParallel() override { return true; }
+
+  int SendMsg(const Message& msg) override {
+    int id = msg.meta.recver;
+    CHECK_NE(id, Meta::kEmpty);
+    Peer* peer = GetPeer(id, false);
+    if (!peer) {
+      LOG(WARNING) << "there is no socket to node " << id;
+      return -1;
+    }
+    std::lock_guard<std::mutex> lk(peer->mu);
+    if (peer->fd < 0 && (peer->node.id == Node::kEmpty || !Dial(peer, 0))) {
+      LOG(WARNING) << "there is no socket to node " << id;
+      return -1;
+    }
+
+    // the header, the sizes and the meta in one buffer
+    int meta_size; char* meta_buf;
+    PackMeta(msg.meta, &meta_buf, &meta_size);
+    size_t n = msg.data.size();
+    size_t head_size = sizeof(Header) + n * sizeof(uint64_t) + meta_size;
+    SArray<char> head = BufferPool::Get()->Alloc(head_size);
+    Header* header = reinterpret_cast<Header*>(head.data());
+    header->magic = Header::kMagic;
+    header->sender = my_node_.id;
+    header->meta_size = meta_size;
+    header->num_data = n;
+    uint64_t* sizes = reinterpret_cast<uint64_t*>(head.data() + sizeof(Header));
+    size_t data_size = 0;
+    for (size_t i = 0; i < n; ++i) {
+      sizes[i] = msg.data[i].size();
+      data_size += sizes[i];
+    }
+    memcpy(head.data() + sizeof(Header) + n * sizeof(uint64_t), meta_buf, meta_size);
+    FreeMeta(meta_buf, meta_size);
+
+    std::vector<iovec> iov;
+    iov.reserve(n + 1);
+    iov.push_back(iovec{head.data(), head_size});
+    for (const auto& d : msg.data) {
+      if (d.size()) iov.push_back(iovec{const_cast<char*>(d.data()), d.size()});
+    }
+    int flags = MSG_NOSIGNAL;
+    bool zerocopy = false;
+#ifdef MSG_ZEROCOPY
+    zerocopy = peer->zerocopy && data_size >= zerocopy_bytes_;
+    if (zerocopy) flags |= MSG_ZEROCOPY;
+#endif
+    if (!SendAll(peer, &iov, flags)) {
+      // a part of the message may be sent, so the stream is lost
+      LOG(WARNING) << "failed to send message to node [" << id << "]: " << strerror(errno)
+                   << ", connecting again on the next send";
+      Disconnect(peer);
+      return -1;
+    }
+    if (zerocopy) {
+      std::vector<SArray<char>> bufs(1, head);
+      bufs.insert(bufs.end(), msg.data.begin(), msg.data.end());
+      peer->zc_pending.push_back(std::make_pair(peer->zc_sent - 1, std::move(bufs)));
+    }
+    if (!peer->zc_pending.empty()) Reap(peer, false);
+    return head_size + data_size;
+  }
+
+  int RecvMsg(Message* msg) override {
+    std::pair<Message, int> recved;
+    recv_queue_.WaitAndPop(&recved);
+    *msg = std::move(recved.first);
+    return recved.second;
+  }
+
+ private:
+  /** \brief the receiving side of a connection, a message being read */
+  struct Conn {
+    enum Stage { HEADER, SIZES, META, DATA };
+    Stage stage = HEADER;
+    Header header;
+    std::vector<uint64_t> sizes;
+    std::vector<char> meta;
+    std::vector<SArray<char>> data;
+    /** \brief where the next bytes go and how many are missing */
+    char* ptr = nullptr;
+    size_t want = 0;
+    int recv_bytes = 0;
+  };
+
+  /**
+   * \brief connect peer to its node, trying retry more times 100ms apart. the
+   * lock of the peer is held
+   * \return false if failed
+   */
+  bool Dial(Peer* peer, int retry) {
+    const Node& node = peer->node;
+    addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(node.hostname.c_str(), std::to_string(node.port).c_str(), &hints, &res);
+    CHECK_EQ(rc, 0) << "failed to resolve " << node.hostname << ": " << gai_strerror(rc);
+    int fd = -1;
+    for (int i = 0; ; ++i) {
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      CHECK_GE(fd, 0) << strerror(errno);
+      if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) break;
+      int err = errno;
+      close(fd);
+      if (i >= retry) {
+        freeaddrinfo(res);
+        errno = err;
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    freeaddrinfo(res);
+    SetOptions(fd);
+#ifdef SO_ZEROCOPY
+    int one = 1;
+    peer->zerocopy = zerocopy_bytes_ > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    peer->fd = fd;
+    peer->zc_sent = 0;
+    // the completions of the zero-copy sends are reaped by the polling thread
+    if (peer->zerocopy) {
+      epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLERR | EPOLLET;
+      ev.data.u64 = kSenderTag | static_cast<uint32_t>(node.id);
+      CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev), 0) << strerror(errno);
+    }
+    return true;
+  }
+
+  /**
+   * \brief close the socket of peer if any, after the kernel is done with the
+   * zero-copy sends. the lock of the peer is held
+   */
+  void Disconnect(Peer* peer) {
+    if (peer->fd < 0) return;
+    Reap(peer, true);
+    // what is still pending only goes to a connection being dropped
+    peer->zc_pending.clear();
+    close(peer->fd);
+    peer->fd = -1;
+  }
+
+  /**
+   * \brief send all the iov, waiting while the socket is full. the lock of the
+   * peer is held
+   */
+  bool SendAll(Peer* peer, std::vector<iovec>* iov, int flags) {
+    msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    size_t first = 0;
+    while (first < iov->size()) {
+      hdr.msg_iov = iov->data() + first;
+      hdr.msg_iovlen = std::min<size_t>(iov->size() - first, IOV_MAX);
+      ssize_t sent = sendmsg(peer->fd, &hdr, flags);
+      if (sent < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          pollfd p{peer->fd, POLLOUT, 0};
+          poll(&p, 1, -1);
+          continue;
+        }
+#ifdef MSG_ZEROCOPY
+        if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+          // out of the locked memory allowed, copy instead
+          flags &= ~MSG_ZEROCOPY;
+          continue;
+        }
+#endif
+        return false;
+      }
+#ifdef MSG_ZEROCOPY
+      if (flags & MSG_ZEROCOPY) ++peer->zc_sent;
+#endif
+      // skip what was sent
+      while (sent > 0) {
+        iovec& v = (*iov)[first];
+        if ((size_t)sent >= v.iov_len) {
+          sent -= v.iov_len;
+          ++first;
+        } else {
+          v.iov_base = static_cast<char*>(v.iov_base) + sent;
+          v.iov_len -= sent;
+          sent = 0;
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * \brief release the buffers of the zero-copy sends the kernel is done with,
+   * waiting for all of them if wait. the lock of the peer is held
+   */
+  void Reap(Peer* peer, bool wait) {
+#ifdef MSG_ZEROCOPY
+    while (!peer->zc_pending.empty()) {
+      char control[128];
+      msghdr hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_control = control;
+      hdr.msg_controllen = sizeof(control);
+      if (recvmsg(peer->fd, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        if (errno == EINTR) continue;
+        if (!wait || (errno != EAGAIN && errno != EWOULDBLOCK)) return;
+        pollfd p{peer->fd, 0, 0};
+        if (poll(&p, 1, 1000) <= 0) return;
+        continue;
+      }
+      for (cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+        auto* err = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cm));
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+        // the sends numbered [ee_info, ee_data] are done
+        uint32_t done = err->ee_data;
+        while (!peer->zc_pending.empty() &&
+               static_cast<int32_t>(peer->zc_pending.front().first - done) <= 0) {
+          peer->zc_pending.pop_front();
+        }
+      }
+    }
+#endif
+  }
+
+  /** \brief the socket options of a connection */
+  void SetOptions(int fd) {
+    if (nodelay_) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (sndbuf_ > 0) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf_, sizeof(sndbuf_));
+    if (rcvbuf_ > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_, sizeof(rcvbuf_));
+  }
+
+  void Watch(int fd) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev), 0) << strerror(errno);
+  }
+
+  /**
+   * \brief the thread function accepting the connections and reading them,
+   * until \ref wake_fd_ is written
+   */
+  void Polling() {
+    epoll_event events[64];
+    // the senders with zero-copy sends done but busy sending when told
+    std::unordered_set<int> unreaped;
+    while (true) {
+      int n = epoll_wait(epoll_fd_, events, 64, unreaped.empty() ? -1 : 1);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        LOG(FATAL) << "epoll_wait failed: " << strerror(errno);
+      }
+      for (int i = 0; i < n; ++i) {
+        if (events[i].data.u64 & kSenderTag) {
+          unreaped.insert(static_cast<int>(events[i].data.u64 & 0xffffffff));
+        }
+      }
+      // not waiting for the lock, its holder may wait for the receiver to read
+      // which may wait for us to read
+      for (auto it = unreaped.begin(); it != unreaped.end(); ) {
+        Peer* peer = GetPeer(*it, false);
+        if (peer && !peer->mu.try_lock()) {
+          ++it;
+          continue;
+        }
+        if (peer) {
+          if (peer->fd >= 0) Reap(peer, false);
+          peer->mu.unlock();
+        }
+        it = unreaped.erase(it);
+      }
+      for (int i = 0; i < n; ++i) {
+        if (events[i].data.u64 & kSenderTag) continue;
+        int fd = events[i].data.fd;
+        if (fd == wake_fd_) return;
+        if (fd == listen_fd_) {
+          int c;
+          while ((c = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+            SetOptions(c);
+            Conn* conn = new Conn();
+            Expect(conn, Conn::HEADER);
+            conns_[c].reset(conn);
+            Watch(c);
+          }
+          continue;
+        }
+        auto it = conns_.find(fd);
+        if (it == conns_.end()) continue;
+        if (!Read(it->second.get(), fd)) {
+          epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+          close(fd);
+          conns_.erase(it);
+        }
+      }
+    }
+  }
+
+  /**
+   * \brief read a connection until it would block
+   * \return false if it is closed
+   */
+  bool Read(Conn* c, int fd) {
+    while (true) {
+      while (c->want == 0) Advance(c);
+      ssize_t r = recv(fd, c->ptr, c->want, 0);
+      if (r > 0) {
+        c->ptr += r;
+        c->want -= r;
+        c->recv_bytes += r;
+        continue;
+      }
+      if (r == 0) return false;
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      LOG(WARNING) << "failed to receive: " << strerror(errno);
+      return false;
+    }
+  }
+
+  /** \brief the next part of a message once a part is read */
+  void Advance(Conn* c) {
+    switch (c->stage) {
+      case Conn::HEADER:
+        CHECK_EQ(c->header.magic, Header::kMagic) << "corrupted message";
+        c->sizes.resize(c->header.num_data);
+        Expect(c, Conn::SIZES);
+        break;
+      case Conn::SIZES:
+        c->meta.resize(c->header.meta_size);
+        c->data.clear();
+        Expect(c, Conn::META);
+        break;
+      case Conn::META:
+      case Conn::DATA:
+        if (c->data.size() < c->sizes.size()) {
+          c->data.push_back(BufferPool::Get()->Alloc(c->sizes[c->data.size()]));
+          Expect(c, Conn::DATA);
+          break;
+        }
+        {
+          std::pair<Message, int> recved;
+          Message* msg = &recved.first;
+          UnpackMeta(c->meta.data(), c->meta.size(), &msg->meta);
+          msg->meta.sender = c->header.sender;
+          msg->meta.recver = my_node_.id;
+          msg->data = std::move(c->data);
+          recved.second = c->recv_bytes;
+          recv_queue_.Push(std::move(recved));
+        }
+        c->data.clear();
+        c->recv_bytes = 0;
+        Expect(c, Conn::HEADER);
+        break;
+    }
+  }
+
+  void Expect(Conn* c, Conn::Stage stage) {
+    c->stage = stage;
+    switch (stage) {
+      case Conn::HEADER:
+        c->ptr = reinterpret_cast<char*>(&c->header);
+        c->want = sizeof(Header);
+        break;
+      case Conn::SIZES:
+        c->ptr = reinterpret_cast<char*>(c->sizes.data());
+        c->want = c->sizes.size() * sizeof(uint64_t);
+        break;
+      case Conn::META:
+        c->ptr = c->meta.data();
+        c->want = c->meta.size();
+        break;
+      case Conn::DATA:
+        c->ptr = c->data.back().data();
+        c->want = c->data.back().size();
+        break;
+    }
+  }
+
+  /**
+   * \brief return the peer of node id, nullptr if not exists and not create
+   */
+  Peer* GetPeer(int id, bool create) {
+    std::lock_guard<std::mutex> lk(senders_mu_);
+    auto it = senders_.find(id);
+    if (it != senders_.end()) return it->second.get();
+    if (!create) return nullptr;
+    Peer* peer = new Peer();
+    senders_[id].reset(peer);
+    return peer;
+  }
+
+  /** \brief marks the epoll data of a sending socket, the rest is the node id */
+  static const uint64_t kSenderTag = 1ULL << 32;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  int listen_fd_ = -1;
+  int sndbuf_ = 0;
+  int rcvbuf_ = 0;
+  int nodelay_ = 1;
+  size_t zerocopy_bytes_ = 0;
+  std::unique_ptr<std::thread> poll_thread_;
+  /** \brief the accepted connections, only used by the polling thread */
+  std::unordered_map<int, std::unique_ptr<Conn>> conns_;
+  /** \brief node id to the peer for sending data to this node */
+  std::unordered_map<int, std::unique_ptr<Peer>> senders_;
+  std::mutex senders_mu_;
+  /** \brief the messages received and their sizes */
+  ThreadsafeQueue<std::pair<Message, int>> recv_queue_;
+};
+}  // namespace ps
+#endif  // __linux__
+#endif  // PS_TCP_VAN_H_
@@ -0,0 +1,92 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_TIMING_WHEEL_H_
+#define PS_TIMING_WHEEL_H_
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+namespace ps {
+
+/**
+ * \brief hierarchical timing wheel of items expiring at a tick
+ *
+ * Level l has 64 slots of 64^l ticks each. An item goes to the lowest level
+ * its expiration fits in and moves down a level whenever the wheel reaches its
+ * slot, so adding and expiring an item is O(1) whatever the number of items.
+ * An item cannot be removed, the owner ignores it on expiration instead. Not
+ * thread safe.
+ */
+template <typename T>
+class TimingWheel {
+ public:
+  /** \param now the current tick */
+  explicit TimingWheel(uint64_t now = 0) : now_(now) {}
+
+  /** \brief add an item expiring at tick, at the next tick if it is past */
+  void Add(uint64_t tick, const T& item) {
+    if (tick <= now_) tick = now_ + 1;
+    uint64_t delta = tick - now_;
+    int level = 0;
+    while (level < kLevels - 1 && (delta >> (kBits * (level + 1))) != 0) ++level;
+    uint64_t slot = tick;
+    if ((delta >> (kBits * (level + 1))) != 0) {
+      // beyond the wheel, in the last slot till it moves down and is added again
+      slot = now_ + (1ULL << (kBits * kLevels)) - 1;
+    }
+    slots_[level][(slot >> (kBits * level)) & kMask].push_back(Timer{tick, item});
+    ++size_;
+  }
+
+  /** \brief advance to tick, appending the items expired to expired */
+  void Advance(uint64_t tick, std::vector<T>* expired) {
+    while (now_ < tick) {
+      ++now_;
+      for (int level = kLevels - 1; level > 0; --level) {
+        if ((now_ & ((1ULL << (kBits * level)) - 1)) == 0) Cascade(level);
+      }
+      auto& slot = slots_[0][now_ & kMask];
+      for (auto& t : slot) expired->push_back(t.item);
+      size_ -= slot.size();
+      slot.clear();
+    }
+  }
+
+  /** \brief the current tick */
+  uint64_t now() const { return now_; }
+
+  /** \brief the number of items */
+  size_t size() const { return size_; }
+
+ private:
+  static const int kBits = 6;
+  static const uint64_t kMask = (1ULL << kBits) - 1;
+  static const int kLevels = 4;
+
+  struct Timer {
+    uint64_t tick;
+    T item;
+  };
+
+  /** \brief move the items of the current slot of level down */
+  void Cascade(int level) {
+    std::vector<Timer> timers;
+    timers.swap(slots_[level][(now_ >> (kBits * level)) & kMask]);
+    size_ -= timers.size();
+    for (const auto& t : timers) {
+      if (t.tick > now_) {
+        Add(t.tick, t.item);
+      } else {
+        // expires now, the slot of the tick is expired next
+        slots_[0][now_ & kMask].push_back(t);
+        ++size_;
+      }
+    }
+  }
+
+  std::vector<Timer> slots_[kLevels][kMask + 1];
+  uint64_t now_;
+  size_t size_ = 0;
+};
+}  // namespace ps
+#endif  // PS_TIMING_WHEEL_H_
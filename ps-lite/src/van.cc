@@ -3,6 +3,10 @@
  */
 
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
 #include <thread>
 
 #include "ps/base.h"
@@ -17,6 +21,24 @@
 #include "./resender.h"
 #include "./zmq_van.h"
 #include "./p3_van.h"
+#include "./shm_van.h"
+#include "./tcp_van.h"
+#include "./local_van.h"
+#include "./compressor.h"
+#include "./slab.h"
+
+#ifdef DMLC_COUNT_ALLOCS
+// count every heap allocation of the process for PS_ALLOC_STATS. new[] and the
+// nothrow and sized versions go through these two. delete is not inlined, or
+// gcc takes the free of a pointer from new as a mismatch
+void* operator new(std::size_t size) {
+  ++ps::HeapAllocs();
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+#endif  // DMLC_COUNT_ALLOCS
 
 namespace ps {
 
@@ -26,11 +48,24 @@ namespace ps {
 // problem.
 static const int kDefaultHeartbeatInterval = 0;
 
+static double Milliseconds(std::chrono::steady_clock::time_point begin,
+                           std::chrono::steady_clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
 Van* Van::Create(const std::string& type) {
   if (type == "zmq") {
     return new ZMQVan();
   } else if (type == "p3") {
     return new P3Van();
+  } else if (type == "shm") {
+    return new ShmVan();
+  } else if (type == "local") {
+    return new LocalVan();
+#ifdef __linux__
+  } else if (type == "tcp") {
+    return new TcpVan();
+#endif
 #ifdef DMLC_USE_IBVERBS
 } else if (type == "ibverbs") {
     return new IBVerbsVan();
@@ -53,6 +88,7 @@ void Van::ProcessAddNodeCommandAtScheduler(Message* msg, Meta* nodes,
   size_t num_nodes =
       Postoffice::Get()->num_servers() + Postoffice::Get()->num_workers();
   if (nodes->control.node.size() == num_nodes) {
+    std::vector<Node> to_connect;
     // sort the nodes according their ip and port,
     std::sort(nodes->control.node.begin(), nodes->control.node.end(),
               [](const Node& a, const Node& b) {
@@ -69,7 +105,7 @@ void Van::ProcessAddNodeCommandAtScheduler(Message* msg, Meta* nodes,
                      : Postoffice::WorkerRankToID(num_workers_);
         PS_VLOG(1) << "assign rank=" << id << " to node " << node.DebugString();
         node.id = id;
-        Connect(node);
+        to_connect.push_back(node);
         Postoffice::Get()->UpdateHeartbeat(node.id, t);
         connected_nodes_[node_host_ip] = id;
       } else {
@@ -82,27 +118,32 @@ void Van::ProcessAddNodeCommandAtScheduler(Message* msg, Meta* nodes,
       if (node.role == Node::SERVER) num_servers_++;
       if (node.role == Node::WORKER) num_workers_++;
     }
+    ConnectAll(to_connect);
     nodes->control.node.push_back(my_node_);
     nodes->control.cmd = Control::ADD_NODE;
     Message back;
     back.meta = *nodes;
-    for (int r : Postoffice::Get()->GetNodeIDs(kWorkerGroup + kServerGroup)) {
-      int recver_id = r;
-      if (shared_node_mapping_.find(r) == shared_node_mapping_.end()) {
-        back.meta.recver = recver_id;
-        back.meta.timestamp = timestamp_++;
-        Send(back);
-      }
+    // down the tree of the nodes, which pass it on
+    std::unordered_set<int> present;
+    for (const auto& node : nodes->control.node) present.insert(node.id);
+    std::vector<int> children;
+    TableChildren(my_node_.id, present, &children);
+    for (int r : children) {
+      back.meta.recver = r;
+      back.meta.timestamp = timestamp_++;
+      Send(back);
     }
     PS_VLOG(1) << "the scheduler is connected to " << num_workers_
                << " workers and " << num_servers_ << " servers";
-    ready_ = true;
+    SetReady();
   } else if (!recovery_nodes->control.node.empty()) {
     auto dead_nodes = Postoffice::Get()->GetDeadNodes(heartbeat_timeout_);
     std::unordered_set<int> dead_set(dead_nodes.begin(), dead_nodes.end());
     // send back the recovery node
     CHECK_EQ(recovery_nodes->control.node.size(), 1);
     Connect(recovery_nodes->control.node[0]);
+    // the restarted node counts the sequence numbers from the start again
+    if (resender_) resender_->Reset(recovery_nodes->control.node[0].id);
     Postoffice::Get()->UpdateHeartbeat(recovery_nodes->control.node[0].id, t);
     Message back;
     for (int r : Postoffice::Get()->GetNodeIDs(kWorkerGroup + kServerGroup)) {
@@ -190,34 +231,104 @@ void Van::ProcessHearbeat(Message* msg) {
 
 void Van::ProcessBarrierCommand(Message* msg) {
   auto& ctrl = msg->meta.control;
+  int group = ctrl.barrier_group;
+  const BarrierPlan& plan = GetBarrierPlan(group);
   if (msg->meta.request) {
-    if (barrier_count_.empty()) {
-      barrier_count_.resize(8, 0);
+    // from this node or a child, wait for the rest of the subtree
+    int count = ++barrier_count_[group];
+    PS_VLOG(1) << "Barrier count for " << group << " : " << count;
+    if (count < static_cast<int>(plan.children.size()) + plan.member) return;
+    barrier_count_[group] = 0;
+    int parent = BarrierParent(my_node_.id);
+    if (parent != Meta::kEmpty) {
+      Message req;
+      req.meta.recver = parent;
+      req.meta.request = true;
+      req.meta.app_id = msg->meta.app_id;
+      req.meta.customer_id = msg->meta.customer_id;
+      req.meta.control.cmd = Control::BARRIER;
+      req.meta.control.barrier_group = group;
+      req.meta.timestamp = timestamp_++;
+      Send(req);
+      return;
     }
-    int group = ctrl.barrier_group;
-    ++barrier_count_[group];
-    PS_VLOG(1) << "Barrier count for " << group << " : "
-               << barrier_count_[group];
-    if (barrier_count_[group] ==
-        static_cast<int>(Postoffice::Get()->GetNodeIDs(group).size())) {
-      barrier_count_[group] = 0;
-      Message res;
-      res.meta.request = false;
-      res.meta.app_id = msg->meta.app_id;
-      res.meta.customer_id = msg->meta.customer_id;
-      res.meta.control.cmd = Control::BARRIER;
-      for (int r : Postoffice::Get()->GetNodeIDs(group)) {
-        int recver_id = r;
-        if (shared_node_mapping_.find(r) == shared_node_mapping_.end()) {
-          res.meta.recver = recver_id;
-          res.meta.timestamp = timestamp_++;
-          Send(res);
-        }
-      }
+  }
+  // the whole tree is done, release the subtree
+  Message res;
+  res.meta.request = false;
+  res.meta.app_id = msg->meta.app_id;
+  res.meta.customer_id = msg->meta.customer_id;
+  res.meta.control.cmd = Control::BARRIER;
+  res.meta.control.barrier_group = group;
+  for (int r : plan.children) {
+    if (shared_node_mapping_.find(r) == shared_node_mapping_.end()) {
+      res.meta.recver = r;
+      res.meta.timestamp = timestamp_++;
+      Send(res);
     }
-  } else {
-    Postoffice::Get()->Manage(*msg);
   }
+  if (plan.member) Postoffice::Get()->Manage(res);
+}
+
+void Van::InitBarrierTree() {
+  if (!barrier_nodes_.empty()) return;
+  barrier_nodes_ = Postoffice::Get()->GetNodeIDs(
+      kScheduler + kServerGroup + kWorkerGroup);
+  std::sort(barrier_nodes_.begin(), barrier_nodes_.end());
+  int n = barrier_nodes_.size();
+  barrier_fanout_ = GetEnv("PS_BARRIER_FANOUT", 0);
+  if (barrier_fanout_ <= 0 || barrier_fanout_ > n - 1) barrier_fanout_ = std::max(n - 1, 1);
+}
+
+int Van::BarrierParent(int id) {
+  std::lock_guard<std::mutex> lk(barrier_mu_);
+  InitBarrierTree();
+  auto it = std::lower_bound(barrier_nodes_.begin(), barrier_nodes_.end(), id);
+  if (it == barrier_nodes_.end() || *it != id || it == barrier_nodes_.begin()) {
+    return Meta::kEmpty;
+  }
+  size_t i = it - barrier_nodes_.begin();
+  return barrier_nodes_[(i - 1) / barrier_fanout_];
+}
+
+const Van::BarrierPlan& Van::GetBarrierPlan(int group) {
+  std::lock_guard<std::mutex> lk(barrier_mu_);
+  InitBarrierTree();
+  auto it = barrier_plans_.find(group);
+  if (it != barrier_plans_.end()) return it->second;
+
+  // whether the subtree of every node has nodes of the group, bottom up
+  const auto& ids = Postoffice::Get()->GetNodeIDs(group);
+  std::unordered_set<int> members(ids.begin(), ids.end());
+  size_t n = barrier_nodes_.size(), k = barrier_fanout_;
+  std::vector<char> has(n, 0);
+  for (size_t i = n; i-- > 0; ) {
+    if (members.count(barrier_nodes_[i])) has[i] = 1;
+    if (has[i] && i > 0) has[(i - 1) / k] = 1;
+  }
+  BarrierPlan& plan = barrier_plans_[group];
+  size_t me = std::lower_bound(barrier_nodes_.begin(), barrier_nodes_.end(), my_node_.id) -
+              barrier_nodes_.begin();
+  plan.member = members.count(my_node_.id) > 0;
+  for (size_t c = me * k + 1; c <= me * k + k && c < n; ++c) {
+    if (has[c]) plan.children.push_back(barrier_nodes_[c]);
+  }
+  return plan;
+}
+
+int Van::BarrierEntry(int group) {
+  const BarrierPlan& plan = GetBarrierPlan(group);
+  int parent = BarrierParent(my_node_.id);
+  if (plan.children.empty() && parent != Meta::kEmpty) return parent;
+  return my_node_.id;
+}
+
+bool Van::NeedConnect(const Node& node) {
+  if (node.role != my_node_.role || node.id == my_node_.id) return true;
+  // partitions are moved and replicated between servers
+  if (node.role == Node::SERVER) return true;
+  // the barrier tree may link nodes of the same role
+  return BarrierParent(node.id) == my_node_.id || BarrierParent(my_node_.id) == node.id;
 }
 
 void Van::ProcessDataMsg(Message* msg) {
@@ -245,22 +356,42 @@ void Van::ProcessAddNodeCommand(Message* msg, Meta* nodes,
   if (is_scheduler_) {
     ProcessAddNodeCommandAtScheduler(msg, nodes, recovery_nodes);
   } else {
+    std::vector<Node> to_connect;
     for (const auto& node : ctrl.node) {
       std::string addr_str = node.hostname + ":" + std::to_string(node.port);
       if (connected_nodes_.find(addr_str) == connected_nodes_.end()) {
-        Connect(node);
+        to_connect.push_back(node);
         connected_nodes_[addr_str] = node.id;
       }
+      if (node.is_recovery && resender_ && node.id != my_node_.id) {
+        resender_->Reset(node.id);
+      }
       if (!node.is_recovery && node.role == Node::SERVER) ++num_servers_;
       if (!node.is_recovery && node.role == Node::WORKER) ++num_workers_;
     }
+    ConnectAll(to_connect);
+    if (!ready_ && !my_node_.is_recovery) {
+      // pass the node table on down the tree
+      std::unordered_set<int> present;
+      for (const auto& node : ctrl.node) present.insert(node.id);
+      std::vector<int> children;
+      TableChildren(my_node_.id, present, &children);
+      Message fwd;
+      fwd.meta.control = ctrl;
+      for (int r : children) {
+        fwd.meta.recver = r;
+        fwd.meta.timestamp = timestamp_++;
+        Send(fwd);
+      }
+    }
     PS_VLOG(1) << my_node_.ShortDebugString() << " is connected to others";
-    ready_ = true;
+    SetReady();
   }
 }
 
 void Van::Start(int customer_id) {
   // get scheduler info
+  auto start = std::chrono::steady_clock::now();
   start_mu_.lock();
 
   if (init_stage == 0) {
@@ -312,14 +443,20 @@ void Van::Start(int customer_id) {
 
     // connect to the scheduler
     Connect(scheduler_);
+    bind_ms_ = Milliseconds(start, std::chrono::steady_clock::now());
 
     // for debug use
     if (Environment::Get()->find("PS_DROP_MSG")) {
       drop_rate_ = atoi(Environment::Get()->find("PS_DROP_MSG"));
+      drop_seed_ = time(NULL) + my_node_.port;
     }
+    compressor_ = Compressor::Create();
+    alloc_stats_ = GetEnv("PS_ALLOC_STATS", 0);
+    lazy_connect_ = CanConnectLazily() && GetEnv("PS_LAZY_CONNECT", 0) != 0;
     // start receiver
     receiver_thread_ =
-        std::unique_ptr<std::thread>(new std::thread(&Van::Receiving, this));
+        std::unique_ptr<std::thread>(new std::thread(
+            Postoffice::Inherit(std::bind(&Van::Receiving, this))));
     init_stage++;
   }
   start_mu_.unlock();
@@ -337,32 +474,116 @@ void Van::Start(int customer_id) {
   }
 
   // wait until ready
-  while (!ready_.load()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  {
+    std::unique_lock<std::mutex> lk(ready_mu_);
+    ready_cv_.wait(lk, [this] { return ready_.load(); });
   }
+  auto registered = std::chrono::steady_clock::now();
 
   start_mu_.lock();
   if (init_stage == 1) {
-    // resender
-    if (Environment::Get()->find("PS_RESEND") &&
-        atoi(Environment::Get()->find("PS_RESEND")) != 0) {
-      int timeout = 1000;
-      if (Environment::Get()->find("PS_RESEND_TIMEOUT")) {
-        timeout = atoi(Environment::Get()->find("PS_RESEND_TIMEOUT"));
-      }
-      resender_ = new Resender(timeout, 10, this);
-    }
-
     if (!is_scheduler_) {
       // start heartbeat thread
       heartbeat_thread_ =
-          std::unique_ptr<std::thread>(new std::thread(&Van::Heartbeat, this));
+          std::unique_ptr<std::thread>(new std::thread(
+              Postoffice::Inherit(std::bind(&Van::Heartbeat, this))));
     }
+    PS_VLOG(1) << my_node_.ShortDebugString() << " started: bind " << bind_ms_
+               << " ms, register " << Milliseconds(start, registered) - bind_ms_
+               << " ms, of which connecting to " << num_connected_ << " nodes "
+               << connect_ms_ << " ms";
     init_stage++;
   }
   start_mu_.unlock();
 }
 
+void Van::SetReady() {
+  // the resender must be there before the first message numbered by another
+  // node, which is sent once that node is ready, maybe before Start returns
+  if (Environment::Get()->find("PS_RESEND") &&
+      atoi(Environment::Get()->find("PS_RESEND")) != 0 && !resender_) {
+    int timeout = 1000;
+    if (Environment::Get()->find("PS_RESEND_TIMEOUT")) {
+      timeout = atoi(Environment::Get()->find("PS_RESEND_TIMEOUT"));
+    }
+    resender_ = new Resender(timeout, 10, this);
+  }
+  {
+    std::lock_guard<std::mutex> lk(ready_mu_);
+    ready_ = true;
+  }
+  ready_cv_.notify_all();
+}
+
+void Van::ConnectAll(const std::vector<Node>& all) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<Node> nodes;
+  if (lazy_connect_) {
+    // only to myself now, to the others on the first send to them
+    std::lock_guard<std::mutex> lk(lazy_mu_);
+    for (const auto& node : all) {
+      if (node.id == my_node_.id) {
+        nodes.push_back(node);
+      } else {
+        lazy_nodes_[node.id] = node;
+      }
+    }
+    has_lazy_nodes_ = !lazy_nodes_.empty();
+  } else {
+    nodes = all;
+  }
+  size_t num_threads = CanConnectInParallel() ? GetEnv("PS_CONNECT_THREADS", 16) : 1;
+  num_threads = std::max<size_t>(1, std::min(num_threads, nodes.size()));
+  if (num_threads == 1) {
+    for (const auto& node : nodes) Connect(node);
+  } else {
+    // a connection may block until the node listens, connect in parallel
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t) {
+      threads.emplace_back(Postoffice::Inherit([this, &nodes, &next] {
+        for (size_t i = next++; i < nodes.size(); i = next++) Connect(nodes[i]);
+      }));
+    }
+    for (auto& t : threads) t.join();
+  }
+  num_connected_ += nodes.size();
+  connect_ms_ += Milliseconds(start, std::chrono::steady_clock::now());
+}
+
+void Van::ConnectLazily(int id) {
+  // held while connecting, so other sends to the node wait for it
+  std::lock_guard<std::mutex> lk(lazy_mu_);
+  auto it = lazy_nodes_.find(id);
+  if (it == lazy_nodes_.end()) return;
+  Connect(it->second);
+  lazy_nodes_.erase(it);
+  if (lazy_nodes_.empty()) has_lazy_nodes_ = false;
+}
+
+void Van::TableChildren(int id, const std::unordered_set<int>& present,
+                        std::vector<int>* children) {
+  std::vector<int> tree;
+  {
+    std::lock_guard<std::mutex> lk(barrier_mu_);
+    InitBarrierTree();
+    size_t i = std::lower_bound(barrier_nodes_.begin(), barrier_nodes_.end(), id) -
+               barrier_nodes_.begin();
+    size_t k = barrier_fanout_;
+    for (size_t c = i * k + 1; c <= i * k + k && c < barrier_nodes_.size(); ++c) {
+      tree.push_back(barrier_nodes_[c]);
+    }
+  }
+  for (int c : tree) {
+    // a node sharing the connection of another one is not in the table
+    if (present.count(c)) {
+      children->push_back(c);
+    } else {
+      TableChildren(c, present, children);
+    }
+  }
+}
+
 void Van::Stop() {
   // stop threads
   Message exit;
@@ -375,21 +596,45 @@ void Van::Stop() {
   receiver_thread_->join();
   init_stage = 0;
   if (!is_scheduler_) heartbeat_thread_->join();
-  if (resender_) delete resender_;
+  delete resender_;
+  resender_ = nullptr;
+  delete compressor_;
+  compressor_ = nullptr;
   ready_ = false;
   connected_nodes_.clear();
   shared_node_mapping_.clear();
+  connect_ms_ = 0;
+  num_connected_ = 0;
+  {
+    std::lock_guard<std::mutex> lk(lazy_mu_);
+    lazy_nodes_.clear();
+    has_lazy_nodes_ = false;
+  }
   send_bytes_ = 0;
   timestamp_ = 0;
   my_node_.id = Meta::kEmpty;
   barrier_count_.clear();
+  {
+    std::lock_guard<std::mutex> lk(barrier_mu_);
+    barrier_nodes_.clear();
+    barrier_plans_.clear();
+  }
 }
 
 int Van::Send(const Message& msg) {
+  bool compress = compressor_ && msg.meta.control.empty();
+  if (!compress && !resender_) return SendRaw(msg);
+  Message out = msg;
+  if (compress) compressor_->Compress(&out);
+  // the resender keeps the message till it is acknowledged
+  return resender_ ? resender_->Send(&out) : SendRaw(out);
+}
+
+int Van::SendRaw(const Message& msg) {
+  if (has_lazy_nodes_.load()) ConnectLazily(msg.meta.recver);
   int send_bytes = SendMsg(msg);
   CHECK_NE(send_bytes, -1);
   send_bytes_ += send_bytes;
-  if (resender_) resender_->AddOutgoing(msg);
   if (Postoffice::Get()->verbose() >= 2) {
     PS_VLOG(2) << msg.DebugString();
   }
@@ -404,10 +649,11 @@ void Van::Receiving() {
   while (true) {
     Message msg;
     int recv_bytes = RecvMsg(&msg);
-    // For debug, drop received message
-    if (ready_.load() && drop_rate_ > 0) {
-      unsigned seed = time(NULL) + my_node_.id;
-      if (rand_r(&seed) % 100 < drop_rate_) {
+    // For debug, drop received message. only the data messages the resender
+    // recovers and the ACK messages, so the nodes still start and stop
+    if (ready_.load() && drop_rate_ > 0 &&
+        ((msg.meta.seq && msg.meta.control.empty()) || msg.meta.control.cmd == Control::ACK)) {
+      if (rand_r(&drop_seed_) % 100 < drop_rate_) {
         LOG(WARNING) << "Drop message " << msg.DebugString();
         continue;
       }
@@ -415,6 +661,19 @@ void Van::Receiving() {
 
     CHECK_NE(recv_bytes, -1);
     recv_bytes_ += recv_bytes;
+    if (alloc_stats_ > 0 && ++num_recv_msgs_ % alloc_stats_ == 0) {
+      uint64_t allocs = HeapAllocs(), pool_allocs = PoolAllocs();
+      LOG(INFO) << my_node_.ShortDebugString() << ": "
+#ifdef DMLC_COUNT_ALLOCS
+                << static_cast<double>(allocs - last_heap_allocs_) / alloc_stats_
+                << " heap allocations per message received, "
+#endif  // DMLC_COUNT_ALLOCS
+                << static_cast<double>(pool_allocs - last_pool_allocs_) / alloc_stats_
+                << " by the pools per message received";
+      last_heap_allocs_ = allocs;
+      last_pool_allocs_ = pool_allocs;
+    }
+    if (!msg.meta.codec.empty()) Compressor::Decompress(&msg);
     if (Postoffice::Get()->verbose() >= 2) {
       PS_VLOG(2) << msg.DebugString();
     }
@@ -448,18 +707,22 @@ void Van::PackMetaPB(const Meta& meta, PBMeta* pb) {
   if (meta.timestamp != Meta::kEmpty) pb->set_timestamp(meta.timestamp);
   if (meta.body.size()) pb->set_body(meta.body);
   pb->set_push(meta.push);
+  pb->set_pull(meta.pull);
   pb->set_request(meta.request);
   pb->set_simple_app(meta.simple_app);
   pb->set_priority(meta.priority);
   pb->set_customer_id(meta.customer_id);
   for (auto d : meta.data_type) pb->add_data_type(d);
+  if (meta.seq) pb->set_seq(meta.seq);
+  if (meta.ack) {
+    pb->set_ack(meta.ack);
+    pb->set_sack(meta.sack);
+  }
   if (!meta.control.empty()) {
     auto ctrl = pb->mutable_control();
     ctrl->set_cmd(meta.control.cmd);
     if (meta.control.cmd == Control::BARRIER) {
       ctrl->set_barrier_group(meta.control.barrier_group);
-    } else if (meta.control.cmd == Control::ACK) {
-      ctrl->set_msg_sig(meta.control.msg_sig);
     }
     for (const auto& n : meta.control.node) {
       auto p = ctrl->add_node();
@@ -474,47 +737,147 @@ void Van::PackMetaPB(const Meta& meta, PBMeta* pb) {
   pb->set_data_size(meta.data_size);
 }
 
+namespace {
+/**
+ * \brief the header of a data message, followed by the data types, one byte
+ * each, the codecs of the data, one byte each if COMPRESSED, and the body. seq,
+ * ack and sack are the ones of \ref Meta with PS_RESEND, 0 otherwise
+ *
+ * A protobuf encoded meta starts with the tag of the head, 0x08, so the magic
+ * tells the two apart.
+ */
+struct RawMeta {
+  static const uint16_t kMagic = 0x5350;  // "PS"
+  static const uint8_t kVersion = 4;
+  enum Flag : uint8_t { REQUEST = 1, PUSH = 2, PULL = 4, SIMPLE_APP = 8, COMPRESSED = 16 };
+  uint16_t magic;
+  uint8_t version;
+  uint8_t flags;
+  uint32_t seq;
+  uint64_t sack;
+  uint32_t ack;
+  int32_t head;
+  int32_t app_id;
+  int32_t customer_id;
+  int32_t timestamp;
+  int32_t priority;
+  int32_t data_size;
+  uint32_t body_size;
+  uint32_t num_data;
+  int32_t slice_id;
+  int32_t slice_index;
+  int32_t num_slices;
+  int32_t slice_frame;
+};
+
+/** \brief meta buffers up to this size are recycled */
+const int kPooledMetaSize = 256;
+}  // namespace
+
+char* Van::AllocMeta(int size) {
+  if (size > kPooledMetaSize) return new char[size];
+  return static_cast<char*>(Slab<kPooledMetaSize>::Alloc());
+}
+
+void Van::FreeMeta(char* meta_buf, int buf_size) {
+  if (buf_size <= kPooledMetaSize) {
+    Slab<kPooledMetaSize>::Free(meta_buf);
+  } else {
+    delete[] meta_buf;
+  }
+}
+
 void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
-  // convert into protobuf
-  PBMeta pb;
-  pb.set_head(meta.head);
-  if (meta.app_id != Meta::kEmpty) pb.set_app_id(meta.app_id);
-  if (meta.timestamp != Meta::kEmpty) pb.set_timestamp(meta.timestamp);
-  if (meta.body.size()) pb.set_body(meta.body);
-  pb.set_push(meta.push);
-  pb.set_pull(meta.pull);
-  pb.set_request(meta.request);
-  pb.set_simple_app(meta.simple_app);
-  pb.set_priority(meta.priority);
-  pb.set_customer_id(meta.customer_id);
-  for (auto d : meta.data_type) pb.add_data_type(d);
-  if (!meta.control.empty()) {
-    auto ctrl = pb.mutable_control();
-    ctrl->set_cmd(meta.control.cmd);
-    if (meta.control.cmd == Control::BARRIER) {
-      ctrl->set_barrier_group(meta.control.barrier_group);
-    } else if (meta.control.cmd == Control::ACK) {
-      ctrl->set_msg_sig(meta.control.msg_sig);
-    }
-    for (const auto& n : meta.control.node) {
-      auto p = ctrl->add_node();
-      p->set_id(n.id);
-      p->set_role(n.role);
-      p->set_port(n.port);
-      p->set_hostname(n.hostname);
-      p->set_is_recovery(n.is_recovery);
-      p->set_customer_id(n.customer_id);
+  if (meta.control.empty()) {
+    // data message, encoded in place
+    size_t num_data = meta.data_type.size();
+    size_t num_codec = meta.codec.empty() ? 0 : num_data;
+    *buf_size = sizeof(RawMeta) + num_data + num_codec + meta.body.size();
+    *meta_buf = AllocMeta(*buf_size);
+    RawMeta* raw = reinterpret_cast<RawMeta*>(*meta_buf);
+    raw->magic = RawMeta::kMagic;
+    raw->version = RawMeta::kVersion;
+    raw->flags = (meta.request ? RawMeta::REQUEST : 0) |
+                 (meta.push ? RawMeta::PUSH : 0) |
+                 (meta.pull ? RawMeta::PULL : 0) |
+                 (meta.simple_app ? RawMeta::SIMPLE_APP : 0) |
+                 (num_codec ? RawMeta::COMPRESSED : 0);
+    raw->seq = meta.seq;
+    raw->sack = meta.sack;
+    raw->ack = meta.ack;
+    raw->head = meta.head;
+    raw->app_id = meta.app_id;
+    raw->customer_id = meta.customer_id;
+    raw->timestamp = meta.timestamp;
+    raw->priority = meta.priority;
+    raw->data_size = meta.data_size;
+    raw->body_size = meta.body.size();
+    raw->num_data = num_data;
+    raw->slice_id = meta.slice_id;
+    raw->slice_index = meta.slice_index;
+    raw->num_slices = meta.num_slices;
+    raw->slice_frame = meta.slice_frame;
+    char* p = *meta_buf + sizeof(RawMeta);
+    for (size_t i = 0; i < num_data; ++i) p[i] = static_cast<char>(meta.data_type[i]);
+    p += num_data;
+    if (num_codec) {
+      CHECK_EQ(meta.codec.size(), num_data);
+      memcpy(p, meta.codec.data(), num_codec);
+      p += num_codec;
     }
+    if (meta.body.size()) memcpy(p, meta.body.data(), meta.body.size());
+    return;
   }
 
+  // control message, convert into protobuf
+  PBMeta pb;
+  PackMetaPB(meta, &pb);
+
   // to string
   *buf_size = pb.ByteSize();
-  *meta_buf = new char[*buf_size + 1];
+  *meta_buf = AllocMeta(*buf_size);
   CHECK(pb.SerializeToArray(*meta_buf, *buf_size))
       << "failed to serialize protbuf";
 }
 
 void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
+  const RawMeta* raw = reinterpret_cast<const RawMeta*>(meta_buf);
+  if (buf_size >= static_cast<int>(sizeof(RawMeta)) && raw->magic == RawMeta::kMagic) {
+    CHECK_EQ(raw->version, RawMeta::kVersion) << "unsupported message version";
+    size_t num_codec = (raw->flags & RawMeta::COMPRESSED) ? raw->num_data : 0;
+    CHECK_EQ(static_cast<size_t>(buf_size),
+             sizeof(RawMeta) + raw->num_data + num_codec + raw->body_size)
+        << "corrupted message meta";
+    meta->seq = raw->seq;
+    meta->sack = raw->sack;
+    meta->ack = raw->ack;
+    meta->head = raw->head;
+    meta->app_id = raw->app_id;
+    meta->customer_id = raw->customer_id;
+    meta->timestamp = raw->timestamp;
+    meta->priority = raw->priority;
+    meta->data_size = raw->data_size;
+    meta->request = raw->flags & RawMeta::REQUEST;
+    meta->push = raw->flags & RawMeta::PUSH;
+    meta->pull = raw->flags & RawMeta::PULL;
+    meta->simple_app = raw->flags & RawMeta::SIMPLE_APP;
+    meta->slice_id = raw->slice_id;
+    meta->slice_index = raw->slice_index;
+    meta->num_slices = raw->num_slices;
+    meta->slice_frame = raw->slice_frame;
+    const char* p = meta_buf + sizeof(RawMeta);
+    meta->data_type.resize(raw->num_data);
+    for (uint32_t i = 0; i < raw->num_data; ++i) {
+      meta->data_type[i] = static_cast<DataType>(p[i]);
+    }
+    p += raw->num_data;
+    meta->codec.assign(p, p + num_codec);
+    meta->body.assign(p + num_codec, raw->body_size);
+    meta->control.cmd = Control::EMPTY;
+    meta->control.node.clear();
+    return;
+  }
+
   // to protobuf
   PBMeta pb;
   CHECK(pb.ParseFromArray(meta_buf, buf_size))
@@ -535,11 +898,14 @@ void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
   for (int i = 0; i < pb.data_type_size(); ++i) {
     meta->data_type[i] = static_cast<DataType>(pb.data_type(i));
   }
+  meta->codec.clear();
+  meta->seq = pb.seq();
+  meta->ack = pb.ack();
+  meta->sack = pb.sack();
   if (pb.has_control()) {
     const auto& ctrl = pb.control();
     meta->control.cmd = static_cast<Control::Command>(ctrl.cmd());
     meta->control.barrier_group = ctrl.barrier_group();
-    meta->control.msg_sig = ctrl.msg_sig();
     for (int i = 0; i < ctrl.node_size(); ++i) {
       const auto& p = ctrl.node(i);
       Node n;
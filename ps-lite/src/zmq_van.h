@@ -6,27 +6,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <zmq.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include "ps/internal/van.h"
+#include "ps/internal/mpsc_queue.h"
+#include "./slab.h"
 #if _MSC_VER
 #define rand_r(x) rand()
 #endif
 
 namespace ps {
+/** \brief a queue taking its nodes from the slabs, so a message pushed does
+ * not allocate */
+template <typename T> using SlabQueue = MPSCQueue<T, SlabAllocator<T>>;
+
 /**
- * \brief be smart on freeing recved data
+ * \brief the zmq deleter of a data sent, whose SArray is the hint
  */
 inline void FreeData(void *data, void *hint) {
-  if (hint == NULL) {
-    delete[] static_cast<char*>(data);
-  } else {
-    delete static_cast<SArray<char>*>(hint);
-  }
+  static_cast<SArray<char>*>(hint)->~SArray<char>();
+  Slab<sizeof(SArray<char>)>::Free(hint);
 }
 
 /**
  * \brief ZMQ based implementation
+ *
+ * Every peer has its own socket and lock, so sends to different nodes run in
+ * parallel and a peer with a full socket only blocks the sends to itself.
+ *
+ * If PS_ASYNC_SEND is set to be 1, application threads only push messages into
+ * the lock-free queue of the receiver, which a sender thread of that peer drains
+ * into its socket, so that many threads (and customers) of a process can submit
+ * requests concurrently. Messages to a peer are sent in the order they are
+ * queued.
  */
 class ZMQVan : public Van {
  public:
@@ -34,6 +51,35 @@ class ZMQVan : public Van {
   virtual ~ZMQVan() {}
 
  protected:
+  /**
+   * \brief the sending side of a connection
+   */
+  struct Peer {
+    /** \brief the DEALER socket connected to the node, owned by the lock holder */
+    void *socket = nullptr;
+    std::mutex mu;
+    /** \brief the messages to send if PS_ASYNC_SEND, in order */
+    SlabQueue<Message> queue;
+    /** \brief drains \ref queue if PS_ASYNC_SEND */
+    std::unique_ptr<std::thread> thread;
+    /** \brief the data messages held back to be sent as one batch */
+    std::vector<Message> batch;
+    /** \brief the bytes of \ref batch */
+    size_t batch_bytes = 0;
+    /** \brief when \ref batch is sent by the flusher at the latest */
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  /**
+   * \brief how the data messages of a priority are coalesced
+   */
+  struct Coalesce {
+    /** \brief a batch is sent once it has this many bytes, 0 to not coalesce */
+    size_t bytes;
+    /** \brief a batch is sent at most this many microseconds after its first message */
+    int usec;
+  };
+
   void Start(int customer_id) override {
     // start zmq
     start_mu_.lock();
@@ -41,24 +87,44 @@ class ZMQVan : public Van {
       context_ = zmq_ctx_new();
       CHECK(context_ != NULL) << "create 0mq context failed";
       zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
+      zmq_ctx_set(context_, ZMQ_IO_THREADS, GetEnv("PS_ZMQ_IO_THREADS", 1));
     }
+    async_send_ = UseAsyncSend();
     start_mu_.unlock();
-    // zmq_ctx_set(context_, ZMQ_IO_THREADS, 4);
     Van::Start(customer_id);
   }
 
   void Stop() override {
     PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
     Van::Stop();
+    // stop the senders after the messages queued before, then send the
+    // batches they left
+    for (auto& it : senders_) {
+      if (!it.second->thread) continue;
+      Message stop;
+      it.second->queue.Push(stop);
+      it.second->thread->join();
+    }
+    Flush();
+    if (flusher_thread_) {
+      {
+        std::lock_guard<std::mutex> lk(flush_mu_);
+        flushing_ = false;
+      }
+      flush_cv_.notify_all();
+      flusher_thread_->join();
+      flusher_thread_.reset();
+    }
     // close sockets
     int linger = 0;
     int rc = zmq_setsockopt(receiver_, ZMQ_LINGER, &linger, sizeof(linger));
     CHECK(rc == 0 || errno == ETERM);
     CHECK_EQ(zmq_close(receiver_), 0);
     for (auto& it : senders_) {
-      int rc = zmq_setsockopt(it.second, ZMQ_LINGER, &linger, sizeof(linger));
+      if (!it.second->socket) continue;
+      int rc = zmq_setsockopt(it.second->socket, ZMQ_LINGER, &linger, sizeof(linger));
       CHECK(rc == 0 || errno == ETERM);
-      CHECK_EQ(zmq_close(it.second), 0);
+      CHECK_EQ(zmq_close(it.second->socket), 0);
     }
     senders_.clear();
     zmq_ctx_destroy(context_);
@@ -95,12 +161,15 @@ class ZMQVan : public Van {
     CHECK_NE(node.port, node.kEmpty);
     CHECK(node.hostname.size());
     int id = node.id;
-    auto it = senders_.find(id);
-    if (it != senders_.end()) {
-      zmq_close(it->second);
+    Peer* peer = GetPeer(id, true);
+    std::lock_guard<std::mutex> lk(peer->mu);
+    if (peer->socket) {
+      zmq_close(peer->socket);
+      peer->socket = nullptr;
     }
-    // worker doesn't need to connect to the other workers. same for server
-    if ((node.role == my_node_.role) && (node.id != my_node_.id)) {
+    // worker doesn't need to connect to the other workers, but its neighbors
+    // in the barrier tree. servers connect to each other
+    if (!NeedConnect(node)) {
       return;
     }
     void *sender = zmq_socket(context_, ZMQ_DEALER);
@@ -125,29 +194,128 @@ class ZMQVan : public Van {
     if (zmq_connect(sender, addr.c_str()) != 0) {
       LOG(FATAL) <<  "connect to " + addr + " failed: " + zmq_strerror(errno);
     }
-    senders_[id] = sender;
+    peer->socket = sender;
+    if (async_send_ && !peer->thread) {
+      peer->thread = std::unique_ptr<std::thread>(
+          new std::thread(&ZMQVan::Sending, this, peer));
+    }
+  }
+
+  bool CanConnectInParallel() override { return true; }
+
+  /**
+   * \brief whether to send through the sender threads of the peers
+   */
+  virtual bool UseAsyncSend() { return GetEnv("PS_ASYNC_SEND", 0) != 0; }
+
+  void Flush() override {
+    std::vector<Peer*> peers;
+    {
+      std::lock_guard<std::mutex> lk(senders_mu_);
+      for (auto& it : senders_) peers.push_back(it.second.get());
+    }
+    for (Peer* peer : peers) {
+      std::lock_guard<std::mutex> lk(peer->mu);
+      SendBatch(peer);
+    }
   }
 
   int SendMsg(const Message& msg) override {
-    std::lock_guard<std::mutex> lk(mu_);
-    // find the socket
     int id = msg.meta.recver;
     CHECK_NE(id, Meta::kEmpty);
-    auto it = senders_.find(id);
-    if (it == senders_.end()) {
+    Peer* peer = GetPeer(id, false);
+    if (!peer) {
       LOG(WARNING) << "there is no socket to node " << id;
       return -1;
     }
-    void *socket = it->second;
+    if (!peer->thread) return SendMsgToSocket(peer, msg);
+    peer->queue.Push(msg);
+    return msg.meta.data_size;
+  }
 
+  /**
+   * \brief send a message through the socket of a peer, or add it to the batch
+   * of the peer if its priority is coalesced. threadsafe
+   * \return the number of bytes sent, -1 if failed
+   */
+  int SendMsgToSocket(Peer* peer, const Message& msg) {
+    std::lock_guard<std::mutex> lk(peer->mu);
+    if (!peer->socket) {
+      LOG(WARNING) << "there is no socket to node " << msg.meta.recver;
+      return -1;
+    }
+    Coalesce policy = {0, 0};
+    if (msg.meta.control.empty()) policy = GetCoalesce(msg.meta.priority);
+    if (!policy.bytes) {
+      // keep the order with the messages held back
+      if (SendBatch(peer) == -1) return -1;
+      return SendFrames(peer->socket, msg, false);
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(policy.usec);
+    if (peer->batch.empty() || deadline < peer->deadline) {
+      peer->deadline = deadline;
+      WakeFlusher(deadline);
+    }
+    peer->batch.push_back(msg);
+    int bytes = msg.meta.data_size + msg.meta.body.size();
+    peer->batch_bytes += bytes;
+    if (peer->batch_bytes >= policy.bytes && SendBatch(peer) == -1) return -1;
+    return bytes;
+  }
+
+  /**
+   * \brief send the batch of a peer as one message: a header with the number
+   * of frames of every message, then the frames of the messages. the lock of the
+   * peer is held
+   * \return the number of bytes sent, -1 if failed
+   */
+  int SendBatch(Peer* peer) {
+    if (peer->batch.empty()) return 0;
+    int num = peer->batch.size();
+    int header_size = (2 + num) * sizeof(uint32_t);
+    uint32_t* header = reinterpret_cast<uint32_t*>(AllocMeta(header_size));
+    header[0] = kBatchMagic;
+    header[1] = num;
+    for (int i = 0; i < num; ++i) header[2 + i] = 1 + peer->batch[i].data.size();
+    int send_bytes = header_size;
+    zmq_msg_t header_msg;
+    zmq_msg_init_data(&header_msg, header, header_size, FreeMetaData,
+                      reinterpret_cast<void*>(static_cast<intptr_t>(header_size)));
+    while (zmq_msg_send(&header_msg, peer->socket, ZMQ_SNDMORE) != header_size) {
+      if (errno == EINTR) continue;
+      peer->batch.clear();
+      peer->batch_bytes = 0;
+      return -1;
+    }
+    for (int i = 0; i < num; ++i) {
+      int bytes = SendFrames(peer->socket, peer->batch[i], i + 1 < num);
+      if (bytes == -1) {
+        send_bytes = -1;
+        break;
+      }
+      send_bytes += bytes;
+    }
+    peer->batch.clear();
+    peer->batch_bytes = 0;
+    return send_bytes;
+  }
+
+  /**
+   * \brief send the meta and the data of a message, followed by more frames if
+   * more
+   * \return the number of bytes sent, -1 if failed
+   */
+  int SendFrames(void* socket, const Message& msg, bool more) {
+    int id = msg.meta.recver;
     // send meta
     int meta_size; char* meta_buf;
     PackMeta(msg.meta, &meta_buf, &meta_size);
     int tag = ZMQ_SNDMORE;
     int n = msg.data.size();
-    if (n == 0) tag = 0;
+    if (n == 0 && !more) tag = 0;
     zmq_msg_t meta_msg;
-    zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeData, NULL);
+    zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeMetaData,
+                      reinterpret_cast<void*>(static_cast<intptr_t>(meta_size)));
     while (true) {
       if (zmq_msg_send(&meta_msg, socket, tag) == meta_size) break;
       if (errno == EINTR) continue;
@@ -158,10 +326,10 @@ class ZMQVan : public Van {
     // send data
     for (int i = 0; i < n; ++i) {
       zmq_msg_t data_msg;
-      SArray<char>* data = new SArray<char>(msg.data[i]);
+      SArray<char>* data = new (Slab<sizeof(SArray<char>)>::Alloc()) SArray<char>(msg.data[i]);
       int data_size = data->size();
       zmq_msg_init_data(&data_msg, data->data(), data->size(), FreeData, data);
-      if (i == n - 1) tag = 0;
+      if (i == n - 1 && !more) tag = 0;
       while (true) {
         if (zmq_msg_send(&data_msg, socket, tag) == data_size) break;
         if (errno == EINTR) continue;
@@ -177,11 +345,31 @@ class ZMQVan : public Van {
   }
 
   int RecvMsg(Message* msg) override {
-    msg->data.clear();
-    size_t recv_bytes = 0;
-    for (int i = 0; ; ++i) {
-      zmq_msg_t* zmsg = new zmq_msg_t;
-      CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
+    if (pending_.empty()) {
+      // reused, so no allocation in the steady state
+      int recv_bytes = RecvFrames(&frames_);
+      if (recv_bytes == -1) return -1;
+      unpacked_msgs_.clear();
+      Unpack(&frames_, &unpacked_msgs_);
+      for (auto& recved : unpacked_msgs_) pending_.push_back(std::move(recved));
+    }
+    *msg = std::move(pending_.front().first);
+    int recv_bytes = pending_.front().second;
+    pending_.pop_front();
+    return recv_bytes;
+  }
+
+  /** \brief whether \ref RecvMsg returns without reading the socket */
+  bool HasPending() const { return !pending_.empty(); }
+
+  /**
+   * \brief receive all the frames of one message from the receiver socket
+   * \return the number of bytes received, -1 if failed
+   */
+  int RecvFrames(std::vector<zmq_msg_t*>* frames) {
+    int recv_bytes = 0;
+    while (true) {
+      zmq_msg_t* zmsg = NewZmqMsg();
       while (true) {
         if (zmq_msg_recv(zmsg, receiver_, 0) != -1) break;
         if (errno == EINTR) {
@@ -190,43 +378,186 @@ class ZMQVan : public Van {
         }
         LOG(WARNING) << "failed to receive message. errno: "
                      << errno << " " << zmq_strerror(errno);
+        DeleteZmqMsg(zmsg);
+        for (auto f : *frames) DeleteZmqMsg(f);
+        frames->clear();
         return -1;
       }
-      char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
-      size_t size = zmq_msg_size(zmsg);
-      recv_bytes += size;
-
-      if (i == 0) {
-        // identify
-        msg->meta.sender = GetNodeID(buf, size);
-        msg->meta.recver = my_node_.id;
-        CHECK(zmq_msg_more(zmsg));
-        zmq_msg_close(zmsg);
-        delete zmsg;
-      } else if (i == 1) {
-        // task
-        UnpackMeta(buf, size, &(msg->meta));
-        zmq_msg_close(zmsg);
-        bool more = zmq_msg_more(zmsg);
-        delete zmsg;
-        if (!more) break;
-      } else {
-        // zero-copy
-        SArray<char> data;
-        data.reset(buf, size, [zmsg, size](char* buf) {
-          zmq_msg_close(zmsg);
-          delete zmsg;
-        });
-        msg->data.push_back(data);
-        if (!zmq_msg_more(zmsg)) {
-          break;
+      recv_bytes += zmq_msg_size(zmsg);
+      frames->push_back(zmsg);
+      if (!zmq_msg_more(zmsg)) break;
+    }
+    return recv_bytes;
+  }
+
+  /** \brief received messages and their sizes */
+  typedef std::vector<std::pair<Message, int>> Unpacked;
+
+  /**
+   * \brief build the messages of the frames received: the identity of the
+   * sender, then the meta and the data of a message, or a batch header and the
+   * metas and the data of its messages. the data is not copied
+   */
+  void Unpack(std::vector<zmq_msg_t*>* frames, Unpacked* msgs) {
+    CHECK_GE(frames->size(), 2U);
+    zmq_msg_t* zmsg = frames->at(0);
+    int sender = GetNodeID((char*)zmq_msg_data(zmsg), zmq_msg_size(zmsg));
+    DeleteZmqMsg(zmsg);
+
+    std::vector<uint32_t> num_frames;
+    size_t i = 1;
+    zmsg = frames->at(1);
+    const uint32_t* header = static_cast<const uint32_t*>(zmq_msg_data(zmsg));
+    if (zmq_msg_size(zmsg) >= 2 * sizeof(uint32_t) && header[0] == kBatchMagic) {
+      num_frames.assign(header + 2, header + 2 + header[1]);
+      DeleteZmqMsg(zmsg);
+      ++i;
+    } else {
+      num_frames.push_back(frames->size() - 1);
+    }
+
+    for (uint32_t n : num_frames) {
+      CHECK_LE(i + n, frames->size()) << "corrupted message batch";
+      std::pair<Message, int> recved;
+      Message* msg = &recved.first;
+      msg->meta.sender = sender;
+      msg->meta.recver = my_node_.id;
+      recved.second = 0;
+      for (size_t first = i; i < first + n; ++i) {
+        zmsg = frames->at(i);
+        char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
+        size_t size = zmq_msg_size(zmsg);
+        recved.second += size;
+        if (i == first) {
+          // task
+          UnpackMeta(buf, size, &(msg->meta));
+          DeleteZmqMsg(zmsg);
+        } else {
+          // zero-copy
+          SArray<char> data;
+          data.reset(buf, size, [zmsg](char* buf) { DeleteZmqMsg(zmsg); },
+                     SlabAllocator<char>());
+          msg->data.push_back(data);
         }
       }
+      msgs->push_back(std::move(recved));
     }
-    return recv_bytes;
+    frames->clear();
+  }
+
+  /** \brief a zmq message of the slab, initialized */
+  static zmq_msg_t* NewZmqMsg() {
+    zmq_msg_t* zmsg = static_cast<zmq_msg_t*>(Slab<sizeof(zmq_msg_t)>::Alloc());
+    CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
+    return zmsg;
+  }
+
+  static void DeleteZmqMsg(zmq_msg_t* zmsg) {
+    zmq_msg_close(zmsg);
+    Slab<sizeof(zmq_msg_t)>::Free(zmsg);
+  }
+
+  /** \brief the zmq deleter of a meta buffer, whose size is the hint */
+  static void FreeMetaData(void *data, void *hint) {
+    FreeMeta(static_cast<char*>(data), static_cast<int>(reinterpret_cast<intptr_t>(hint)));
   }
 
+  void *receiver_ = nullptr;
+
  private:
+  /**
+   * \brief the thread function draining the queue of a peer, until a message
+   * without receiver
+   */
+  void Sending(Peer* peer) {
+    while (true) {
+      Message msg;
+      peer->queue.WaitAndPop(&msg);
+      if (msg.meta.recver == Meta::kEmpty) break;
+      CHECK_NE(SendMsgToSocket(peer, msg), -1) << "failed to send " << msg.DebugString();
+    }
+  }
+
+  /**
+   * \brief the coalescing of a priority: PS_COALESCE_BYTES_<priority> and
+   * PS_COALESCE_USEC_<priority> if set, PS_COALESCE_BYTES and PS_COALESCE_USEC
+   * otherwise
+   */
+  Coalesce GetCoalesce(int priority) {
+    std::lock_guard<std::mutex> lk(coalesce_mu_);
+    auto it = coalesce_.find(priority);
+    if (it != coalesce_.end()) return it->second;
+    std::string p = std::to_string(priority);
+    Coalesce c;
+    c.bytes = GetEnv(("PS_COALESCE_BYTES_" + p).c_str(), GetEnv("PS_COALESCE_BYTES", 0));
+    c.usec = GetEnv(("PS_COALESCE_USEC_" + p).c_str(), GetEnv("PS_COALESCE_USEC", 100));
+    coalesce_[priority] = c;
+    return c;
+  }
+
+  /**
+   * \brief make the flusher wake up by deadline, starting it if not yet
+   */
+  void WakeFlusher(std::chrono::steady_clock::time_point deadline) {
+    std::lock_guard<std::mutex> lk(flush_mu_);
+    if (!flusher_thread_) {
+      flushing_ = true;
+      next_flush_ = deadline;
+      flusher_thread_ = std::unique_ptr<std::thread>(
+          new std::thread(&ZMQVan::Flushing, this));
+    } else if (deadline < next_flush_) {
+      next_flush_ = deadline;
+      flush_cv_.notify_one();
+    }
+  }
+
+  /**
+   * \brief the thread function sending the batches whose deadline passed
+   */
+  void Flushing() {
+    std::unique_lock<std::mutex> lk(flush_mu_);
+    while (flushing_) {
+      auto wake = next_flush_;
+      flush_cv_.wait_until(lk, wake);
+      if (!flushing_) break;
+      auto now = std::chrono::steady_clock::now();
+      if (now < next_flush_) continue;
+      // an hour is as good as never, WakeFlusher brings it forward
+      next_flush_ = now + std::chrono::hours(1);
+      lk.unlock();
+      std::vector<Peer*> peers;
+      {
+        std::lock_guard<std::mutex> lk2(senders_mu_);
+        for (auto& it : senders_) peers.push_back(it.second.get());
+      }
+      auto next = now + std::chrono::hours(1);
+      for (Peer* peer : peers) {
+        std::lock_guard<std::mutex> lk2(peer->mu);
+        if (peer->batch.empty()) continue;
+        if (peer->deadline <= now) {
+          SendBatch(peer);
+        } else if (peer->deadline < next) {
+          next = peer->deadline;
+        }
+      }
+      lk.lock();
+      if (next < next_flush_) next_flush_ = next;
+    }
+  }
+
+  /**
+   * \brief return the peer of node id, nullptr if not exists and not create
+   */
+  Peer* GetPeer(int id, bool create) {
+    std::lock_guard<std::mutex> lk(senders_mu_);
+    auto it = senders_.find(id);
+    if (it != senders_.end()) return it->second.get();
+    if (!create) return nullptr;
+    Peer* peer = new Peer();
+    senders_[id].reset(peer);
+    return peer;
+  }
+
   /**
    * return the node id given the received identity
    * \return -1 if not find
@@ -249,11 +580,32 @@ class ZMQVan : public Van {
 
   void *context_ = nullptr;
   /**
-   * \brief node_id to the socket for sending data to this node
+   * \brief node_id to the peer for sending data to this node. peers are only
+   * removed by Stop
    */
-  std::unordered_map<int, void*> senders_;
-  std::mutex mu_;
-  void *receiver_ = nullptr;
+  std::unordered_map<int, std::unique_ptr<Peer>> senders_;
+  /** \brief protects the map \ref senders_, not the peers */
+  std::mutex senders_mu_;
+  /** \brief whether messages are sent by the sender threads of the peers */
+  bool async_send_ = false;
+  /** \brief the messages of a batch not returned yet by \ref RecvMsg */
+  std::deque<std::pair<Message, int>> pending_;
+  /** \brief the frames and the messages of \ref RecvMsg, reused */
+  std::vector<zmq_msg_t*> frames_;
+  Unpacked unpacked_msgs_;
+
+  /** \brief the first word of the header of a batch, unlike a meta */
+  static const uint32_t kBatchMagic = 0x48435442;  // "BTCH"
+  /** \brief the coalescing of every priority seen, read from the environment */
+  std::unordered_map<int, Coalesce> coalesce_;
+  std::mutex coalesce_mu_;
+  /** \brief sends the batches whose deadline passed */
+  std::unique_ptr<std::thread> flusher_thread_;
+  std::mutex flush_mu_;
+  std::condition_variable flush_cv_;
+  bool flushing_ = false;
+  /** \brief when the flusher wakes up next */
+  std::chrono::steady_clock::time_point next_flush_;
 };
 }  // namespace ps
 
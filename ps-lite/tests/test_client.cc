@@ -0,0 +1,100 @@
+/**
+ * pulls single rows and batches of rows of a matrix from threads sharing the
+ * routing of one client, with all the nodes running as threads of this process
+ * over the local van
+ */
+#include <thread>
+#include "ps/ps.h"
+#include "psf/client/client.h"
+#include "psf/server/MatrixMetaService.h"
+using namespace ps;
+
+const int kRows = 8, kCols = 10;
+
+// GetRow of row of matrix
+ReqMatrixMeta RowOf(int matrixId, int row) {
+  return ReqMatrixMeta(psfType::GetRow, matrixId, matrixId, 0, 0, row, -1, -1, -1, -1, -1, -1, -1);
+}
+
+void RunNode(const std::string& role) {
+  Postoffice* po = Postoffice::Create({
+      {"DMLC_ROLE", role},
+      {"DMLC_NUM_WORKER", "1"},
+      {"DMLC_NUM_SERVER", "2"},
+      {"DMLC_PS_VAN_TYPE", "local"},
+      {"DMLC_PS_ROOT_URI", "127.0.0.1"},
+      {"DMLC_PS_ROOT_PORT", "8114"}});
+  Postoffice::SetCurrent(po);
+  Start(0);
+
+  if (IsScheduler()) {
+    MatrixMetaService service;
+    Finalize(0, true);
+  } else if (IsServer()) {
+    auto server = new KVServer<float>(0);
+    auto handle = std::make_shared<KVServerMLHandle<float>>();
+    server->set_request_handle([handle](const KVMeta& req_meta, const KVPairs<float>& req_data,
+                                        KVServer<float>* server) {
+        (*handle)(req_meta, req_data, server);
+      });
+    Finalize(0, true);
+    delete server;
+  } else {
+    // 2 x 4 blocks, 3 of them cover a row
+    Client<float> client(0, 0);
+    int id = client.CreateMatrix(MatrixContext("w", kRows, kCols, 2, 4));
+    std::vector<float> matrix(kRows * kCols);
+    for (int r = 0; r < kRows; ++r) {
+      for (int c = 0; c < kCols; ++c) matrix[r * kCols + c] = r * 100 + c;
+    }
+    client.Wait(client.Push(matrix, ServerMatrixMeta(psfType::PushAll, id, 0, 0, kRows, 0, kCols, -1)));
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; ++t) {
+      threads.emplace_back(Postoffice::Inherit([&client, id, t] {
+          Client<float> mine(0, 1 + t, client);
+          for (int i = 0; i < 50; ++i) {
+            int row = (i + t) % kRows;
+            std::vector<float> vals;
+            std::vector<int> lens;
+            mine.Wait(mine.Pull(vals, lens, RowOf(id, row)));
+            CHECK_EQ(vals.size(), kCols);
+            for (int c = 0; c < kCols; ++c) CHECK_EQ(vals[c], row * 100 + c);
+
+            // the distinct rows, ascending
+            vals.clear();
+            lens.clear();
+            mine.Wait(mine.PullRows(vals, lens, RowOf(id, -1), {6, 1, 5, 1}));
+            int rows[] = {1, 5, 6};
+            CHECK_EQ(vals.size(), 3 * kCols);
+            CHECK_EQ(lens.size(), 3 * 3);
+            for (int j = 0; j < 3; ++j) {
+              for (int c = 0; c < kCols; ++c) CHECK_EQ(vals[j * kCols + c], rows[j] * 100 + c);
+            }
+          }
+        }));
+    }
+    for (auto& t : threads) t.join();
+
+    std::vector<float> ones(kCols, 1);
+    client.Wait(client.Push(ones, ServerMatrixMeta(psfType::PushRow, id, 0, 0, kRows, 0, kCols, 3)));
+    std::vector<float> vals;
+    std::vector<int> lens;
+    client.Wait(client.Pull(vals, lens, RowOf(id, 3)));
+    for (int c = 0; c < kCols; ++c) CHECK_EQ(vals[c], 301 + c);
+    Finalize(0, true);
+  }
+
+  Postoffice::SetCurrent(nullptr);
+  delete po;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::thread> nodes;
+  for (const char* role : {"scheduler", "server", "server", "worker"}) {
+    nodes.emplace_back(RunNode, std::string(role));
+  }
+  for (auto& t : nodes) t.join();
+  LOG(INFO) << "client: passed";
+  return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * migrates a partition between servers over the p3 van while a worker pushes
+ * to it with mixed priorities, the state being sliced, and checks no push is
+ * lost. All the nodes run as threads of this process.
+ */
+#include <future>
+#include <sstream>
+#include <thread>
+#include "ps/ps.h"
+#include "psf/server/PartitionBalancer.h"
+using namespace ps;
+
+const int kRows = 256, kCols = 256, kPushes = 1000;
+
+std::promise<Key> allocated;
+std::promise<void> migrating, migrated;
+
+void RunNode(const std::string& role) {
+  Postoffice* po = Postoffice::Create({
+      {"DMLC_ROLE", role},
+      {"DMLC_NUM_WORKER", "1"},
+      {"DMLC_NUM_SERVER", "2"},
+      {"DMLC_PS_VAN_TYPE", "p3"},
+      {"DMLC_PS_ROOT_URI", "127.0.0.1"},
+      {"DMLC_PS_ROOT_PORT", "8113"},
+      {"DMLC_NODE_HOST", "127.0.0.1"},
+      // the state of the block is 64 slices, a pushed row is one
+      {"PS_P3_SLICE_BYTES", "4096"}});
+  Postoffice::SetCurrent(po);
+  Start(0);
+
+  if (IsScheduler()) {
+    Key key = allocated.get_future().get();
+    PartitionBalancer app(0, 0);
+    int ts = app.Request(balanceCmd::PartMigrate, "1 " + std::to_string(key),
+                         Postoffice::ServerRankToID(0));
+    migrating.set_value();
+    app.Wait(ts);
+    migrated.set_value();
+    Finalize(0, true);
+  } else if (IsServer()) {
+    auto server = new KVServer<float>(0);
+    auto handle = std::make_shared<KVServerMLHandle<float>>();
+    server->set_request_handle([handle](const KVMeta& req_meta, const KVPairs<float>& req_data,
+                                        KVServer<float>* server) {
+        (*handle)(req_meta, req_data, server);
+      });
+    server->SimpleApp::set_request_handle([handle, server](const SimpleData& req, SimpleApp* app) {
+        handle->Control(req, server);
+      });
+    Finalize(0, true);
+    delete server;
+  } else {
+    KVWorker<float> kv(0, 0);
+    Key key = po->GetKeyRouter()->KeyOfServer(0, 0);
+    std::vector<ServerMatrixMeta> metas = {
+      ServerMatrixMeta(psfType::PushAll, 0, 0, 0, kRows, 0, kCols, -1)};
+    kv.Wait(kv.Push({key}, {}, {0}, metas, metaCmd::MatrixAlloc));
+    allocated.set_value(key);
+
+    // a row of ones at a time while the block moves, most of them forwarded
+    // by server 0
+    migrating.get_future().wait();
+    std::vector<float> ones(kCols, 1);
+    std::vector<int> ts;
+    for (int i = 0; i < kPushes; ++i) {
+      std::vector<ServerMatrixMeta> row = {
+        ServerMatrixMeta(psfType::PushAll, 0, 0, 0, kRows, 0, kCols, i % kRows)};
+      ts.push_back(kv.Push({key}, ones, {kCols}, row, 0, nullptr, i % 3));
+    }
+    for (int t : ts) kv.Wait(t);
+    migrated.get_future().wait();
+
+    std::vector<float> vals;
+    std::vector<ReqMatrixMeta> req = {
+      ReqMatrixMeta(psfType::PullAll, 0, 0, key, key, -1, -1, -1, -1, -1, -1, -1, -1)};
+    kv.Wait(kv.Pull({key}, &vals, req));
+    CHECK_EQ(vals.size(), kRows * kCols);
+    for (int r = 0; r < kRows; ++r) {
+      float expect = kPushes / kRows + (r < kPushes % kRows);
+      for (int c = 0; c < kCols; ++c) CHECK_EQ(vals[r * kCols + c], expect) << r << " " << c;
+    }
+    Finalize(0, true);
+  }
+
+  Postoffice::SetCurrent(nullptr);
+  delete po;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::thread> nodes;
+  for (const char* role : {"scheduler", "server", "server", "worker"}) {
+    nodes.emplace_back(RunNode, std::string(role));
+  }
+  for (auto& t : nodes) t.join();
+  LOG(INFO) << "migrate a partition over p3 while pushing: passed";
+  return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * reports the blocks placed together as partners, replicates a partition to
+ * another server, then drops the replica, with all the nodes running as threads
+ * of this process over the local van
+ */
+#include <future>
+#include <map>
+#include <sstream>
+#include <thread>
+#include "ps/ps.h"
+#include "psf/server/PartitionBalancer.h"
+using namespace ps;
+
+std::promise<std::pair<Key, Key>> allocated;
+
+// partition -> its partners, from the statistics of a server
+std::map<Key, std::vector<Key>> Partners(const std::string& report) {
+  std::map<Key, std::vector<Key>> partners;
+  std::istringstream is(report);
+  Key key; uint64_t requests, bytes; int replica; size_t num;
+  while (is >> key >> requests >> bytes >> replica >> num) {
+    partners[key].resize(num);
+    for (size_t i = 0; i < num; ++i) is >> partners[key][i];
+  }
+  return partners;
+}
+
+void RunNode(const std::string& role) {
+  Postoffice* po = Postoffice::Create({
+      {"DMLC_ROLE", role},
+      {"DMLC_NUM_WORKER", "1"},
+      {"DMLC_NUM_SERVER", "2"},
+      {"DMLC_PS_VAN_TYPE", "local"},
+      {"DMLC_PS_ROOT_URI", "127.0.0.1"},
+      {"DMLC_PS_ROOT_PORT", "8111"}});
+  Postoffice::SetCurrent(po);
+  Start(0);
+
+  if (IsScheduler()) {
+    auto keys = allocated.get_future().get();
+    Key key = keys.first;
+    PartitionBalancer app(0, 0);
+    std::string report;
+    app.set_response_handle([&report](const SimpleData& res, SimpleApp* app) {
+        report = res.body;
+      });
+    // the blocks of the same index and shape stay together, before any binary op
+    app.Wait(app.Request(balanceCmd::PartStatsReq, "", Postoffice::ServerRankToID(0)));
+    auto partners = Partners(report);
+    CHECK_EQ(partners.size(), 2) << report;
+    CHECK(partners[key] == std::vector<Key>{keys.second}) << report;
+    CHECK(partners[keys.second] == std::vector<Key>{key}) << report;
+
+    std::ostringstream os;
+    os << key << " 1";
+    app.Wait(app.Request(balanceCmd::PartReplicate, os.str(), Postoffice::ServerRankToID(0)));
+    app.Wait(app.Request(balanceCmd::PartStatsReq, "", Postoffice::ServerRankToID(1)));
+    partners = Partners(report);
+    CHECK(partners.size() == 1 && partners.count(key)) << report;
+
+    app.Wait(app.Request(balanceCmd::PartUnreplicate, std::to_string(key),
+                         Postoffice::ServerRankToID(0)));
+    app.Wait(app.Request(balanceCmd::PartStatsReq, "", Postoffice::ServerRankToID(1)));
+    CHECK(report.empty()) << report;
+    app.Wait(app.Request(balanceCmd::PartStatsReq, "", Postoffice::ServerRankToID(0)));
+    CHECK(Partners(report).count(key)) << report;
+    Finalize(0, true);
+  } else if (IsServer()) {
+    auto server = new KVServer<float>(0);
+    auto handle = std::make_shared<KVServerMLHandle<float>>();
+    server->set_request_handle([handle](const KVMeta& req_meta, const KVPairs<float>& req_data,
+                                        KVServer<float>* server) {
+        (*handle)(req_meta, req_data, server);
+      });
+    server->SimpleApp::set_request_handle([handle, server](const SimpleData& req, SimpleApp* app) {
+        handle->Control(req, server);
+      });
+    Finalize(0, true);
+    handle->StopSync();
+    delete server;
+  } else {
+    KVWorker<float> kv(0, 0);
+    // block 0 of two matrices of the same shape
+    Key key = po->GetKeyRouter()->KeyOfServer(0, 0);
+    Key key2 = po->GetKeyRouter()->KeyOfServer(0, 1);
+    std::vector<ServerMatrixMeta> metas = {ServerMatrixMeta(psfType::PushAll, 0, 0, 0, 4, 0, 8, -1),
+                                           ServerMatrixMeta(psfType::PushAll, 1, 0, 0, 4, 0, 8, -1)};
+    kv.Wait(kv.Push({key, key2}, {}, {0, 0}, metas, metaCmd::MatrixAlloc));
+    allocated.set_value(std::make_pair(key, key2));
+    Finalize(0, true);
+  }
+
+  Postoffice::SetCurrent(nullptr);
+  delete po;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::thread> nodes;
+  for (const char* role : {"scheduler", "server", "server", "worker"}) {
+    nodes.emplace_back(RunNode, std::string(role));
+  }
+  for (auto& t : nodes) t.join();
+  LOG(INFO) << "replicate and drop a partition: passed";
+  return 0;
+}
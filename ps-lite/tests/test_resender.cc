@@ -0,0 +1,112 @@
+/**
+ * the sequence numbers of the resender, and requests answered over the local
+ * van while the nodes drop a tenth of the messages they receive
+ */
+#include <thread>
+#include "ps/ps.h"
+#include "ps/internal/van.h"
+#include "resender.h"
+using namespace ps;
+
+// a message of sender numbered seq
+Message Numbered(int sender, uint32_t seq) {
+  Message msg;
+  msg.meta.sender = sender;
+  msg.meta.recver = 1;
+  msg.meta.seq = seq;
+  return msg;
+}
+
+void TestSequence() {
+  // across the wraparound
+  CHECK(Resender::Before(1, 2));
+  CHECK(!Resender::Before(2, 1));
+  CHECK(!Resender::Before(5, 5));
+  CHECK(Resender::Before(0xfffffff0u, 3));
+  CHECK(!Resender::Before(3, 0xfffffff0u));
+
+  // the monitor neither resends nor acknowledges within a tick of 10 seconds,
+  // so it needs no van
+  Resender resender(80000, 10, nullptr);
+  const int sender = 9;
+  // AddIncomming returns true for a message to drop
+  CHECK(!resender.AddIncomming(Numbered(sender, 1)));
+  CHECK(resender.AddIncomming(Numbered(sender, 1)));
+  // out of order within the window
+  CHECK(!resender.AddIncomming(Numbered(sender, 3)));
+  CHECK(resender.AddIncomming(Numbered(sender, 3)));
+  CHECK(!resender.AddIncomming(Numbered(sender, 2)));
+  CHECK(resender.AddIncomming(Numbered(sender, 2)));
+  // 4 is next, so the window ends before 4 + kWindow
+  CHECK(resender.AddIncomming(Numbered(sender, 4 + Resender::kWindow)));
+  CHECK(!resender.AddIncomming(Numbered(sender, 3 + Resender::kWindow)));
+  for (uint32_t seq = 4; seq < 3 + Resender::kWindow; ++seq) {
+    CHECK(!resender.AddIncomming(Numbered(sender, seq))) << seq;
+  }
+  // all received before 4 + kWindow now
+  CHECK(!resender.AddIncomming(Numbered(sender, 4 + Resender::kWindow)));
+  CHECK(resender.AddIncomming(Numbered(sender, 3 + Resender::kWindow)));
+  // a node not resending does not number its messages
+  CHECK(!resender.AddIncomming(Numbered(sender + 1, 0)));
+  CHECK(!resender.AddIncomming(Numbered(sender + 1, 0)));
+  // an ACK message is only for the resender
+  Message ack = Numbered(sender, 0);
+  ack.meta.control.cmd = Control::ACK;
+  CHECK(resender.AddIncomming(ack));
+}
+
+const int kRequests = 200;
+
+void RunNode(const std::string& role) {
+  Postoffice* po = Postoffice::Create({
+      {"DMLC_ROLE", role},
+      {"DMLC_NUM_WORKER", "1"},
+      {"DMLC_NUM_SERVER", "1"},
+      {"DMLC_PS_VAN_TYPE", "local"},
+      {"DMLC_PS_ROOT_URI", "127.0.0.1"},
+      {"DMLC_PS_ROOT_PORT", "8112"},
+      {"PS_RESEND", "1"},
+      {"PS_RESEND_TIMEOUT", "100"},
+      {"PS_DROP_MSG", "10"}});
+  Postoffice::SetCurrent(po);
+  Start(0);
+
+  if (IsServer()) {
+    SimpleApp app(0, 0);
+    app.set_request_handle([](const SimpleData& req, SimpleApp* app) {
+        app->Response(req, req.body);
+      });
+    Finalize(0, true);
+  } else if (IsWorker()) {
+    SimpleApp app(0, 0);
+    std::vector<int> responses(kRequests);
+    app.set_response_handle([&responses](const SimpleData& res, SimpleApp* app) {
+        ++responses[std::stoi(res.body)];
+      });
+    std::vector<int> ts;
+    for (int i = 0; i < kRequests; ++i) {
+      ts.push_back(app.Request(0, std::to_string(i), kServerGroup));
+    }
+    for (int t : ts) app.Wait(t);
+    // every request is answered once
+    for (int i = 0; i < kRequests; ++i) CHECK_EQ(responses[i], 1) << i;
+    Finalize(0, true);
+  } else {
+    Finalize(0, true);
+  }
+
+  Postoffice::SetCurrent(nullptr);
+  delete po;
+}
+
+int main(int argc, char *argv[]) {
+  TestSequence();
+
+  std::vector<std::thread> nodes;
+  for (const char* role : {"scheduler", "server", "worker"}) {
+    nodes.emplace_back(RunNode, std::string(role));
+  }
+  for (auto& t : nodes) t.join();
+  LOG(INFO) << "resender: passed";
+  return 0;
+}
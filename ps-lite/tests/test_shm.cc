@@ -0,0 +1,96 @@
+/**
+ * a worker and a server in two processes push through the shared memory ring
+ * of the shm van: the records wrap around the ring behind padding records, the
+ * server releases them out of order, a push larger than the ring goes over
+ * ZMQ, and the pauses let the polling thread sleep. Every push has to arrive
+ * once and in order.
+ */
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include "ps/ps.h"
+using namespace ps;
+
+const int kPushes = 600;
+// floats, the ring is 1MB
+const int kMaxLen = 30000, kLargeLen = 400000;
+
+int LenOf(int i) { return i == kPushes / 2 ? kLargeLen : 1 + i * 7919 % kMaxLen; }
+
+void RunNode(const std::string& role) {
+  Postoffice* po = Postoffice::Create({
+      {"DMLC_ROLE", role},
+      {"DMLC_NUM_WORKER", "1"},
+      {"DMLC_NUM_SERVER", "1"},
+      {"DMLC_PS_VAN_TYPE", "shm"},
+      {"DMLC_PS_ROOT_URI", "127.0.0.1"},
+      {"DMLC_PS_ROOT_PORT", "8115"},
+      {"DMLC_NODE_HOST", "127.0.0.1"},
+      {"PS_SHM_RING_SIZE", "1"}});
+  Postoffice::SetCurrent(po);
+  Start(0);
+
+  if (IsServer()) {
+    int next = 0;
+    std::vector<KVPairs<float>> held;
+    auto server = new KVServer<float>(0);
+    server->set_request_handle([&](const KVMeta& req_meta, const KVPairs<float>& req_data,
+                                   KVServer<float>* server) {
+        CHECK_EQ(req_data.vals.size(), LenOf(next));
+        for (float v : req_data.vals) CHECK_EQ(v, next);
+        ++next;
+        // keep 4 in the ring, then release them out of order. the space after
+        // the first one is only reused once it is released too
+        held.push_back(req_data);
+        if (held.size() == 4) {
+          for (int i : {2, 0, 3, 1}) held[i] = KVPairs<float>();
+          held.clear();
+        }
+        server->Response(req_meta);
+      });
+    Finalize(0, true);
+    CHECK_EQ(next, kPushes);
+    held.clear();
+    delete server;
+  } else if (IsWorker()) {
+    KVWorker<float> kv(0, 0);
+    Key key = po->GetKeyRouter()->KeyOfServer(0, 0);
+    std::vector<int> ts;
+    for (int i = 0; i < kPushes; ++i) {
+      int len = LenOf(i);
+      std::vector<ServerMatrixMeta> meta = {
+        ServerMatrixMeta(psfType::PushAll, 0, 0, 0, 1, 0, len, -1)};
+      ts.push_back(kv.Push({key}, std::vector<float>(len, i), {len}, meta));
+      if (i % 100 == 99) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    for (int t : ts) kv.Wait(t);
+    Finalize(0, true);
+  } else {
+    Finalize(0, true);
+  }
+
+  Postoffice::SetCurrent(nullptr);
+  delete po;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<pid_t> nodes;
+  for (const char* role : {"scheduler", "server", "worker"}) {
+    pid_t pid = fork();
+    CHECK_GE(pid, 0);
+    if (pid == 0) {
+      RunNode(role);
+      exit(0);
+    }
+    nodes.push_back(pid);
+  }
+  for (pid_t pid : nodes) {
+    int status;
+    CHECK_EQ(waitpid(pid, &status, 0), pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "node " << pid << " failed";
+  }
+  LOG(INFO) << "shm ring between two processes: passed";
+  return 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * blocks allocated by one thread and freed by another go back to the first
+ * one through the depot, and a block freed after the cache of the thread is
+ * destroyed goes to the heap
+ */
+#include <thread>
+#include "dmlc/logging.h"
+#include "slab.h"
+using namespace ps;
+
+typedef Slab<48> TestSlab;
+
+// destroyed after the cache of its thread, which it is constructed before
+struct LateFree {
+  void* block = nullptr;
+  ~LateFree() { if (block) TestSlab::Free(block); }
+};
+
+int main(int argc, char *argv[]) {
+  const int n = 64 * 64;
+  std::vector<void*> blocks(n);
+
+  // the producer allocates, the consumer frees, a few rounds
+  uint64_t heap = 0;
+  for (int round = 0; round < 4; ++round) {
+    std::thread producer([&blocks] {
+        for (auto& b : blocks) b = TestSlab::Alloc();
+      });
+    producer.join();
+    std::thread consumer([&blocks] {
+        for (auto b : blocks) TestSlab::Free(b);
+      });
+    consumer.join();
+    uint64_t allocs = PoolAllocs() - heap;
+    heap = PoolAllocs();
+    // the first round takes every block from the heap, the later ones reuse
+    // the blocks the consumer moved to the depot, but the last batch it kept
+    if (round == 0) {
+      CHECK_EQ(allocs, n);
+    } else {
+      CHECK_LE(allocs, 2 * 64) << "round " << round;
+    }
+  }
+
+  std::thread late([] {
+      static thread_local LateFree holder;
+      holder.block = TestSlab::Alloc();
+      TestSlab::Free(TestSlab::Alloc());
+    });
+  late.join();
+
+  LOG(INFO) << "slab: passed";
+  return 0;
+}
@@ -0,0 +1,86 @@
+/**
+ * requests echoed over the tcp van, and pushes of sizes around the zero-copy
+ * threshold whose buffers the polling thread releases. All the nodes run as
+ * threads of this process.
+ */
+#include <thread>
+#include "ps/ps.h"
+using namespace ps;
+
+const int kRequests = 200, kPushes = 300;
+// floats, the zero-copy threshold is 1024 of them
+const int kMaxLen = 4096;
+
+int LenOf(int i) { return 1 + i * 7919 % kMaxLen; }
+
+void RunNode(const std::string& role) {
+  Postoffice* po = Postoffice::Create({
+      {"DMLC_ROLE", role},
+      {"DMLC_NUM_WORKER", "1"},
+      {"DMLC_NUM_SERVER", "1"},
+      {"DMLC_PS_VAN_TYPE", "tcp"},
+      {"DMLC_PS_ROOT_URI", "127.0.0.1"},
+      {"DMLC_PS_ROOT_PORT", "8116"},
+      {"DMLC_NODE_HOST", "127.0.0.1"},
+      {"PS_TCP_ZEROCOPY_BYTES", "4096"}});
+  Postoffice::SetCurrent(po);
+  Start(0);
+
+  if (IsServer()) {
+    int next = 0;
+    auto server = new KVServer<float>(0);
+    server->set_request_handle([&next](const KVMeta& req_meta, const KVPairs<float>& req_data,
+                                       KVServer<float>* server) {
+        CHECK_EQ(req_data.vals.size(), LenOf(next));
+        for (float v : req_data.vals) CHECK_EQ(v, next);
+        ++next;
+        server->Response(req_meta);
+      });
+    server->SimpleApp::set_request_handle([](const SimpleData& req, SimpleApp* app) {
+        app->Response(req, req.body);
+      });
+    Finalize(0, true);
+    CHECK_EQ(next, kPushes);
+    delete server;
+  } else if (IsWorker()) {
+    SimpleApp app(0, 1);
+    std::vector<int> responses(kRequests);
+    app.set_response_handle([&responses](const SimpleData& res, SimpleApp* app) {
+        ++responses[std::stoi(res.body)];
+      });
+    std::vector<int> ts;
+    for (int i = 0; i < kRequests; ++i) {
+      ts.push_back(app.Request(0, std::to_string(i), kServerGroup));
+    }
+    for (int t : ts) app.Wait(t);
+    // every request is answered once
+    for (int i = 0; i < kRequests; ++i) CHECK_EQ(responses[i], 1) << i;
+
+    KVWorker<float> kv(0, 0);
+    Key key = po->GetKeyRouter()->KeyOfServer(0, 0);
+    ts.clear();
+    for (int i = 0; i < kPushes; ++i) {
+      int len = LenOf(i);
+      std::vector<ServerMatrixMeta> meta = {
+        ServerMatrixMeta(psfType::PushAll, 0, 0, 0, 1, 0, len, -1)};
+      ts.push_back(kv.Push({key}, std::vector<float>(len, i), {len}, meta));
+    }
+    for (int t : ts) kv.Wait(t);
+    Finalize(0, true);
+  } else {
+    Finalize(0, true);
+  }
+
+  Postoffice::SetCurrent(nullptr);
+  delete po;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::thread> nodes;
+  for (const char* role : {"scheduler", "server", "worker"}) {
+    nodes.emplace_back(RunNode, std::string(role));
+  }
+  for (auto& t : nodes) t.join();
+  LOG(INFO) << "round trips over the tcp van: passed";
+  return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * every item of the timing wheel expires at its tick, including the ones
+ * cascading down from the higher levels and the ones beyond the wheel
+ */
+#include <random>
+#include <vector>
+#include "dmlc/logging.h"
+#include "timing_wheel.h"
+using namespace ps;
+
+// advance one tick at a time, checking every item expires at its tick
+void Expire(TimingWheel<uint64_t>* wheel, uint64_t to) {
+  std::vector<uint64_t> expired;
+  while (wheel->now() < to) {
+    expired.clear();
+    wheel->Advance(wheel->now() + 1, &expired);
+    for (uint64_t tick : expired) CHECK_EQ(tick, wheel->now());
+  }
+}
+
+int main(int argc, char *argv[]) {
+  // the level boundaries are at 64, 64^2 and 64^3 ticks, the wheel spans 64^4
+  const uint64_t start = 60;
+  TimingWheel<uint64_t> wheel(start);
+  std::vector<uint64_t> ticks = {61, 63, 64, 65, 127, 128, 4095, 4096, 4097,
+                                 4096 + 64, 262143, 262144, 262145, 16777216,
+                                 16777216 + start, 16777216 + 4096 + 5};
+  for (uint64_t tick : ticks) wheel.Add(tick, tick);
+  CHECK_EQ(wheel.size(), ticks.size());
+  Expire(&wheel, ticks.back());
+  CHECK_EQ(wheel.size(), 0);
+
+  // a tick in the past expires at the next one
+  std::vector<uint64_t> expired;
+  wheel.Add(wheel.now() - 5, wheel.now() + 1);
+  wheel.Advance(wheel.now() + 1, &expired);
+  CHECK_EQ(expired.size(), 1);
+
+  // random ticks added while advancing by random steps
+  std::mt19937_64 rng(7);
+  for (int trial = 0; trial < 20; ++trial) {
+    TimingWheel<uint64_t> w(rng() % 1000000);
+    for (int step = 0; step < 1000; ++step) {
+      for (int i = 0; i < 4; ++i) {
+        uint64_t delta = rng() % 4 ? rng() % 200 : rng() % 300000;
+        w.Add(w.now() + 1 + delta, w.now() + 1 + delta);
+      }
+      uint64_t to = w.now() + 1 + rng() % 50;
+      expired.clear();
+      uint64_t from = w.now();
+      w.Advance(to, &expired);
+      for (uint64_t tick : expired) {
+        CHECK_GT(tick, from);
+        CHECK_LE(tick, to);
+      }
+    }
+    expired.clear();
+    w.Advance(w.now() + 400000, &expired);
+    CHECK_EQ(w.size(), 0);
+  }
+
+  LOG(INFO) << "timing wheel: passed";
+  return 0;
+}